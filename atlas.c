@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "atlas.h"
+#include "cache.h"
+#include "md5.h"
+#include "png.h"
+
+// Which tiles hold an icon, as a string of '1' and '0' stored in the atlas
+// itself so a cached atlas can be reused without decoding any icon
+#define ATLAS_TILES_KEY "ils::Tiles"
+#define ATLAS_MAX_TILES (PNG_TEXT_VALUE_MAX - 1)
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static bool render_atlas(const Atlas* atlas, const char* png_path, char* tiles) {
+    int rows = (atlas->count + atlas->columns - 1) / atlas->columns;
+    int width = atlas->columns * atlas->tile_size;
+    int height = rows * atlas->tile_size;
+
+    unsigned char* pixels = calloc((size_t)width * height, 4);
+    if (!pixels) return false;
+
+    for (int i = 0; i < atlas->count; i++) {
+        int icon_width, icon_height;
+        unsigned char* icon = png_read_rgba(atlas->paths[i], &icon_width, &icon_height);
+        tiles[i] = icon ? '1' : '0';
+        if (!icon) continue;
+
+        png_blit_scaled(pixels, width, (i % atlas->columns) * atlas->tile_size,
+                        (i / atlas->columns) * atlas->tile_size, atlas->tile_size, atlas->tile_size,
+                        icon, icon_width, icon_height);
+        free(icon);
+    }
+    tiles[atlas->count] = '\0';
+
+    PngTextField field = {.key = ATLAS_TILES_KEY};
+    snprintf(field.value, sizeof(field.value), "%s", tiles);
+
+    bool ok = png_write_rgba(png_path, pixels, width, height) && png_write_text(png_path, &field, 1);
+    free(pixels);
+    return ok;
+}
+
+static bool read_tiles(Atlas* atlas) {
+    PngTextField field = {.key = ATLAS_TILES_KEY};
+    if (!png_read_text(atlas->png_path, &field, 1) || !field.found ||
+        strlen(field.value) != (size_t)atlas->count) {
+        return false;
+    }
+    memcpy(atlas->tiles, field.value, atlas->count + 1);
+    return true;
+}
+
+bool atlas_build(Atlas* atlas, const char* const* paths, int count, int tile_size) {
+    memset(atlas, 0, sizeof(Atlas));
+    atlas->tile_size = tile_size;
+
+    const char** sorted = malloc((count ? count : 1) * sizeof(char*));
+    atlas->paths = malloc((count ? count : 1) * sizeof(char*));
+    if (!sorted || !atlas->paths) {
+        free(sorted);
+        return false;
+    }
+    memcpy(sorted, paths, count * sizeof(char*));
+    qsort(sorted, count, sizeof(char*), compare_paths);
+
+    size_t key_capacity = 32;
+    for (int i = 0; i < count && atlas->count < ATLAS_MAX_TILES; i++) {
+        if (i > 0 && strcmp(sorted[i - 1], sorted[i]) == 0) continue;
+
+        char* copy = strdup(sorted[i]);
+        if (!copy) break;
+        atlas->paths[atlas->count++] = copy;
+        key_capacity += strlen(copy) + 64;
+    }
+    free(sorted);
+    if (atlas->count == 0) return false;
+
+    // The key covers every icon's identity, so any changed icon means a new atlas
+    char* key = malloc(key_capacity);
+    if (!key) return false;
+    size_t key_length = sprintf(key, "%d", tile_size);
+
+    for (int i = 0; i < atlas->count; i++) {
+        struct stat st;
+        if (stat(atlas->paths[i], &st) != 0) {
+            free(key);
+            return false;
+        }
+        key_length += sprintf(key + key_length, "\n%s %lld %lld", atlas->paths[i],
+                              (long long)st.st_mtime, (long long)st.st_size);
+    }
+
+    char hex[MD5_HEX_LENGTH];
+    md5_hex(key, key_length, hex);
+    free(key);
+
+    char id[9];
+    memcpy(id, hex, 8);
+    id[8] = '\0';
+    atlas->image_id = (unsigned int)(strtoul(id, NULL, 16) & 0x7fffffff);
+    if (atlas->image_id == 0) atlas->image_id = 1;
+
+    // Square-ish grid
+    atlas->columns = 1;
+    while (atlas->columns * atlas->columns < atlas->count) atlas->columns++;
+    snprintf(atlas->png_path, sizeof(atlas->png_path), "%s/atlas_%s.png", cache_directory(), hex);
+
+    atlas->tiles = malloc(atlas->count + 1);
+    if (!atlas->tiles) return false;
+
+    if (cache_lookup(atlas->png_path) && read_tiles(atlas)) {
+        return true;
+    }
+
+    CacheFill fill;
+    if (!cache_begin_fill(atlas->png_path, &fill)) {
+        return read_tiles(atlas); // Built by a concurrent run meanwhile
+    }
+
+    bool rendered = render_atlas(atlas, fill.temp_path, atlas->tiles);
+    if (!cache_end_fill(atlas->png_path, &fill, rendered)) return false;
+
+    cache_filled(atlas->png_path);
+    return true;
+}
+
+// Tile index of an icon, or -1 when the atlas has no pixels for it
+int atlas_tile(const Atlas* atlas, const char* path) {
+    if (!atlas->tiles) return -1;
+
+    char* const* found = bsearch(&path, atlas->paths, atlas->count, sizeof(char*), compare_paths);
+    if (!found) return -1;
+
+    int index = (int)(found - atlas->paths);
+    return atlas->tiles[index] == '1' ? index : -1;
+}
+
+void atlas_free(Atlas* atlas) {
+    for (int i = 0; i < atlas->count; i++) {
+        free(atlas->paths[i]);
+    }
+    free(atlas->paths);
+    free(atlas->tiles);
+    memset(atlas, 0, sizeof(Atlas));
+}
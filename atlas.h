@@ -0,0 +1,26 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <stdbool.h>
+#include "config.h"
+
+// A sprite atlas packs every distinct icon of a listing into one PNG grid
+// of tile_size squares, so kitty gets a single upload per listing and each
+// cell is a placement of a source rectangle. Atlases are cached in the
+// icon cache under a key derived from the icon set (paths, mtimes, sizes).
+
+typedef struct {
+    char png_path[MAX_PATH_LENGTH];
+    unsigned int image_id;
+    int tile_size;
+    int columns;
+    int count;
+    char** paths;  // sorted, one per tile
+    char* tiles;   // '1' where the tile holds an icon
+} Atlas;
+
+bool atlas_build(Atlas* atlas, const char* const* paths, int count, int tile_size);
+int atlas_tile(const Atlas* atlas, const char* path);
+void atlas_free(Atlas* atlas);
+
+#endif
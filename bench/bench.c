@@ -0,0 +1,818 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "../png.h"
+
+// End-to-end benchmark for ils. Builds reproducible fixtures (directories
+// with a realistic extension mix and a synthetic freedesktop theme chain),
+// runs ils against them with cold and warm caches for each protocol, with
+// output going to a pty or /dev/null, and prints the results as JSON.
+// A protocol of "kitty:rgba" (or png, file) picks the kitty transfer
+// format, a "+daemon" suffix sends the listing through a resident
+// `ils --daemon`, and --display replays each pty run on the terminal running
+// the benchmark to time how long it takes to show it.
+
+#define FIXTURE_VERSION 1
+#define MAX_SIZES 8
+#define MAX_PROTOCOLS 8
+#define MAX_RUNS 256
+
+typedef struct {
+    const char* suffix;
+    int weight;
+    bool executable;
+    bool image;
+} FileKind;
+
+// Roughly a source checkout with some media and archives mixed in
+static const FileKind file_kinds[] = {
+    {".c", 14, false, false},
+    {".h", 10, false, false},
+    {".py", 8, false, false},
+    {".js", 6, false, false},
+    {".md", 5, false, false},
+    {".txt", 6, false, false},
+    {".json", 5, false, false},
+    {".yaml", 3, false, false},
+    {".sh", 3, true, false},
+    {".tar.gz", 2, false, false},
+    {".zip", 1, false, false},
+    {".pdf", 2, false, false},
+    {".png", 5, false, true},
+    {".jpg", 3, false, true},
+    {".svg", 2, false, true},
+    {"", 4, true, false},
+};
+
+static const char* base_names[] = {
+    "main", "util", "test", "data", "image", "report", "config", "build", "notes", "photo",
+};
+
+static const char* literal_names[] = {
+    "Makefile", "README", "LICENSE", "Dockerfile", "CMakeLists.txt", "configure",
+};
+
+// Icons ils actually asks for; the rest of the theme is filler
+static const char* theme_icon_names[] = {
+    "folder", "text-x-generic", "application-x-executable", "text-x-csrc", "text-x-chdr",
+    "text-x-python", "application-javascript", "text-x-javascript", "text-markdown",
+    "text-plain", "application-json", "application-x-yaml", "application-x-shellscript",
+    "application-x-compressed-tar", "application-zip", "application-pdf", "image-png",
+    "image-jpeg", "image-svg+xml", "image-x-generic", "text-x-makefile", "text-x-script",
+    NULL
+};
+
+static const int theme_sizes[] = {16, 22, 24, 32, 48, 64, 96, 128, 256};
+static const char* theme_contexts[] = {"mimetypes", "places", "apps", "actions", "devices"};
+
+#define THEME_SIZE_COUNT (int)(sizeof(theme_sizes) / sizeof(theme_sizes[0]))
+#define THEME_CONTEXT_COUNT (int)(sizeof(theme_contexts) / sizeof(theme_contexts[0]))
+#define THEME_DIRECTORY_COUNT ((THEME_SIZE_COUNT + 1) * THEME_CONTEXT_COUNT)
+
+typedef struct {
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    long max_rss_kb;
+    long long bytes;
+    long spawns;
+    double display_ms;
+} RunResult;
+
+static char ils_path[PATH_MAX];
+static char bench_dir[PATH_MAX];
+static int sizes[MAX_SIZES] = {10, 1000, 100000, 1000000};
+static int size_count = 4;
+static const char* protocols[MAX_PROTOCOLS] = {"kitty", "sixel"};
+static int protocol_count = 2;
+static int runs = 3;
+static bool measure_display = false;
+static int theme_icons = 2000;
+static int theme_depth = 3;
+static char strace_path[PATH_MAX];
+static char original_path[8192];
+static pid_t daemon_pid = -1;
+
+static unsigned long long rng_state;
+
+static unsigned long long next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Every fixture path hangs off --dir; one that doesn't fit is an error
+// rather than a silently different file
+static void format_path(char* buffer, size_t size, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, size, format, args);
+    va_end(args);
+    if (length < 0 || (size_t)length >= size) {
+        fprintf(stderr, "bench: path too long: %s...\n", buffer);
+        exit(1);
+    }
+}
+
+static void join(char* buffer, size_t size, const char* directory, const char* name) {
+    format_path(buffer, size, "%s/%s", directory, name);
+}
+
+static bool make_directories(const char* path) {
+    char copy[PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s", path);
+    for (char* slash = strchr(copy + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(copy, 0755);
+        *slash = '/';
+    }
+    return mkdir(copy, 0755) == 0 || errno == EEXIST;
+}
+
+static bool write_file(const char* path, const void* data, size_t length, mode_t mode) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0) return false;
+    bool ok = length == 0 || write(fd, data, length) == (ssize_t)length;
+    return close(fd) == 0 && ok;
+}
+
+static unsigned char* read_file(const char* path, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* data = size > 0 ? malloc(size) : NULL;
+    if (data && fread(data, 1, size, file) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *length = data ? (size_t)size : 0;
+    return data;
+}
+
+// A stamp records the parameters a fixture was built with, so reruns reuse it
+static bool stamp_matches(const char* directory, const char* expected) {
+    char path[PATH_MAX], found[256] = "";
+    join(path, sizeof(path), directory, ".ils-bench");
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+    bool ok = fgets(found, sizeof(found), file) && strcmp(found, expected) == 0;
+    fclose(file);
+    return ok;
+}
+
+static void write_stamp(const char* directory, const char* stamp) {
+    char path[PATH_MAX];
+    join(path, sizeof(path), directory, ".ils-bench");
+    write_file(path, stamp, strlen(stamp), 0644);
+}
+
+static const char svg_icon[] =
+    "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"64\" height=\"64\">"
+    "<rect x=\"8\" y=\"4\" width=\"48\" height=\"56\" rx=\"4\" fill=\"#5c8dd6\"/></svg>\n";
+
+static bool generate_directory(int count, const unsigned char* png, size_t png_length) {
+    char directory[PATH_MAX], stamp[64];
+    format_path(directory, sizeof(directory), "%s/entries_%d", bench_dir, count);
+    snprintf(stamp, sizeof(stamp), "entries %d v%d\n", count, FIXTURE_VERSION);
+    if (stamp_matches(directory, stamp)) return true;
+
+    fprintf(stderr, "bench: generating %d entries\n", count);
+    if (!make_directories(directory)) return false;
+
+    int total_weight = 0;
+    for (size_t i = 0; i < sizeof(file_kinds) / sizeof(file_kinds[0]); i++) {
+        total_weight += file_kinds[i].weight;
+    }
+
+    rng_state = 0x9e3779b97f4a7c15ULL ^ (unsigned long long)count;
+    for (int i = 0; i < count; i++) {
+        char name[128], path[PATH_MAX];
+        unsigned long long r = next_random();
+        const char* base = base_names[r % (sizeof(base_names) / sizeof(base_names[0]))];
+
+        // Well-known literal names first, then a few subdirectories
+        if (i < (int)(sizeof(literal_names) / sizeof(literal_names[0]))) {
+            join(path, sizeof(path), directory, literal_names[i]);
+            if (!write_file(path, NULL, 0, 0644)) return false;
+            continue;
+        }
+        if (r % 100 < 3) {
+            snprintf(name, sizeof(name), "%s_dir_%07d", base, i);
+            join(path, sizeof(path), directory, name);
+            mkdir(path, 0755);
+            continue;
+        }
+
+        int pick = (int)((r >> 16) % total_weight);
+        const FileKind* kind = file_kinds;
+        while (pick >= kind->weight) {
+            pick -= kind->weight;
+            kind++;
+        }
+
+        snprintf(name, sizeof(name), "%s_%07d%s", base, i, kind->suffix);
+        join(path, sizeof(path), directory, name);
+
+        bool ok;
+        if (kind->image && strcmp(kind->suffix, ".svg") == 0) {
+            ok = write_file(path, svg_icon, sizeof(svg_icon) - 1, 0644);
+        } else if (kind->image) {
+            ok = write_file(path, png, png_length, 0644);
+        } else {
+            ok = write_file(path, NULL, 0, kind->executable ? 0755 : 0644);
+        }
+        if (!ok) return false;
+    }
+
+    write_stamp(directory, stamp);
+    return true;
+}
+
+static bool write_theme(const char* icons_root, const char* name, const char* inherits,
+                        int level, int levels) {
+    char theme_dir[PATH_MAX], path[PATH_MAX];
+    join(theme_dir, sizeof(theme_dir), icons_root, name);
+    if (!make_directories(theme_dir)) return false;
+
+    size_t capacity = 4096 + THEME_DIRECTORY_COUNT * 128;
+    char* index = malloc(capacity);
+    if (!index) return false;
+    size_t length = snprintf(index, capacity, "[Icon Theme]\nName=%s\nComment=ils benchmark theme\n", name);
+    if (inherits) length += snprintf(index + length, capacity - length, "Inherits=%s\n", inherits);
+    length += snprintf(index + length, capacity - length, "Directories=");
+
+    char directories[THEME_DIRECTORY_COUNT][64];
+    int directory_count = 0;
+    for (int s = 0; s <= THEME_SIZE_COUNT; s++) {
+        for (int c = 0; c < THEME_CONTEXT_COUNT; c++) {
+            char* dir = directories[directory_count++];
+            if (s < THEME_SIZE_COUNT) {
+                snprintf(dir, 64, "%dx%d/%s", theme_sizes[s], theme_sizes[s], theme_contexts[c]);
+            } else {
+                snprintf(dir, 64, "scalable/%s", theme_contexts[c]);
+            }
+            length += snprintf(index + length, capacity - length, "%s%s", dir,
+                               directory_count < THEME_DIRECTORY_COUNT ? "," : "\n");
+        }
+    }
+
+    for (int d = 0; d < directory_count; d++) {
+        int s = d / THEME_CONTEXT_COUNT;
+        int c = d % THEME_CONTEXT_COUNT;
+        if (s < THEME_SIZE_COUNT) {
+            length += snprintf(index + length, capacity - length,
+                               "\n[%s]\nSize=%d\nContext=%s\nType=Fixed\n",
+                               directories[d], theme_sizes[s], theme_contexts[c]);
+        } else {
+            length += snprintf(index + length, capacity - length,
+                               "\n[%s]\nSize=64\nMinSize=8\nMaxSize=512\nContext=%s\nType=Scalable\n",
+                               directories[d], theme_contexts[c]);
+        }
+        join(path, sizeof(path), theme_dir, directories[d]);
+        make_directories(path);
+    }
+
+    join(path, sizeof(path), theme_dir, "index.theme");
+    bool ok = write_file(path, index, length, 0644);
+    free(index);
+
+    // Filler is spread over the chain; the names ils looks up sit at the
+    // bottom so every lookup walks the inheritance
+    int per_level = theme_icons / levels;
+    for (int i = 0; ok && i < per_level; i++) {
+        const char* dir = directories[i % directory_count];
+        format_path(path, sizeof(path), "%s/%s/bench-icon-%d-%06d.svg", theme_dir, dir, level, i);
+        ok = write_file(path, svg_icon, sizeof(svg_icon) - 1, 0644);
+    }
+    for (int i = 0; ok && level == levels - 1 && theme_icon_names[i]; i++) {
+        for (int d = 0; ok && d < directory_count; d += THEME_CONTEXT_COUNT) {
+            format_path(path, sizeof(path), "%s/%s/%s.svg", theme_dir, directories[d], theme_icon_names[i]);
+            ok = write_file(path, svg_icon, sizeof(svg_icon) - 1, 0644);
+        }
+    }
+    return ok;
+}
+
+// Coffee (the default theme) -> bench-1 -> ... -> hicolor
+static bool generate_theme(void) {
+    char icons_root[PATH_MAX], stamp[64];
+    format_path(icons_root, sizeof(icons_root), "%s/home/.local/share/icons", bench_dir);
+    snprintf(stamp, sizeof(stamp), "theme %d %d v%d\n", theme_icons, theme_depth, FIXTURE_VERSION);
+    if (stamp_matches(icons_root, stamp)) return true;
+
+    fprintf(stderr, "bench: generating theme chain of %d with %d icons\n", theme_depth, theme_icons);
+    if (!make_directories(icons_root)) return false;
+
+    int levels = theme_depth + 1;
+    for (int level = 0; level < levels; level++) {
+        char name[32], inherits[32];
+        if (level == 0) snprintf(name, sizeof(name), "Coffee");
+        else if (level == levels - 1) snprintf(name, sizeof(name), "hicolor");
+        else snprintf(name, sizeof(name), "bench-%d", level);
+
+        if (level + 1 == levels - 1) snprintf(inherits, sizeof(inherits), "hicolor");
+        else snprintf(inherits, sizeof(inherits), "bench-%d", level + 1);
+
+        if (!write_theme(icons_root, name, level == levels - 1 ? NULL : inherits, level, levels)) {
+            return false;
+        }
+    }
+    write_stamp(icons_root, stamp);
+    return true;
+}
+
+// Converters go through counting wrappers so spawns can be reported
+static bool generate_shims(void) {
+    static const char* tools[] = {"rsvg-convert", "convert", "magick", "lsd", NULL};
+    char directory[PATH_MAX], path[PATH_MAX], script[PATH_MAX + 8192 + 256];
+    format_path(directory, sizeof(directory), "%s/shims", bench_dir);
+    if (!make_directories(directory)) return false;
+
+    for (int i = 0; tools[i]; i++) {
+        join(path, sizeof(path), directory, tools[i]);
+        int length = snprintf(script, sizeof(script),
+                              "#!/bin/sh\necho %s >> \"$ILS_BENCH_SPAWNS\"\nPATH='%s' exec %s \"$@\"\n",
+                              tools[i], original_path, tools[i]);
+        if (!write_file(path, script, length, 0755)) return false;
+    }
+    return true;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st; (void)flag; (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static void clear_caches(void) {
+    char path[PATH_MAX];
+    format_path(path, sizeof(path), "%s/home/.local/share/ils", bench_dir);
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    format_path(path, sizeof(path), "%s/home/.cache/thumbnails", bench_dir);
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static long count_lines(const char* path, bool syscalls_only) {
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+    long count = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file)) {
+        // strace -f splits interrupted calls into two lines and logs signals and exits
+        if (syscalls_only && (strstr(line, "resumed>") || strstr(line, "+++") || strstr(line, "---"))) {
+            continue;
+        }
+        if (strchr(line, '\n')) count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static bool uses_daemon(const char* protocol) {
+    return strstr(protocol, "+daemon") != NULL;
+}
+
+// Every ils the benchmark starts sees only the fixtures
+static void enter_fixtures(void) {
+    char home[PATH_MAX], empty[PATH_MAX], runtime[PATH_MAX], path[PATH_MAX + sizeof(original_path)], spawns[PATH_MAX];
+    format_path(home, sizeof(home), "%s/home", bench_dir);
+    format_path(empty, sizeof(empty), "%s/empty", bench_dir);
+    format_path(runtime, sizeof(runtime), "%s/run", bench_dir);
+    format_path(path, sizeof(path), "%s/shims:%s", bench_dir, original_path);
+    format_path(spawns, sizeof(spawns), "%s/spawns", bench_dir);
+
+    setenv("HOME", home, 1);
+    setenv("XDG_DATA_DIRS", empty, 1);
+    setenv("XDG_RUNTIME_DIR", runtime, 1);
+    setenv("PATH", path, 1);
+    setenv("ILS_BENCH_SPAWNS", spawns, 1);
+    setenv("TERM", "xterm-kitty", 1);
+    unsetenv("XDG_DATA_HOME");
+    unsetenv("XDG_CACHE_HOME");
+    unsetenv("DEBUG_ICONS");
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) dup2(null_fd, STDERR_FILENO);
+    if (chdir(bench_dir) != 0) _exit(127);
+}
+
+static void exec_ils(const char* protocol, int entries, const char* trace_path) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s", protocol);
+    char* suffix = strchr(name, '+');
+    if (suffix) *suffix = '\0';
+    char* transfer = strchr(name, ':');
+    if (transfer) *transfer++ = '\0';
+    else transfer = "auto";
+
+    char target[64];
+    snprintf(target, sizeof(target), "entries_%d", entries);
+    enter_fixtures();
+
+    const char* args[16];
+    int count = 0;
+    if (trace_path) {
+        args[count++] = strace_path;
+        args[count++] = "-f";
+        args[count++] = "-qq";
+        args[count++] = "-o";
+        args[count++] = trace_path;
+    }
+    args[count++] = ils_path;
+    if (!uses_daemon(protocol)) args[count++] = "--no-daemon";
+    args[count++] = "--protocol";
+    args[count++] = name;
+    args[count++] = "--kitty-transfer";
+    args[count++] = transfer;
+    args[count++] = target;
+    args[count] = NULL;
+    execv(args[0], (char* const*)args);
+    _exit(127);
+}
+
+static void stop_daemon(void) {
+    if (daemon_pid < 0) return;
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+    daemon_pid = -1;
+}
+
+// Starting up is not part of any sample, so wait until it accepts
+static bool start_daemon(void) {
+    stop_daemon();
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    format_path(addr.sun_path, sizeof(addr.sun_path), "%s/run/ils.sock", bench_dir);
+    unlink(addr.sun_path);
+
+    daemon_pid = fork();
+    if (daemon_pid < 0) return false;
+    if (daemon_pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        enter_fixtures();
+        execl(ils_path, "ils", "--daemon", (char*)NULL);
+        _exit(127);
+    }
+
+    struct timespec delay = {0, 10 * 1000000L};
+    for (int waited_ms = 0; waited_ms < 10000; waited_ms += 10) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool ready = fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (fd >= 0) close(fd);
+        if (ready) return true;
+        if (waitpid(daemon_pid, NULL, WNOHANG) == daemon_pid) break;
+        nanosleep(&delay, NULL);
+    }
+    stop_daemon();
+    return false;
+}
+
+// Replays captured output on the benchmark's own terminal followed by a
+// DA1 query. Terminals answer in order, so the reply arrives once
+// everything before it has been decoded and drawn. -1 without a terminal
+// or a reply within ten seconds.
+static double display_ms(const char* data, size_t length) {
+    int fd = open("/dev/tty", O_RDWR | O_NOCTTY);
+    if (fd < 0) return -1;
+
+    struct termios saved, raw;
+    if (tcgetattr(fd, &saved) != 0) {
+        close(fd);
+        return -1;
+    }
+    raw = saved;
+    cfmakeraw(&raw);
+    tcsetattr(fd, TCSANOW, &raw);
+
+    double start = now_ms();
+    double elapsed = -1;
+    bool ok = true;
+    for (size_t done = 0; ok && done < length; ) {
+        ssize_t n = write(fd, data + done, length - done);
+        if (n > 0) done += n;
+        else ok = n < 0 && errno == EINTR;
+    }
+    ok = ok && write(fd, "\033[c", 3) == 3;
+
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (ok && poll(&pfd, 1, 10000) > 0) {
+        char c;
+        if (read(fd, &c, 1) != 1) break;
+        if (c == 'c') {
+            elapsed = now_ms() - start;
+            break;
+        }
+    }
+
+    tcsetattr(fd, TCSANOW, &saved);
+    close(fd);
+    return elapsed;
+}
+
+// Output to a pty is counted and discarded; /dev/null output is not counted
+static bool run_ils(const char* protocol, int entries, bool to_pty, const char* trace_path, RunResult* result) {
+    char spawns[PATH_MAX];
+    format_path(spawns, sizeof(spawns), "%s/spawns", bench_dir);
+    write_file(spawns, NULL, 0, 0644);
+
+    memset(result, 0, sizeof(*result));
+    result->bytes = -1;
+    result->display_ms = -1;
+    double start = now_ms();
+
+    pid_t pid;
+    int master = -1;
+    if (to_pty) {
+        // 200x50 cells of 10x20 pixels, so no cell size query is needed
+        struct winsize ws = {.ws_row = 50, .ws_col = 200, .ws_xpixel = 2000, .ws_ypixel = 1000};
+        pid = forkpty(&master, NULL, NULL, &ws);
+    } else {
+        pid = fork();
+    }
+    if (pid < 0) return false;
+
+    if (pid == 0) {
+        if (!to_pty) {
+            int null_fd = open("/dev/null", O_RDWR);
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        exec_ils(protocol, entries, trace_path);
+    }
+
+    char* captured = NULL;
+    if (to_pty) {
+        char buffer[65536];
+        ssize_t n;
+        result->bytes = 0;
+        while ((n = read(master, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)) {
+            if (n <= 0) continue;
+            if (measure_display) {
+                char* tmp = realloc(captured, result->bytes + n);
+                if (tmp) memcpy(tmp + result->bytes, buffer, n);
+                else free(captured);
+                captured = tmp;
+            }
+            result->bytes += n;
+        }
+        close(master);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) return false;
+
+    result->wall_ms = now_ms() - start;
+    result->user_ms = usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0;
+    result->sys_ms = usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+    result->max_rss_kb = usage.ru_maxrss;
+    result->spawns = count_lines(spawns, false);
+    if (captured) {
+        result->display_ms = display_ms(captured, result->bytes);
+        free(captured);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) != 127;
+}
+
+static long long count_syscalls(const char* protocol, int entries, bool to_pty, bool cold) {
+    if (!strace_path[0]) return -1;
+
+    char trace_path[PATH_MAX];
+    format_path(trace_path, sizeof(trace_path), "%s/trace", bench_dir);
+    if (cold) clear_caches();
+
+    RunResult ignored;
+    if (!run_ils(protocol, entries, to_pty, trace_path, &ignored)) return -1;
+    long long count = count_lines(trace_path, true);
+    unlink(trace_path);
+    return count;
+}
+
+static int compare_wall(const void* a, const void* b) {
+    double x = ((const RunResult*)a)->wall_ms, y = ((const RunResult*)b)->wall_ms;
+    return (x > y) - (x < y);
+}
+
+static bool first_result = true;
+
+static void print_result(int entries, const char* protocol, bool to_pty, bool cold,
+                         RunResult* samples, int count, long long syscalls) {
+    qsort(samples, count, sizeof(RunResult), compare_wall);
+    const RunResult* median = &samples[count / 2];
+    // Nearest rank; below 100 runs this is the slowest one
+    const RunResult* p99 = &samples[(count * 99 + 99) / 100 - 1];
+
+    long max_rss = 0;
+    for (int i = 0; i < count; i++) {
+        if (samples[i].max_rss_kb > max_rss) max_rss = samples[i].max_rss_kb;
+    }
+
+    printf("%s\n    {\"entries\": %d, \"protocol\": \"%s\", \"output\": \"%s\", \"cache\": \"%s\", "
+           "\"runs\": %d, \"wall_ms\": %.2f, \"wall_ms_min\": %.2f, \"wall_ms_p99\": %.2f, \"user_ms\": %.2f, \"sys_ms\": %.2f, "
+           "\"max_rss_kb\": %ld, \"spawns\": %ld, ",
+           first_result ? "" : ",", entries, protocol, to_pty ? "pty" : "null", cold ? "cold" : "warm",
+           count, median->wall_ms, samples[0].wall_ms, p99->wall_ms, median->user_ms, median->sys_ms,
+           max_rss, median->spawns);
+    if (median->bytes >= 0) printf("\"bytes\": %lld, ", median->bytes);
+    else printf("\"bytes\": null, ");
+    if (median->display_ms >= 0) printf("\"display_ms\": %.2f, ", median->display_ms);
+    else printf("\"display_ms\": null, ");
+    if (syscalls >= 0) printf("\"syscalls\": %lld}", syscalls);
+    else printf("\"syscalls\": null}");
+
+    first_result = false;
+    fflush(stdout);
+}
+
+// A cold daemon run also starts from a fresh daemon
+static bool bench_case(int entries, const char* protocol, bool to_pty) {
+    RunResult samples[MAX_RUNS];
+    bool daemon = uses_daemon(protocol);
+    bool ok = true;
+
+    for (int cold = 1; ok && cold >= 0; cold--) {
+        fprintf(stderr, "bench: %d entries, %s, %s, %s\n", entries, protocol,
+                to_pty ? "pty" : "null", cold ? "cold" : "warm");
+
+        if (!cold) {
+            RunResult warmup;
+            ok = run_ils(protocol, entries, to_pty, NULL, &warmup);
+        }
+        for (int i = 0; ok && i < runs; i++) {
+            if (cold) clear_caches();
+            if (daemon && (cold || daemon_pid < 0)) ok = start_daemon();
+            ok = ok && run_ils(protocol, entries, to_pty, NULL, &samples[i]);
+        }
+        if (daemon && cold) ok = ok && start_daemon();
+        if (!ok) break;
+
+        long long syscalls = count_syscalls(protocol, entries, to_pty, cold);
+        print_result(entries, protocol, to_pty, cold, samples, runs, syscalls);
+    }
+    stop_daemon();
+    return ok;
+}
+
+static int parse_list(const char* text, int* values, int max) {
+    int count = 0;
+    for (const char* p = text; *p && count < max; ) {
+        char* end;
+        long value = strtol(p, &end, 10);
+        if (end == p) break;
+        if (value > 0) values[count++] = (int)value;
+        p = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+static void find_strace(void) {
+    char copy[sizeof(original_path)];
+    snprintf(copy, sizeof(copy), "%s", original_path);
+    char* saveptr;
+    for (char* dir = strtok_r(copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr)) {
+        snprintf(strace_path, sizeof(strace_path), "%s/strace", dir);
+        if (access(strace_path, X_OK) == 0) return;
+    }
+    strace_path[0] = '\0';
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: bench --ils PATH --dir DIR [--sizes 10,1000,...] [--protocols kitty,sixel]\n"
+            "             [--runs N] [--theme-icons N] [--theme-depth N] [--display]\n"
+            "protocols are kitty, sixel or kitty:png, kitty:rgba, kitty:file, each optionally\n"
+            "followed by +daemon to go through a resident ils --daemon\n");
+    exit(2);
+}
+
+int main(int argc, char* argv[]) {
+    const char* ils = NULL;
+    const char* dir = NULL;
+    static char protocol_list[256];
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--display") == 0) {
+            measure_display = true;
+            continue;
+        }
+        if (i + 1 >= argc) usage();
+        if (strcmp(argv[i], "--ils") == 0) {
+            ils = argv[++i];
+        } else if (strcmp(argv[i], "--dir") == 0) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--sizes") == 0) {
+            size_count = parse_list(argv[++i], sizes, MAX_SIZES);
+        } else if (strcmp(argv[i], "--runs") == 0) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--theme-icons") == 0) {
+            theme_icons = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--theme-depth") == 0) {
+            theme_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--protocols") == 0) {
+            snprintf(protocol_list, sizeof(protocol_list), "%s", argv[++i]);
+            protocol_count = 0;
+            char* saveptr;
+            for (char* p = strtok_r(protocol_list, ",", &saveptr); p && protocol_count < MAX_PROTOCOLS;
+                 p = strtok_r(NULL, ",", &saveptr)) {
+                protocols[protocol_count++] = p;
+            }
+        } else {
+            usage();
+        }
+    }
+    if (!ils || !dir || size_count == 0 || protocol_count == 0) usage();
+    if (runs < 1) runs = 1;
+    if (runs > MAX_RUNS) runs = MAX_RUNS;
+    if (theme_depth < 1) theme_depth = 1;
+    if (theme_icons < 0) theme_icons = 0;
+
+    if (!realpath(ils, ils_path)) {
+        fprintf(stderr, "bench: cannot find %s\n", ils);
+        return 1;
+    }
+    if (!make_directories(dir) || !realpath(dir, bench_dir)) {
+        fprintf(stderr, "bench: cannot create %s\n", dir);
+        return 1;
+    }
+    snprintf(original_path, sizeof(original_path), "%s", getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+    find_strace();
+
+    char path[PATH_MAX];
+    format_path(path, sizeof(path), "%s/empty", bench_dir);
+    make_directories(path);
+    format_path(path, sizeof(path), "%s/run", bench_dir);
+    make_directories(path);
+
+    // One gradient image is shared by every image fixture
+    unsigned char pixels[64 * 64 * 4];
+    for (int y = 0; y < 64; y++) {
+        for (int x = 0; x < 64; x++) {
+            unsigned char* p = pixels + (y * 64 + x) * 4;
+            p[0] = x * 4;
+            p[1] = y * 4;
+            p[2] = 160;
+            p[3] = 255;
+        }
+    }
+    size_t png_length;
+    format_path(path, sizeof(path), "%s/sample.png", bench_dir);
+    unsigned char* png = png_write_rgba(path, pixels, 64, 64) ? read_file(path, &png_length) : NULL;
+
+    bool ok = png && generate_theme() && generate_shims();
+    for (int i = 0; ok && i < size_count; i++) {
+        ok = generate_directory(sizes[i], png, png_length);
+    }
+    free(png);
+    if (!ok) {
+        fprintf(stderr, "bench: cannot generate fixtures in %s: %s\n", bench_dir, strerror(errno));
+        return 1;
+    }
+
+    printf("{\n  \"ils\": \"%s\", \"fixtures\": \"%s\", \"theme_icons\": %d, \"theme_depth\": %d, "
+           "\"syscalls_counted\": %s,\n  \"results\": [",
+           ils_path, bench_dir, theme_icons, theme_depth, strace_path[0] ? "true" : "false");
+
+    for (int s = 0; ok && s < size_count; s++) {
+        for (int p = 0; ok && p < protocol_count; p++) {
+            ok = bench_case(sizes[s], protocols[p], true) && bench_case(sizes[s], protocols[p], false);
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    if (!ok) {
+        fprintf(stderr, "bench: running %s failed\n", ils_path);
+        return 1;
+    }
+    return 0;
+}
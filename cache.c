@@ -0,0 +1,823 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include "config.h"
+#include "cache.h"
+#include "profile.h"
+#include "png.h"
+#include "md5.h"
+#include "hashmap.h"
+
+typedef struct {
+    long long hits;
+    long long misses;
+    long long evictions;
+    long long bytes;
+    long long entries;
+} CacheStats;
+
+typedef struct {
+    char* path;
+    long long size;
+    time_t last_access;
+} CacheCandidate;
+
+typedef struct JournalRecord {
+    char* path;
+    time_t last_access;
+    bool seen;
+    struct JournalRecord* next;
+} JournalRecord;
+
+static char CACHE_PATH[MAX_PATH_LENGTH];
+static char STATE_PATH[MAX_PATH_LENGTH];
+
+static long long max_cache_bytes = CACHE_MAX_BYTES;
+static long long max_cache_entries = CACHE_MAX_ENTRIES;
+
+// Accounting for this run, flushed by cache_finish()
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static CacheStats run_stats;
+static char** touched_paths = NULL;
+static int touched_count = 0;
+static int touched_capacity = 0;
+static HashMap* touched_set = NULL;    // The same paths, so each is journaled once
+
+// Converter fingerprints, looked up once per run
+typedef struct {
+    char name[32];
+    char fingerprint[MAX_PATH_LENGTH + 64];
+} ToolFingerprint;
+
+static ToolFingerprint tool_fingerprints[8];
+static int tool_fingerprint_count = 0;
+
+void cache_init(void) {
+    const char* home = getenv("HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        home = pw ? pw->pw_dir : "/tmp";
+    }
+    snprintf(STATE_PATH, sizeof(STATE_PATH), "%s/.local/share/ils", home);
+    snprintf(CACHE_PATH, sizeof(CACHE_PATH), "%s/%s", home, CACHE_DIRECTORY_PATH);
+}
+
+void cache_set_limits(long long max_bytes, long long max_entries) {
+    if (max_bytes > 0) max_cache_bytes = max_bytes;
+    if (max_entries > 0) max_cache_entries = max_entries;
+}
+
+const char* cache_directory(void) {
+    return CACHE_PATH;
+}
+
+const char* cache_state_directory(void) {
+    return STATE_PATH;
+}
+
+void ensure_cache_directory(void) {
+    struct stat st = {0};
+
+    char* dir_copy = strdup(CACHE_PATH);
+    if (!dir_copy) return;
+
+    char* slash = strchr(dir_copy + 1, '/');
+    while (slash) {
+        *slash = '\0';
+        if (stat(dir_copy, &st) == -1) {
+            mkdir(dir_copy, 0755);
+        }
+        *slash = '/';
+        slash = strchr(slash + 1, '/');
+    }
+    if (stat(dir_copy, &st) == -1) {
+        mkdir(dir_copy, 0755);
+    }
+    free(dir_copy);
+}
+
+static void state_file_path(char* buffer, size_t size, const char* name) {
+    snprintf(buffer, size, "%s/%s", STATE_PATH, name);
+}
+
+static void touch_path(const char* path) {
+    if (!touched_set) touched_set = hashmap_create(INITIAL_CAPACITY);
+    if (touched_set && hashmap_get(touched_set, path)) return;
+    if (touched_count >= touched_capacity) {
+        int capacity = touched_capacity ? touched_capacity * 2 : INITIAL_CAPACITY;
+        char** tmp = realloc(touched_paths, capacity * sizeof(char*));
+        if (!tmp) return;
+        touched_paths = tmp;
+        touched_capacity = capacity;
+    }
+    char* copy = strdup(path);
+    if (copy) {
+        touched_paths[touched_count++] = copy;
+        if (touched_set) hashmap_put(touched_set, copy, copy);
+    }
+}
+
+static void split_cache_path(const char* path, char* dir, size_t dir_size, const char** base) {
+    const char* slash = strrchr(path, '/');
+    if (slash) {
+        snprintf(dir, dir_size, "%.*s", (int)(slash - path), path);
+        *base = slash + 1;
+    } else {
+        snprintf(dir, dir_size, ".");
+        *base = path;
+    }
+}
+
+static bool lock_is_stale(const char* lock_path) {
+    struct stat st;
+    if (stat(lock_path, &st) != 0) return false;
+    if (time(NULL) - st.st_mtime > CACHE_LOCK_STALE_SECONDS) return true;
+
+    // The owner writes its pid; a lock left behind by a crashed run is stale
+    char buffer[32] = {0};
+    int fd = open(lock_path, O_RDONLY);
+    if (fd < 0) return false;
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+
+    pid_t owner = len > 0 ? (pid_t)atoi(buffer) : 0;
+    return owner > 0 && kill(owner, 0) != 0 && errno == ESRCH;
+}
+
+static bool fill_is_current(const char* path, CacheFillCurrent current, const void* context) {
+    return current ? current(path, context) : access(path, F_OK) == 0;
+}
+
+static bool begin_fill(const char* path, CacheFill* fill, CacheFillCurrent current, const void* context) {
+    char dir[MAX_PATH_LENGTH];
+    const char* base;
+    split_cache_path(path, dir, sizeof(dir), &base);
+
+    // Temp names keep the extension so converters still pick the format
+    snprintf(fill->temp_path, sizeof(fill->temp_path), "%s/.tmp-%d-%s", dir, (int)getpid(), base);
+    snprintf(fill->lock_path, sizeof(fill->lock_path), "%s/.%s.lock", dir, base);
+
+    struct timespec delay = { 0, CACHE_FILL_POLL_MS * 1000000L };
+    int waited_ms = 0;
+
+    for (;;) {
+        int fd = open(fill->lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            char pid_text[32];
+            int len = snprintf(pid_text, sizeof(pid_text), "%d\n", (int)getpid());
+            if (write(fd, pid_text, len) != len) {
+                // The lock still works without the pid, it just ages out
+            }
+            close(fd);
+
+            // Someone may have finished between our lookup and the claim
+            if (fill_is_current(path, current, context)) {
+                unlink(fill->lock_path);
+                return false;
+            }
+            return true;
+        }
+
+        if (errno != EEXIST) return false;
+
+        // Another producer owns this key; wait for its rename
+        if (fill_is_current(path, current, context)) return false;
+
+        if (lock_is_stale(fill->lock_path)) {
+            unlink(fill->lock_path);
+            continue;
+        }
+
+        if (waited_ms >= CACHE_FILL_WAIT_MS) return false;
+        nanosleep(&delay, NULL);
+        waited_ms += CACHE_FILL_POLL_MS;
+    }
+}
+
+bool cache_begin_fill(const char* path, CacheFill* fill) {
+    return begin_fill(path, fill, NULL, NULL);
+}
+
+bool cache_begin_refill(const char* path, CacheFill* fill, CacheFillCurrent current, const void* context) {
+    return begin_fill(path, fill, current, context);
+}
+
+static bool fill_is_complete(const char* path, const char* temp_path) {
+    const char* dot = strrchr(path, '.');
+    if (dot && strcmp(dot, ".png") == 0) {
+        return png_is_complete(temp_path);
+    }
+
+    struct stat st;
+    return stat(temp_path, &st) == 0 && st.st_size > 0;
+}
+
+bool cache_end_fill(const char* path, CacheFill* fill, bool produced) {
+    bool ok = produced && fill_is_complete(path, fill->temp_path) &&
+              rename(fill->temp_path, path) == 0;
+
+    if (!ok) {
+        unlink(fill->temp_path);
+    }
+    unlink(fill->lock_path);
+    return ok;
+}
+
+bool cache_lookup(const char* path) {
+    if (!path) return false;
+
+    struct stat st;
+    profile_count(PROFILE_STATS, 1);
+    bool hit = stat(path, &st) == 0;
+    cache_record_access(path, hit);
+    return hit;
+}
+
+void cache_record_access(const char* path, bool hit) {
+    profile_count(hit ? PROFILE_CACHE_HITS : PROFILE_CACHE_MISSES, 1);
+    pthread_mutex_lock(&cache_lock);
+    if (hit) {
+        run_stats.hits++;
+        touch_path(path);
+    } else {
+        run_stats.misses++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_filled(const char* path) {
+    struct stat st;
+    if (!path || stat(path, &st) != 0) return;
+
+    pthread_mutex_lock(&cache_lock);
+    run_stats.bytes += st.st_size;
+    run_stats.entries++;
+    touch_path(path);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static bool parse_stats(FILE* file, CacheStats* stats) {
+    char key[32];
+    long long value;
+    bool parsed = false;
+    memset(stats, 0, sizeof(CacheStats));
+
+    while (fscanf(file, "%31s %lld", key, &value) == 2) {
+        parsed = true;
+        if (strcmp(key, "hits") == 0) stats->hits = value;
+        else if (strcmp(key, "misses") == 0) stats->misses = value;
+        else if (strcmp(key, "evictions") == 0) stats->evictions = value;
+        else if (strcmp(key, "bytes") == 0) stats->bytes = value;
+        else if (strcmp(key, "entries") == 0) stats->entries = value;
+    }
+    return parsed;
+}
+
+static bool read_stats(CacheStats* stats) {
+    char path[MAX_PATH_LENGTH + 32];
+    state_file_path(path, sizeof(path), "cache.stats");
+
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        memset(stats, 0, sizeof(CacheStats));
+        return false;
+    }
+    parse_stats(file, stats);
+    fclose(file);
+    return true;
+}
+
+// Add deltas to the persistent counters. When sizes_absolute is set the
+// byte/entry totals are replaced instead (used after a full rescan).
+// Returns false if there were no counters yet, i.e. the size is unknown.
+static bool update_stats(const CacheStats* delta, bool sizes_absolute, CacheStats* result) {
+    char path[MAX_PATH_LENGTH + 32];
+    state_file_path(path, sizeof(path), "cache.stats");
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return true;
+    flock(fd, LOCK_EX);
+
+    CacheStats stats;
+    FILE* file = fdopen(fd, "r+");
+    if (!file) {
+        close(fd);
+        return true;
+    }
+    bool known = parse_stats(file, &stats);
+
+    stats.hits += delta->hits;
+    stats.misses += delta->misses;
+    stats.evictions += delta->evictions;
+    if (sizes_absolute) {
+        stats.bytes = delta->bytes;
+        stats.entries = delta->entries;
+    } else {
+        stats.bytes += delta->bytes;
+        stats.entries += delta->entries;
+    }
+
+    rewind(file);
+    if (ftruncate(fd, 0) == 0) {
+        fprintf(file, "hits %lld\nmisses %lld\nevictions %lld\nbytes %lld\nentries %lld\n",
+                stats.hits, stats.misses, stats.evictions, stats.bytes, stats.entries);
+    }
+    if (result) *result = stats;
+
+    // Closing the stream also drops the lock
+    fclose(file);
+    return known;
+}
+
+// A tool is identified by where it lives on PATH and its binary's mtime and
+// size, so upgrading or installing it invalidates recorded failures without
+// running it to ask for a version.
+static const char* tool_fingerprint(const char* name) {
+    for (int i = 0; i < tool_fingerprint_count; i++) {
+        if (strcmp(tool_fingerprints[i].name, name) == 0) {
+            return tool_fingerprints[i].fingerprint;
+        }
+    }
+
+    static char scratch[MAX_PATH_LENGTH + 64];
+    ToolFingerprint* tool = tool_fingerprint_count < (int)(sizeof(tool_fingerprints) / sizeof(tool_fingerprints[0]))
+        ? &tool_fingerprints[tool_fingerprint_count++] : NULL;
+    char* fingerprint = tool ? tool->fingerprint : scratch;
+    size_t size = tool ? sizeof(tool->fingerprint) : sizeof(scratch);
+    if (tool) snprintf(tool->name, sizeof(tool->name), "%s", name);
+
+    snprintf(fingerprint, size, "%s missing", name);
+
+    const char* path_env = getenv("PATH");
+    char* paths = strdup(path_env ? path_env : "/usr/bin:/bin");
+    if (!paths) return fingerprint;
+
+    char* saveptr;
+    for (char* dir = strtok_r(paths, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr)) {
+        char candidate[MAX_PATH_LENGTH];
+        struct stat st;
+        snprintf(candidate, sizeof(candidate), "%s/%s", dir, name);
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IXUSR)) {
+            snprintf(fingerprint, size, "%.900s %lld.%09ld %lld", candidate,
+                     (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_size);
+            break;
+        }
+    }
+    free(paths);
+    return fingerprint;
+}
+
+static void failure_marker_path(const char* kind, const char* source, int size, const char* tools,
+                                char* path, size_t path_size) {
+    char key[MAX_PATH_LENGTH * 4];
+    int len = snprintf(key, sizeof(key), "%s\n%s\n%d", kind, source, size);
+
+    // File sources are retried as soon as they change
+    struct stat st;
+    if (source[0] == '/' && stat(source, &st) == 0 && len > 0 && (size_t)len < sizeof(key)) {
+        len += snprintf(key + len, sizeof(key) - len, "\n%lld %lld",
+                        (long long)st.st_mtime, (long long)st.st_size);
+    }
+
+    char names[256];
+    snprintf(names, sizeof(names), "%s", tools);
+    char* saveptr;
+    for (char* name = strtok_r(names, " ", &saveptr); name; name = strtok_r(NULL, " ", &saveptr)) {
+        if (len <= 0 || (size_t)len >= sizeof(key)) break;
+        len += snprintf(key + len, sizeof(key) - len, "\n%s", tool_fingerprint(name));
+    }
+    if (len < 0 || (size_t)len >= sizeof(key)) len = sizeof(key) - 1;
+
+    char hex[MD5_HEX_LENGTH];
+    md5_hex(key, len, hex);
+    snprintf(path, path_size, "%s/failures/%s", STATE_PATH, hex);
+}
+
+bool cache_known_failure(const char* kind, const char* source, int size, const char* tools) {
+    char path[MAX_PATH_LENGTH + 64];
+    pthread_mutex_lock(&cache_lock);
+    failure_marker_path(kind, source, size, tools, path, sizeof(path));
+    pthread_mutex_unlock(&cache_lock);
+
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+    if (time(NULL) - st.st_mtime < CACHE_FAILURE_TTL_SECONDS) return true;
+
+    unlink(path);
+    return false;
+}
+
+void cache_record_failure(const char* kind, const char* source, int size, const char* tools) {
+    char path[MAX_PATH_LENGTH + 64];
+    char dir[MAX_PATH_LENGTH + 32];
+    pthread_mutex_lock(&cache_lock);
+    failure_marker_path(kind, source, size, tools, path, sizeof(path));
+    pthread_mutex_unlock(&cache_lock);
+
+    state_file_path(dir, sizeof(dir), "failures");
+    ensure_cache_directory();
+    mkdir(dir, 0755);
+
+    // The marker's mtime is its timestamp; the content only helps debugging
+    FILE* marker = fopen(path, "w");
+    if (marker) {
+        fprintf(marker, "%s %d %s\n", kind, size, source);
+        fclose(marker);
+    }
+
+    if (getenv("DEBUG_ICONS")) {
+        fprintf(stderr, "Recorded %s failure for: %s\n", kind, source);
+    }
+}
+
+// Expired markers would otherwise pile up for sources that never come back
+static void sweep_failures(void) {
+    char dir_path[MAX_PATH_LENGTH + 32];
+    state_file_path(dir_path, sizeof(dir_path), "failures");
+
+    DIR* dir = opendir(dir_path);
+    if (!dir) return;
+
+    int fd = dirfd(dir);
+    time_t now = time(NULL);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (entry->d_name[0] == '.' || fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (now - st.st_mtime >= CACHE_FAILURE_TTL_SECONDS) {
+            unlinkat(fd, entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+static unsigned int hash_path(const char* path) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static JournalRecord** load_journal(const char* journal_path, int bucket_count) {
+    JournalRecord** buckets = calloc(bucket_count, sizeof(JournalRecord*));
+    if (!buckets) return NULL;
+
+    FILE* file = fopen(journal_path, "r");
+    if (!file) return buckets;
+
+    char line[MAX_PATH_LENGTH + 32];
+    while (fgets(line, sizeof(line), file)) {
+        char* newline = strchr(line, '\n');
+        if (!newline) continue; // Torn or oversized record
+        *newline = '\0';
+
+        char* space = strchr(line, ' ');
+        if (!space || space[1] != '/') continue;
+        time_t when = (time_t)strtoll(line, NULL, 10);
+        const char* path = space + 1;
+
+        unsigned int bucket = hash_path(path) % bucket_count;
+        JournalRecord* record = buckets[bucket];
+        while (record && strcmp(record->path, path) != 0) {
+            record = record->next;
+        }
+
+        if (record) {
+            if (when > record->last_access) record->last_access = when;
+            continue;
+        }
+
+        record = malloc(sizeof(JournalRecord));
+        if (!record) continue;
+        record->path = strdup(path);
+        record->last_access = when;
+        record->seen = false;
+        record->next = buckets[bucket];
+        buckets[bucket] = record;
+    }
+
+    fclose(file);
+    return buckets;
+}
+
+static void free_journal(JournalRecord** buckets, int bucket_count) {
+    for (int i = 0; i < bucket_count; i++) {
+        JournalRecord* record = buckets[i];
+        while (record) {
+            JournalRecord* next = record->next;
+            free(record->path);
+            free(record);
+            record = next;
+        }
+    }
+    free(buckets);
+}
+
+static bool add_candidate(CacheCandidate** candidates, int* count, int* capacity,
+                          const char* path, long long size, time_t last_access) {
+    if (*count >= *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : INITIAL_CAPACITY;
+        CacheCandidate* tmp = realloc(*candidates, new_capacity * sizeof(CacheCandidate));
+        if (!tmp) return false;
+        *candidates = tmp;
+        *capacity = new_capacity;
+    }
+
+    (*candidates)[*count].path = strdup(path);
+    (*candidates)[*count].size = size;
+    (*candidates)[*count].last_access = last_access;
+    (*count)++;
+    return true;
+}
+
+static int compare_candidates(const void* a, const void* b) {
+    const CacheCandidate* ca = a;
+    const CacheCandidate* cb = b;
+    if (ca->last_access < cb->last_access) return -1;
+    if (ca->last_access > cb->last_access) return 1;
+    return 0;
+}
+
+// Thumbnails are shared with file managers; ils only deletes the ones it
+// wrote itself, whatever it happened to read
+static bool written_by_ils(const char* path) {
+    PngTextField software = {.key = "Software"};
+    return png_read_text(path, &software, 1) && software.found && strcmp(software.value, "ils") == 0;
+}
+
+// Runs in a detached child. Rebuilds the LRU order from the journal (files
+// never journaled fall back to their mtime), deletes the oldest entries
+// until the cache is back under ~90% of its budget and compacts the journal.
+static void cache_evict(void) {
+    char lock_path[MAX_PATH_LENGTH + 32];
+    char journal_path[MAX_PATH_LENGTH + 32];
+    char compact_path[MAX_PATH_LENGTH + 48];
+    state_file_path(lock_path, sizeof(lock_path), "evict.lock");
+    state_file_path(journal_path, sizeof(journal_path), "access.journal");
+    snprintf(compact_path, sizeof(compact_path), "%s.%d", journal_path, (int)getpid());
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0) return;
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(lock_fd); // Another evictor is already running
+        return;
+    }
+
+    struct stat journal_st;
+    int bucket_count = 1024;
+    if (stat(journal_path, &journal_st) == 0 && journal_st.st_size / 64 > bucket_count) {
+        bucket_count = (int)(journal_st.st_size / 64);
+    }
+    JournalRecord** journal = load_journal(journal_path, bucket_count);
+    if (!journal) {
+        close(lock_fd);
+        return;
+    }
+
+    CacheCandidate* candidates = NULL;
+    int count = 0;
+    int capacity = 0;
+    long long total_bytes = 0;
+
+    DIR* dir = opendir(CACHE_PATH);
+    if (dir) {
+        int fd = dirfd(dir);
+        time_t now = time(NULL);
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            struct stat st;
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) continue;
+
+            // Temp files and locks are skipped, and swept once a crash left them behind
+            if (entry->d_name[0] == '.') {
+                if (now - st.st_mtime > CACHE_LOCK_STALE_SECONDS * 10) {
+                    unlinkat(fd, entry->d_name, 0);
+                }
+                continue;
+            }
+
+            char path[MAX_PATH_LENGTH * 2];
+            snprintf(path, sizeof(path), "%s/%s", CACHE_PATH, entry->d_name);
+
+            time_t last_access = st.st_mtime;
+            JournalRecord* record = journal[hash_path(path) % bucket_count];
+            while (record && strcmp(record->path, path) != 0) {
+                record = record->next;
+            }
+            if (record) {
+                record->seen = true;
+                if (record->last_access > last_access) last_access = record->last_access;
+            }
+
+            if (add_candidate(&candidates, &count, &capacity, path, st.st_size, last_access)) {
+                total_bytes += st.st_size;
+            }
+        }
+        closedir(dir);
+    }
+
+    // Thumbnails live outside our directory; only the ones ils made are ours to trim
+    for (int i = 0; i < bucket_count; i++) {
+        for (JournalRecord* record = journal[i]; record; record = record->next) {
+            struct stat st;
+            if (record->seen || stat(record->path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (!written_by_ils(record->path)) continue;
+            if (add_candidate(&candidates, &count, &capacity, record->path, st.st_size, record->last_access)) {
+                total_bytes += st.st_size;
+            }
+        }
+    }
+    free_journal(journal, bucket_count);
+    sweep_failures();
+
+    qsort(candidates, count, sizeof(CacheCandidate), compare_candidates);
+
+    long long target_bytes = max_cache_bytes / 10 * 9;
+    long long target_entries = max_cache_entries / 10 * 9;
+    long long remaining_entries = count;
+    CacheStats delta = {0};
+    int first_kept = 0;
+
+    if (total_bytes > max_cache_bytes || remaining_entries > max_cache_entries) {
+        while (first_kept < count && (total_bytes > target_bytes || remaining_entries > target_entries)) {
+            if (unlink(candidates[first_kept].path) == 0) {
+                total_bytes -= candidates[first_kept].size;
+                remaining_entries--;
+                delta.evictions++;
+            }
+            first_kept++;
+        }
+    }
+
+    FILE* compact = fopen(compact_path, "w");
+    if (compact) {
+        for (int i = first_kept; i < count; i++) {
+            fprintf(compact, "%lld %s\n", (long long)candidates[i].last_access, candidates[i].path);
+        }
+        if (fclose(compact) != 0 || rename(compact_path, journal_path) != 0) {
+            unlink(compact_path);
+        }
+    }
+
+    delta.bytes = total_bytes;
+    delta.entries = remaining_entries;
+    update_stats(&delta, true, NULL);
+
+    for (int i = 0; i < count; i++) {
+        free(candidates[i].path);
+    }
+    free(candidates);
+    close(lock_fd);
+}
+
+// Returns true in a fully detached, low priority background child (which
+// must finish with _exit) and false in the caller once it has been started.
+bool cache_fork_detached(void) {
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+
+    // Double fork so the worker is reparented and never holds up the shell
+    setsid();
+    if (fork() != 0) _exit(0);
+
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+    }
+    if (nice(10) == -1) {
+        // Not fatal, just runs at normal priority
+    }
+    return true;
+}
+
+void cache_finish(void) {
+    bool needs_eviction = false;
+    pthread_mutex_lock(&cache_lock);
+
+    if (touched_count > 0) {
+        char journal_path[MAX_PATH_LENGTH + 32];
+        state_file_path(journal_path, sizeof(journal_path), "access.journal");
+
+        // O_APPEND keeps records from concurrent runs from interleaving
+        int fd = open(journal_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd >= 0) {
+            long long now = (long long)time(NULL);
+            char record[MAX_PATH_LENGTH + 32];
+            for (int i = 0; i < touched_count; i++) {
+                int len = snprintf(record, sizeof(record), "%lld %s\n", now, touched_paths[i]);
+                if (len > 0 && (size_t)len < sizeof(record)) {
+                    if (write(fd, record, len) != len) break;
+                }
+            }
+
+            // The evictor also compacts the journal, so run it when it gets long
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > CACHE_JOURNAL_MAX_BYTES) {
+                needs_eviction = true;
+            }
+            close(fd);
+        }
+    }
+
+    for (int i = 0; i < touched_count; i++) {
+        free(touched_paths[i]);
+    }
+    free(touched_paths);
+    touched_paths = NULL;
+    touched_count = touched_capacity = 0;
+    if (touched_set) hashmap_clear(touched_set, NULL);
+
+    if (run_stats.hits || run_stats.misses || run_stats.entries) {
+        // Without previous counters the size of an existing cache is
+        // unknown, so let the evictor measure it once
+        CacheStats totals;
+        if (!update_stats(&run_stats, false, &totals) ||
+            totals.bytes > max_cache_bytes || totals.entries > max_cache_entries) {
+            needs_eviction = true;
+        }
+    }
+    memset(&run_stats, 0, sizeof(run_stats));
+
+    pthread_mutex_unlock(&cache_lock);
+
+    if (needs_eviction && cache_fork_detached()) {
+        cache_evict();
+        _exit(0);
+    }
+}
+
+static void format_bytes(long long bytes, char* buffer, size_t size) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = (double)bytes;
+    int unit = 0;
+    while (value >= 1024.0 && unit < 4) {
+        value /= 1024.0;
+        unit++;
+    }
+    snprintf(buffer, size, unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+}
+
+void cache_print_stats(FILE* out) {
+    CacheStats stats;
+    read_stats(&stats);
+
+    // Report the real size rather than the running estimate
+    long long bytes = 0;
+    long long entries = 0;
+    DIR* dir = opendir(CACHE_PATH);
+    if (dir) {
+        int fd = dirfd(dir);
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            struct stat st;
+            if (entry->d_name[0] == '.') continue;
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+                bytes += st.st_size;
+                entries++;
+            }
+        }
+        closedir(dir);
+    }
+
+    char size_text[32];
+    char budget_text[32];
+    format_bytes(bytes, size_text, sizeof(size_text));
+    format_bytes(max_cache_bytes, budget_text, sizeof(budget_text));
+
+    long long lookups = stats.hits + stats.misses;
+    double hit_rate = lookups ? 100.0 * (double)stats.hits / (double)lookups : 0.0;
+
+    fprintf(out, "Cache directory: %s\n", CACHE_PATH);
+    fprintf(out, "Size:            %s of %s (%lld of %lld entries)\n",
+            size_text, budget_text, entries, max_cache_entries);
+    if (stats.bytes != bytes) {
+        char tracked_text[32];
+        format_bytes(stats.bytes, tracked_text, sizeof(tracked_text));
+        fprintf(out, "Tracked size:    %s incl. thumbnails (%lld entries)\n", tracked_text, stats.entries);
+    }
+    fprintf(out, "Hit rate:        %.1f%% (%lld hits, %lld misses)\n", hit_rate, stats.hits, stats.misses);
+    fprintf(out, "Evictions:       %lld\n", stats.evictions);
+}
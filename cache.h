@@ -0,0 +1,50 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "config.h"
+
+// The rendered icon cache lives in ~/.local/share/ils/icons and is kept
+// within a byte and entry budget. Accesses are appended to a small journal
+// at exit; when the estimated size exceeds the budget a detached child
+// evicts least recently used entries, so listings never wait on it.
+
+void cache_init(void);
+void cache_set_limits(long long max_bytes, long long max_entries);
+const char* cache_directory(void);
+const char* cache_state_directory(void);
+void ensure_cache_directory(void);
+
+// Every fill is written to a temp file next to the entry and renamed into
+// place, so readers never see partial files. A lock file created with
+// O_EXCL makes sure concurrent ils processes generate each key only once.
+typedef struct {
+    char temp_path[MAX_PATH_LENGTH + 64];
+    char lock_path[MAX_PATH_LENGTH + 64];
+} CacheFill;
+
+bool cache_begin_fill(const char* path, CacheFill* fill);
+
+// For entries that go out of date: an existing file only counts as filled
+// when `current` says so, and a stale one is replaced by the rename
+typedef bool (*CacheFillCurrent)(const char* path, const void* context);
+bool cache_begin_refill(const char* path, CacheFill* fill, CacheFillCurrent current, const void* context);
+bool cache_end_fill(const char* path, CacheFill* fill, bool produced);
+
+bool cache_lookup(const char* path);
+void cache_record_access(const char* path, bool hit);
+void cache_filled(const char* path);
+void cache_finish(void);
+bool cache_fork_detached(void);
+
+// Conversions that failed are remembered for CACHE_FAILURE_TTL_SECONDS so
+// later runs go straight to the fallback icon. The key covers the source
+// (and its mtime and size when it is a file), the icon size and the
+// converter binaries named in `tools`, so changing any of them retries.
+bool cache_known_failure(const char* kind, const char* source, int size, const char* tools);
+void cache_record_failure(const char* kind, const char* source, int size, const char* tools);
+
+void cache_print_stats(FILE* out);
+
+#endif
@@ -8,11 +8,23 @@
 #define OUTPUT_CHUNK_SIZE 8192
 #define MIN_COLUMN_WIDTH 5
 #define COLUMN_PADDING 1
+#define MAX_ENUMERATION_THREADS 8
+#define DEFER_THUMBNAILS 0
+#define KITTY_ATLAS 0
+#define KITTY_PLACEHOLDERS 0
+#define ICON_CELL_COLUMNS 4
+#define ICON_CELL_ROWS 2
+#define DEFAULT_CELL_WIDTH 10
+#define DEFAULT_CELL_HEIGHT 20
 
 #define ICON_SIZE_16 16
 #define ICON_SIZE_32 32
 #define ICON_SIZE_64 64
 #define DEFAULT_ICON_SIZE ICON_SIZE_64
+#define MIN_ICON_SIZE 8
+#define MAX_ICON_SIZE 512
+#define TERM_QUERY_TIMEOUT_MS 100
+#define TERM_PROBE_TTL_SECONDS (30 * 24 * 60 * 60)
 
 typedef enum {
     PROTOCOL_KITTY,
@@ -20,10 +32,44 @@ typedef enum {
     PROTOCOL_LSD
 } GraphicsProtocol;
 
+// How kitty receives icon pixels: PNG data, zlib-compressed raw RGBA, or
+// the path of the cached PNG for the terminal to read itself. Auto picks
+// RGBA over SSH and file paths otherwise.
+typedef enum {
+    KITTY_TRANSFER_AUTO,
+    KITTY_TRANSFER_PNG,
+    KITTY_TRANSFER_RGBA,
+    KITTY_TRANSFER_FILE
+} KittyTransfer;
+
+#define KITTY_TRANSFER KITTY_TRANSFER_AUTO
+
 #define ICON_BASE_PATH "/usr/share/icons"
 #define DEFAULT_THEME "Coffee"
 
 #define CACHE_DIRECTORY_PATH ".local/share/ils/icons"
+#define CACHE_MAX_BYTES (256LL * 1024 * 1024)
+#define CACHE_MAX_ENTRIES 20000
+#define CACHE_JOURNAL_MAX_BYTES (1024 * 1024)
+#define CACHE_LOCK_STALE_SECONDS 30
+#define CACHE_FILL_WAIT_MS 10000
+#define CACHE_FILL_POLL_MS 10
+#define CACHE_FAILURE_TTL_SECONDS (7 * 24 * 60 * 60)
+
+#define DAEMON_TIMEOUT_MS 2000
+#define DAEMON_MAX_ENTRIES (1 << 20)
+#define DAEMON_PAYLOAD_BUDGET (64 * 1024 * 1024)
+#define DAEMON_RESOLVED_MAX 65536
+#define DAEMON_IDLE_MS 200
+#define DAEMON_IDLE_MAX_REQUESTS 1024
+
+#define SNIFF_READ_BYTES 512
+#define SNIFF_BATCH_SIZE 32
+#define SNIFF_CACHE_MAX_ENTRIES 100000
+
+#define DETAILS_DAY_CACHE_SIZE 64
+
+#define WATCH_SETTLE_MS 50
 
 #define RESET   "\x1B[0m"
 #define RED     "\x1B[31m"
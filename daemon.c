@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "config.h"
+#include "daemon.h"
+
+#define DAEMON_MAGIC "ILS2"
+
+static bool daemon_socket_path(char* path, size_t size) {
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && runtime_dir[0] == '/') {
+        snprintf(path, size, "%s/ils.sock", runtime_dir);
+    } else {
+        // Private per-user directory under /tmp, refuse one we do not own
+        char dir[64];
+        snprintf(dir, sizeof(dir), "/tmp/ils-%d", (int)getuid());
+        mkdir(dir, 0700);
+
+        struct stat st;
+        if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()) {
+            return false;
+        }
+        snprintf(path, size, "%s/ils.sock", dir);
+    }
+    return strlen(path) < sizeof(((struct sockaddr_un*)0)->sun_path);
+}
+
+static void set_timeout(int fd, int milliseconds) {
+    struct timeval timeout = { milliseconds / 1000, (milliseconds % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+int daemon_connect(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!daemon_socket_path(addr.sun_path, sizeof(addr.sun_path))) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // A wedged daemon must never hang a listing; the client falls back
+    set_timeout(fd, DAEMON_TIMEOUT_MS);
+    return fd;
+}
+
+static bool write_all(int fd, const void* data, size_t length) {
+    const char* p = data;
+    while (length > 0) {
+        ssize_t written = send(fd, p, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        p += written;
+        length -= written;
+    }
+    return true;
+}
+
+static bool read_all(FILE* in, void* data, size_t length) {
+    return fread(data, 1, length, in) == length;
+}
+
+// Reads "<numbers...>\n" headers; exactly one newline terminates them so
+// the raw bytes that follow may start with whitespace.
+static bool read_header_end(FILE* in) {
+    return fgetc(in) == '\n';
+}
+
+bool daemon_request(int fd, int protocol, int transfer, int icon_size, const char* cwd,
+                    const DaemonEntry* entries, int count, DaemonPayload* payloads) {
+    size_t capacity = OUTPUT_CHUNK_SIZE;
+    size_t length = 0;
+    char* request = malloc(capacity);
+    if (!request) return false;
+
+    // Requests are assembled in one buffer and sent with a single write
+    for (int i = -1; i < count; i++) {
+        char header[128];
+        const char* first;
+        const char* second;
+        int header_length;
+
+        if (i < 0) {
+            header_length = snprintf(header, sizeof(header), "%s %d %d %d %d %zu\n",
+                                     DAEMON_MAGIC, protocol, transfer, icon_size, count, strlen(cwd));
+            first = cwd;
+            second = "";
+        } else {
+            header_length = snprintf(header, sizeof(header), "%o %zu %zu\n",
+                                     (unsigned int)entries[i].mode, strlen(entries[i].name), strlen(entries[i].path));
+            first = entries[i].name;
+            second = entries[i].path;
+        }
+
+        size_t needed = length + header_length + strlen(first) + strlen(second);
+        if (needed > capacity) {
+            while (needed > capacity) capacity *= 2;
+            char* tmp = realloc(request, capacity);
+            if (!tmp) {
+                free(request);
+                return false;
+            }
+            request = tmp;
+        }
+
+        memcpy(request + length, header, header_length);
+        length += header_length;
+        memcpy(request + length, first, strlen(first));
+        length += strlen(first);
+        memcpy(request + length, second, strlen(second));
+        length += strlen(second);
+    }
+
+    bool ok = write_all(fd, request, length);
+    free(request);
+    if (!ok) return false;
+
+    int in_fd = dup(fd);
+    FILE* in = in_fd >= 0 ? fdopen(in_fd, "r") : NULL;
+    if (!in) {
+        if (in_fd >= 0) close(in_fd);
+        return false;
+    }
+
+    int answered = -1;
+    ok = fscanf(in, DAEMON_MAGIC " %d", &answered) == 1 && read_header_end(in) && answered == count;
+
+    int received = 0;
+    for (; ok && received < count; received++) {
+        size_t payload_length;
+        if (fscanf(in, "%zu", &payload_length) != 1 || !read_header_end(in)) {
+            ok = false;
+            break;
+        }
+
+        payloads[received].length = payload_length;
+        payloads[received].data = NULL;
+        if (payload_length == 0) continue;
+
+        payloads[received].data = malloc(payload_length);
+        if (!payloads[received].data || !read_all(in, payloads[received].data, payload_length)) {
+            free(payloads[received].data);
+            payloads[received].data = NULL;
+            ok = false;
+            break;
+        }
+    }
+
+    if (!ok) {
+        for (int i = 0; i < received; i++) {
+            free(payloads[i].data);
+            payloads[i].data = NULL;
+        }
+    }
+
+    fclose(in);
+    return ok;
+}
+
+static char* read_string(FILE* in, size_t length) {
+    if (length > MAX_PATH_LENGTH * 4) return NULL;
+
+    char* value = malloc(length + 1);
+    if (!value) return NULL;
+    if (!read_all(in, value, length)) {
+        free(value);
+        return NULL;
+    }
+    value[length] = '\0';
+    return value;
+}
+
+// Serve every request on one connection until the client hangs up
+static void serve_client(int fd, DaemonHandler handler) {
+    int in_fd = dup(fd);
+    FILE* in = in_fd >= 0 ? fdopen(in_fd, "r") : NULL;
+    if (!in) {
+        if (in_fd >= 0) close(in_fd);
+        return;
+    }
+
+    for (;;) {
+        int protocol, transfer, icon_size, count;
+        size_t cwd_length;
+        if (fscanf(in, DAEMON_MAGIC " %d %d %d %d %zu", &protocol, &transfer, &icon_size, &count, &cwd_length) != 5 ||
+            !read_header_end(in) || count < 0 || count > DAEMON_MAX_ENTRIES) {
+            break;
+        }
+
+        char* cwd = read_string(in, cwd_length);
+        DaemonEntry* entries = calloc(count ? count : 1, sizeof(DaemonEntry));
+        DaemonPayload* payloads = calloc(count ? count : 1, sizeof(DaemonPayload));
+        bool ok = cwd && entries && payloads;
+
+        int parsed = 0;
+        for (; ok && parsed < count; parsed++) {
+            unsigned int mode;
+            size_t name_length, path_length;
+            if (fscanf(in, "%o %zu %zu", &mode, &name_length, &path_length) != 3 || !read_header_end(in)) {
+                ok = false;
+                break;
+            }
+            entries[parsed].mode = (mode_t)mode;
+            entries[parsed].name = read_string(in, name_length);
+            entries[parsed].path = read_string(in, path_length);
+            if (!entries[parsed].name || !entries[parsed].path) {
+                parsed++;
+                ok = false;
+                break;
+            }
+        }
+
+        if (ok) {
+            handler(protocol, transfer, icon_size, cwd, entries, count, payloads);
+
+            char header[64];
+            int header_length = snprintf(header, sizeof(header), "%s %d\n", DAEMON_MAGIC, count);
+            ok = write_all(fd, header, header_length);
+            for (int i = 0; ok && i < count; i++) {
+                header_length = snprintf(header, sizeof(header), "%zu\n", payloads[i].length);
+                ok = write_all(fd, header, header_length) &&
+                     (payloads[i].length == 0 || write_all(fd, payloads[i].data, payloads[i].length));
+            }
+        }
+
+        for (int i = 0; i < parsed; i++) {
+            free((char*)entries[i].name);
+            free((char*)entries[i].path);
+        }
+        free(entries);
+        free(payloads);
+        free(cwd);
+
+        if (!ok) break;
+    }
+
+    fclose(in);
+}
+
+int daemon_serve(DaemonHandler handler, DaemonIdle idle) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!daemon_socket_path(addr.sun_path, sizeof(addr.sun_path))) {
+        fprintf(stderr, "ils: no private directory for the daemon socket\n");
+        return 1;
+    }
+
+    // Refuse to replace a live daemon, but clean up after a dead one
+    int probe = daemon_connect();
+    if (probe >= 0) {
+        close(probe);
+        fprintf(stderr, "ils: daemon already running on %s\n", addr.sun_path);
+        return 1;
+    }
+    unlink(addr.sun_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("ils: socket");
+        return 1;
+    }
+
+    mode_t old_umask = umask(077);
+    int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_umask);
+
+    if (bound != 0 || listen(fd, 16) != 0) {
+        fprintf(stderr, "ils: cannot listen on %s: %s\n", addr.sun_path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "ils: daemon listening on %s\n", addr.sun_path);
+
+    // Bookkeeping waits for a quiet moment instead of a client, or for
+    // enough clients that it cannot be put off any longer
+    int served = 0;
+    for (;;) {
+        if (served >= DAEMON_IDLE_MAX_REQUESTS) {
+            idle();
+            served = 0;
+        } else if (served > 0) {
+            struct pollfd listener = { fd, POLLIN, 0 };
+            int ready = poll(&listener, 1, DAEMON_IDLE_MS);
+            if (ready == 0) {
+                idle();
+                served = 0;
+                continue;
+            }
+            if (ready < 0 && errno != EINTR) break;
+        }
+        
+        int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("ils: accept");
+            break;
+        }
+
+        // Only the owning user may use the resident state
+        struct ucred credentials;
+        socklen_t credentials_length = sizeof(credentials);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) == 0 &&
+            credentials.uid == getuid()) {
+            set_timeout(client, DAEMON_TIMEOUT_MS);
+            serve_client(client, handler);
+            served++;
+        }
+        close(client);
+    }
+
+    if (served > 0) idle();
+    close(fd);
+    unlink(addr.sun_path);
+    return 1;
+}
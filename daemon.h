@@ -0,0 +1,36 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// `ils --daemon` keeps the theme index, resolved icons and encoded image
+// payloads in memory and answers listings over a per-user Unix socket.
+// Clients send each entry's mode, name and path and get back the bytes to
+// emit for its icon; without a daemon they simply resolve everything
+// themselves.
+
+typedef struct {
+    mode_t mode;
+    const char* name;
+    const char* path;
+} DaemonEntry;
+
+typedef struct {
+    char* data;
+    size_t length;
+} DaemonPayload;
+
+typedef void (*DaemonHandler)(int protocol, int transfer, int icon_size, const char* cwd,
+                              const DaemonEntry* entries, int count, DaemonPayload* payloads);
+
+int daemon_connect(void);
+bool daemon_request(int fd, int protocol, int transfer, int icon_size, const char* cwd,
+                    const DaemonEntry* entries, int count, DaemonPayload* payloads);
+// Called once no request has come in for DAEMON_IDLE_MS after the last one
+typedef void (*DaemonIdle)(void);
+
+int daemon_serve(DaemonHandler handler, DaemonIdle idle);
+
+#endif
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "details.h"
+
+// GNU ls's cut-off between showing the time and the year
+#define RECENT_SECONDS (31556952 / 2)
+
+typedef struct {
+    uint32_t id;
+    char* name;         // NULL marks an empty slot
+} NameSlot;
+
+typedef struct {
+    NameSlot* slots;
+    uint32_t size;
+    uint32_t count;
+} NameTable;
+
+typedef struct {
+    time_t start;       // Local midnight
+    time_t end;         // The next one; start == end when unused
+    int year;
+    char date[16];      // "Jan  5"
+} DayEntry;
+
+static NameTable users = {0};
+static NameTable groups = {0};
+static DayEntry days[DETAILS_DAY_CACHE_SIZE];
+static time_t now = 0;
+
+void details_mode(mode_t mode, char text[11]) {
+    text[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' :
+              S_ISBLK(mode) ? 'b' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : '-';
+    text[1] = mode & S_IRUSR ? 'r' : '-';
+    text[2] = mode & S_IWUSR ? 'w' : '-';
+    text[3] = mode & S_ISUID ? (mode & S_IXUSR ? 's' : 'S') : (mode & S_IXUSR ? 'x' : '-');
+    text[4] = mode & S_IRGRP ? 'r' : '-';
+    text[5] = mode & S_IWGRP ? 'w' : '-';
+    text[6] = mode & S_ISGID ? (mode & S_IXGRP ? 's' : 'S') : (mode & S_IXGRP ? 'x' : '-');
+    text[7] = mode & S_IROTH ? 'r' : '-';
+    text[8] = mode & S_IWOTH ? 'w' : '-';
+    text[9] = mode & S_ISVTX ? (mode & S_IXOTH ? 't' : 'T') : (mode & S_IXOTH ? 'x' : '-');
+    text[10] = '\0';
+}
+
+static uint32_t id_hash(uint32_t id) {
+    id ^= id >> 16;
+    id *= 0x7FEB352DU;
+    id ^= id >> 15;
+    return id;
+}
+
+static NameSlot* find_slot(NameTable* table, uint32_t id) {
+    uint32_t mask = table->size - 1;
+    uint32_t index = id_hash(id) & mask;
+    while (table->slots[index].name && table->slots[index].id != id) {
+        index = (index + 1) & mask;
+    }
+    return &table->slots[index];
+}
+
+static bool grow_table(NameTable* table) {
+    uint32_t size = table->size ? table->size * 2 : 64;
+    NameSlot* slots = calloc(size, sizeof(NameSlot));
+    if (!slots) return false;
+
+    NameTable grown = { slots, size, table->count };
+    for (uint32_t i = 0; i < table->size; i++) {
+        if (table->slots[i].name) *find_slot(&grown, table->slots[i].id) = table->slots[i];
+    }
+    free(table->slots);
+    *table = grown;
+    return true;
+}
+
+// Ids without a name are remembered as their number, so they are not
+// looked up again either
+static const char* lookup_name(NameTable* table, uint32_t id, bool group) {
+    if ((table->count + 1) * 2 > table->size && !grow_table(table)) return "?";
+
+    NameSlot* slot = find_slot(table, id);
+    if (slot->name) return slot->name;
+
+    const char* name = NULL;
+    if (group) {
+        struct group* entry = getgrgid(id);
+        if (entry) name = entry->gr_name;
+    } else {
+        struct passwd* entry = getpwuid(id);
+        if (entry) name = entry->pw_name;
+    }
+
+    char number[16];
+    if (!name) {
+        snprintf(number, sizeof(number), "%u", id);
+        name = number;
+    }
+    slot->name = strdup(name);
+    if (!slot->name) return "?";
+    slot->id = id;
+    table->count++;
+    return slot->name;
+}
+
+const char* details_user(uid_t uid) {
+    return lookup_name(&users, (uint32_t)uid, false);
+}
+
+const char* details_group(gid_t gid) {
+    return lookup_name(&groups, (uint32_t)gid, true);
+}
+
+// The local day holding `when`. Days that are not 24 hours long (DST
+// changes) are not cached, since the time of day cannot be worked out
+// from the offset to midnight.
+static const DayEntry* find_day(time_t when) {
+    long long day_number = (long long)when / 86400;
+    DayEntry* day = &days[((day_number % DETAILS_DAY_CACHE_SIZE) + DETAILS_DAY_CACHE_SIZE) % DETAILS_DAY_CACHE_SIZE];
+    if (when >= day->start && when < day->end) return day;
+
+    struct tm local;
+    if (!localtime_r(&when, &local)) return NULL;
+
+    struct tm midnight = local;
+    midnight.tm_hour = midnight.tm_min = midnight.tm_sec = 0;
+    midnight.tm_isdst = -1;
+    time_t start = mktime(&midnight);
+
+    midnight = local;
+    midnight.tm_mday++;
+    midnight.tm_hour = midnight.tm_min = midnight.tm_sec = 0;
+    midnight.tm_isdst = -1;
+    time_t end = mktime(&midnight);
+    if (end - start != 86400 || when < start || when >= end) return NULL;
+
+    day->start = start;
+    day->end = end;
+    day->year = local.tm_year + 1900;
+    strftime(day->date, sizeof(day->date), "%b %e", &local);
+    return day;
+}
+
+void details_time(time_t when, char text[32]) {
+    if (now == 0) now = time(NULL);
+
+    const DayEntry* day = find_day(when);
+    bool recent = when > now - RECENT_SECONDS && when <= now + RECENT_SECONDS;
+
+    if (!day) {
+        struct tm local;
+        if (!localtime_r(&when, &local)) {
+            snprintf(text, 32, "%lld", (long long)when);
+        } else if (recent) {
+            strftime(text, 32, "%b %e %H:%M", &local);
+        } else {
+            strftime(text, 32, "%b %e  %Y", &local);
+        }
+        return;
+    }
+
+    if (recent) {
+        int seconds = (int)(when - day->start);
+        snprintf(text, 32, "%s %02d:%02d", day->date, seconds / 3600, seconds / 60 % 60);
+    } else {
+        snprintf(text, 32, "%s  %d", day->date, day->year);
+    }
+}
+
+static void free_table(NameTable* table) {
+    for (uint32_t i = 0; i < table->size; i++) {
+        free(table->slots[i].name);
+    }
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+void details_cleanup(void) {
+    free_table(&users);
+    free_table(&groups);
+    memset(days, 0, sizeof(days));
+    now = 0;
+}
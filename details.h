@@ -0,0 +1,25 @@
+#ifndef DETAILS_H
+#define DETAILS_H
+
+#include <sys/types.h>
+#include <time.h>
+
+// Fields for the long listing. User and group names are looked up once
+// per id, since every getpwuid may be a round trip to a directory
+// service, and dates are formatted from a small cache of local days, so
+// localtime runs once per distinct day rather than once per row.
+
+// "drwxr-xr-x" plus a NUL
+void details_mode(mode_t mode, char text[11]);
+
+// The name for an id, or the id in decimal when it has none. The strings
+// live until details_cleanup.
+const char* details_user(uid_t uid);
+const char* details_group(gid_t gid);
+
+// "Jan  5 12:34" within six months of now, "Jan  5  2023" otherwise
+void details_time(time_t when, char text[32]);
+
+void details_cleanup(void);
+
+#endif
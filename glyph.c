@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include "glyph.h"
+#include "png.h"
+
+#ifdef HAVE_FREETYPE
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <fontconfig/fontconfig.h>
+
+#define MAX_GLYPH_FACES 16
+#define MAX_GLYPH_CODEPOINTS 8
+
+typedef struct {
+    char* file;
+    int index;
+    FT_Face face;
+} GlyphFace;
+
+typedef struct {
+    unsigned char* pixels;  // premultiplied RGBA while compositing
+    int width;
+    int height;
+    int min_x, min_y, max_x, max_y;
+} Canvas;
+
+static pthread_mutex_t glyph_lock = PTHREAD_MUTEX_INITIALIZER;
+static FT_Library library = NULL;
+static FcFontSet* fonts = NULL;
+static bool init_failed = false;
+static GlyphFace faces[MAX_GLYPH_FACES];
+static int face_count = 0;
+
+// Fontconfig is only loaded when the first glyph misses the cache; every
+// installed font is sorted once so per-codepoint fallback is a list walk.
+static bool glyph_init(void) {
+    if (library || init_failed) return library != NULL;
+    init_failed = true;
+
+    if (!FcInit()) return false;
+
+    FcPattern* pattern = FcNameParse((const FcChar8*)"monospace");
+    if (!pattern) return false;
+    FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+
+    FcResult result;
+    fonts = FcFontSort(NULL, pattern, FcFalse, NULL, &result);
+    FcPatternDestroy(pattern);
+    if (!fonts || fonts->nfont == 0) return false;
+
+    if (FT_Init_FreeType(&library) != 0) {
+        library = NULL;
+        return false;
+    }
+
+    init_failed = false;
+    return true;
+}
+
+static FT_Face open_face(const char* file, int index) {
+    for (int i = 0; i < face_count; i++) {
+        if (faces[i].index == index && strcmp(faces[i].file, file) == 0) {
+            return faces[i].face;
+        }
+    }
+
+    FT_Face face;
+    if (FT_New_Face(library, file, index, &face) != 0) return NULL;
+
+    // Recycle the oldest slot once the table is full
+    if (face_count == MAX_GLYPH_FACES) {
+        FT_Done_Face(faces[0].face);
+        free(faces[0].file);
+        memmove(faces, faces + 1, (MAX_GLYPH_FACES - 1) * sizeof(GlyphFace));
+        face_count--;
+    }
+
+    faces[face_count].file = strdup(file);
+    faces[face_count].index = index;
+    faces[face_count].face = face;
+    face_count++;
+    return face;
+}
+
+static bool is_emoji_codepoint(uint32_t cp) {
+    return (cp >= 0x1F000 && cp <= 0x1FAFF) || (cp >= 0x2600 && cp <= 0x27BF) ||
+           (cp >= 0x2B00 && cp <= 0x2BFF);
+}
+
+static FT_Face find_face(uint32_t cp) {
+    // Emoji try colour fonts first; nerd-font glyphs live in the private
+    // use area, so the charset test alone finds the patched fonts
+    for (int pass = is_emoji_codepoint(cp) ? 0 : 1; pass < 2; pass++) {
+        for (int i = 0; i < fonts->nfont; i++) {
+            FcPattern* font = fonts->fonts[i];
+
+            FcCharSet* charset;
+            if (FcPatternGetCharSet(font, FC_CHARSET, 0, &charset) != FcResultMatch ||
+                !FcCharSetHasChar(charset, cp)) {
+                continue;
+            }
+
+#ifdef FC_COLOR
+            if (pass == 0) {
+                FcBool color;
+                if (FcPatternGetBool(font, FC_COLOR, 0, &color) != FcResultMatch || !color) continue;
+            }
+#endif
+
+            FcChar8* file;
+            int index = 0;
+            if (FcPatternGetString(font, FC_FILE, 0, &file) != FcResultMatch) continue;
+            FcPatternGetInteger(font, FC_INDEX, 0, &index);
+
+            FT_Face face = open_face((const char*)file, index);
+            if (face) return face;
+        }
+    }
+    return NULL;
+}
+
+static int decode_utf8(const char* text, uint32_t* codepoints, int max) {
+    const unsigned char* p = (const unsigned char*)text;
+    int count = 0;
+
+    while (*p && count < max) {
+        uint32_t cp;
+        int extra;
+        if (*p < 0x80) { cp = *p; extra = 0; }
+        else if ((*p & 0xE0) == 0xC0) { cp = *p & 0x1F; extra = 1; }
+        else if ((*p & 0xF0) == 0xE0) { cp = *p & 0x0F; extra = 2; }
+        else if ((*p & 0xF8) == 0xF0) { cp = *p & 0x07; extra = 3; }
+        else { p++; continue; }
+
+        p++;
+        for (int i = 0; i < extra; i++, p++) {
+            if ((*p & 0xC0) != 0x80) return count;
+            cp = (cp << 6) | (*p & 0x3F);
+        }
+
+        // Whitespace pads lsd icons, selectors and joiners need shaping we don't do
+        if (cp > 0x20 && cp != 0xFE0E && cp != 0xFE0F && cp != 0x200D) {
+            codepoints[count++] = cp;
+        }
+    }
+    return count;
+}
+
+// Premultiplied RGBA of one bitmap pixel
+static void read_pixel(const FT_Bitmap* bitmap, int x, int y, uint32_t rgb, unsigned int out[4]) {
+    const unsigned char* row = bitmap->pitch >= 0
+        ? bitmap->buffer + y * bitmap->pitch
+        : bitmap->buffer + (bitmap->rows - 1 - y) * -bitmap->pitch;
+    unsigned int alpha;
+
+    switch (bitmap->pixel_mode) {
+        case FT_PIXEL_MODE_BGRA:
+            out[0] = row[x * 4 + 2];
+            out[1] = row[x * 4 + 1];
+            out[2] = row[x * 4];
+            out[3] = row[x * 4 + 3];
+            return;
+        case FT_PIXEL_MODE_MONO:
+            alpha = (row[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0;
+            break;
+        case FT_PIXEL_MODE_GRAY:
+            alpha = row[x];
+            break;
+        default:
+            alpha = 0;
+            break;
+    }
+
+    out[0] = ((rgb >> 16) & 0xFF) * alpha / 255;
+    out[1] = ((rgb >> 8) & 0xFF) * alpha / 255;
+    out[2] = (rgb & 0xFF) * alpha / 255;
+    out[3] = alpha;
+}
+
+// Composite a glyph bitmap at (left, top), box-filtering bitmap strikes
+// (colour emoji) down by `scale`
+static void draw_bitmap(Canvas* canvas, const FT_Bitmap* bitmap, int left, int top, double scale, uint32_t rgb) {
+    int width = (int)(bitmap->width * scale + 0.5);
+    int height = (int)(bitmap->rows * scale + 0.5);
+
+    for (int dy = 0; dy < height; dy++) {
+        int y = top + dy;
+        if (y < 0 || y >= canvas->height) continue;
+
+        int sy0 = (int)(dy / scale);
+        int sy1 = (int)((dy + 1) / scale);
+        if (sy1 <= sy0) sy1 = sy0 + 1;
+        if (sy1 > (int)bitmap->rows) sy1 = bitmap->rows;
+
+        for (int dx = 0; dx < width; dx++) {
+            int x = left + dx;
+            if (x < 0 || x >= canvas->width) continue;
+
+            int sx0 = (int)(dx / scale);
+            int sx1 = (int)((dx + 1) / scale);
+            if (sx1 <= sx0) sx1 = sx0 + 1;
+            if (sx1 > (int)bitmap->width) sx1 = bitmap->width;
+
+            unsigned int sum[4] = {0, 0, 0, 0};
+            int samples = 0;
+            for (int sy = sy0; sy < sy1; sy++) {
+                for (int sx = sx0; sx < sx1; sx++) {
+                    unsigned int pixel[4];
+                    read_pixel(bitmap, sx, sy, rgb, pixel);
+                    for (int c = 0; c < 4; c++) sum[c] += pixel[c];
+                    samples++;
+                }
+            }
+            if (samples == 0 || sum[3] == 0) continue;
+
+            unsigned char* dst = canvas->pixels + ((size_t)y * canvas->width + x) * 4;
+            unsigned int alpha = sum[3] / samples;
+            for (int c = 0; c < 4; c++) {
+                dst[c] = (unsigned char)(sum[c] / samples + dst[c] * (255 - alpha) / 255);
+            }
+
+            if (x < canvas->min_x) canvas->min_x = x;
+            if (y < canvas->min_y) canvas->min_y = y;
+            if (x > canvas->max_x) canvas->max_x = x;
+            if (y > canvas->max_y) canvas->max_y = y;
+        }
+    }
+}
+
+static bool render_glyphs(Canvas* canvas, const uint32_t* codepoints, int count, int font_size, uint32_t rgb) {
+    int pen_x = font_size;
+    int baseline = canvas->height * 3 / 4;
+
+    for (int i = 0; i < count; i++) {
+        FT_Face face = find_face(codepoints[i]);
+        if (!face) continue;
+
+        FT_UInt index = FT_Get_Char_Index(face, codepoints[i]);
+        if (index == 0) continue;
+
+        double scale = 1.0;
+        if (FT_IS_SCALABLE(face)) {
+            FT_Set_Pixel_Sizes(face, 0, font_size);
+        } else if (face->num_fixed_sizes > 0) {
+            // Bitmap-only colour fonts: smallest strike that is big enough
+            int best = 0;
+            for (int s = 1; s < face->num_fixed_sizes; s++) {
+                int height = face->available_sizes[s].height;
+                int best_height = face->available_sizes[best].height;
+                if ((best_height < font_size && height > best_height) ||
+                    (height >= font_size && height < best_height)) {
+                    best = s;
+                }
+            }
+            FT_Select_Size(face, best);
+            scale = (double)font_size / face->available_sizes[best].height;
+        } else {
+            continue;
+        }
+
+        if (FT_Load_Glyph(face, index, FT_LOAD_RENDER | FT_LOAD_COLOR) != 0) continue;
+
+        FT_GlyphSlot slot = face->glyph;
+        draw_bitmap(canvas, &slot->bitmap,
+                    pen_x + (int)(slot->bitmap_left * scale),
+                    baseline - (int)(slot->bitmap_top * scale), scale, rgb);
+        pen_x += (int)((slot->advance.x >> 6) * scale);
+    }
+
+    return canvas->max_x >= canvas->min_x;
+}
+
+bool glyph_render_png(const char* text, int size, uint32_t rgb, const char* png_path) {
+    uint32_t codepoints[MAX_GLYPH_CODEPOINTS];
+    int count = decode_utf8(text, codepoints, MAX_GLYPH_CODEPOINTS);
+    if (count == 0) return false;
+
+    int font_size = (size * 6) / 10;
+    if (font_size < 12) font_size = 12;
+    if (font_size > size - 4) font_size = size - 4;
+
+    // Lay out on a roomy canvas, then centre the ink in the icon
+    Canvas canvas = { NULL, font_size * (count + 2), font_size * 3, INT_MAX, INT_MAX, -1, -1 };
+    canvas.pixels = calloc((size_t)canvas.width * canvas.height, 4);
+    unsigned char* icon = calloc((size_t)size * size, 4);
+    if (!canvas.pixels || !icon) {
+        free(canvas.pixels);
+        free(icon);
+        return false;
+    }
+
+    pthread_mutex_lock(&glyph_lock);
+    bool drawn = glyph_init() && render_glyphs(&canvas, codepoints, count, font_size, rgb);
+    pthread_mutex_unlock(&glyph_lock);
+
+    bool ok = false;
+    if (drawn) {
+        int ink_width = canvas.max_x - canvas.min_x + 1;
+        int ink_height = canvas.max_y - canvas.min_y + 1;
+        int offset_x = (size - ink_width) / 2 - canvas.min_x;
+        int offset_y = (size - ink_height) / 2 - canvas.min_y;
+
+        for (int y = 0; y < size; y++) {
+            int sy = y - offset_y;
+            if (sy < 0 || sy >= canvas.height) continue;
+            for (int x = 0; x < size; x++) {
+                int sx = x - offset_x;
+                if (sx < 0 || sx >= canvas.width) continue;
+
+                const unsigned char* src = canvas.pixels + ((size_t)sy * canvas.width + sx) * 4;
+                unsigned char* dst = icon + ((size_t)y * size + x) * 4;
+                if (src[3] == 0) continue;
+
+                // PNG wants straight alpha
+                for (int c = 0; c < 3; c++) {
+                    unsigned int value = src[c] * 255u / src[3];
+                    dst[c] = (unsigned char)(value > 255 ? 255 : value);
+                }
+                dst[3] = src[3];
+            }
+        }
+
+        ok = png_write_rgba(png_path, icon, size, size);
+    }
+
+    free(canvas.pixels);
+    free(icon);
+    return ok;
+}
+
+#else
+
+bool glyph_render_png(const char* text, int size, uint32_t rgb, const char* png_path) {
+    (void)text; (void)size; (void)rgb; (void)png_path;
+    return false;
+}
+
+#endif
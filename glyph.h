@@ -0,0 +1,13 @@
+#ifndef GLYPH_H
+#define GLYPH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Renders lsd glyphs straight to a size x size PNG with FreeType, picking
+// a font per codepoint through fontconfig (colour fonts first for emoji).
+// Returns false when built without FreeType or when no font has the glyph,
+// so callers can fall back to other renderers.
+bool glyph_render_png(const char* text, int size, uint32_t rgb, const char* png_path);
+
+#endif
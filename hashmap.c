@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "hashmap.h"
+
+typedef struct HashEntry {
+    char* key;
+    void* value;
+    unsigned int hash;
+    struct HashEntry* next;
+} HashEntry;
+
+struct HashMap {
+    HashEntry** buckets;
+    int bucket_count;
+    int count;
+};
+
+unsigned int hash_string(const char* key) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)key; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+HashMap* hashmap_create(int bucket_count) {
+    HashMap* map = malloc(sizeof(HashMap));
+    if (!map) return NULL;
+
+    map->bucket_count = bucket_count > 16 ? bucket_count : 16;
+    map->buckets = calloc(map->bucket_count, sizeof(HashEntry*));
+    map->count = 0;
+    if (!map->buckets) {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void* hashmap_get(const HashMap* map, const char* key) {
+    unsigned int hash = hash_string(key);
+    for (HashEntry* entry = map->buckets[hash % map->bucket_count]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            return entry->value;
+        }
+    }
+    return NULL;
+}
+
+static void grow(HashMap* map) {
+    int bucket_count = map->bucket_count * 2;
+    HashEntry** buckets = calloc(bucket_count, sizeof(HashEntry*));
+    if (!buckets) return; // Keep working with longer chains
+
+    for (int i = 0; i < map->bucket_count; i++) {
+        HashEntry* entry = map->buckets[i];
+        while (entry) {
+            HashEntry* next = entry->next;
+            entry->next = buckets[entry->hash % bucket_count];
+            buckets[entry->hash % bucket_count] = entry;
+            entry = next;
+        }
+    }
+
+    free(map->buckets);
+    map->buckets = buckets;
+    map->bucket_count = bucket_count;
+}
+
+// Insert or replace; a replaced value is not freed
+bool hashmap_put(HashMap* map, const char* key, void* value) {
+    unsigned int hash = hash_string(key);
+    for (HashEntry* entry = map->buckets[hash % map->bucket_count]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            entry->value = value;
+            return true;
+        }
+    }
+
+    HashEntry* entry = malloc(sizeof(HashEntry));
+    if (!entry) return false;
+    entry->key = strdup(key);
+    if (!entry->key) {
+        free(entry);
+        return false;
+    }
+    entry->value = value;
+    entry->hash = hash;
+    entry->next = map->buckets[hash % map->bucket_count];
+    map->buckets[hash % map->bucket_count] = entry;
+
+    if (++map->count > map->bucket_count * 2) {
+        grow(map);
+    }
+    return true;
+}
+
+int hashmap_count(const HashMap* map) {
+    return map->count;
+}
+
+void hashmap_clear(HashMap* map, void (*free_value)(void*)) {
+    for (int i = 0; i < map->bucket_count; i++) {
+        HashEntry* entry = map->buckets[i];
+        while (entry) {
+            HashEntry* next = entry->next;
+            if (free_value) free_value(entry->value);
+            free(entry->key);
+            free(entry);
+            entry = next;
+        }
+        map->buckets[i] = NULL;
+    }
+    map->count = 0;
+}
+
+void hashmap_free(HashMap* map, void (*free_value)(void*)) {
+    if (!map) return;
+    hashmap_clear(map, free_value);
+    free(map->buckets);
+    free(map);
+}
@@ -0,0 +1,20 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stdbool.h>
+
+// Small string-keyed chained hash map; keys are copied, values are owned
+// by the caller (pass a free function to clear/free to release them).
+
+typedef struct HashMap HashMap;
+
+unsigned int hash_string(const char* key);
+
+HashMap* hashmap_create(int bucket_count);
+void* hashmap_get(const HashMap* map, const char* key);
+bool hashmap_put(HashMap* map, const char* key, void* value);
+int hashmap_count(const HashMap* map);
+void hashmap_clear(HashMap* map, void (*free_value)(void*));
+void hashmap_free(HashMap* map, void (*free_value)(void*));
+
+#endif
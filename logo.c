@@ -1,31 +1,73 @@
 #define _GNU_SOURCE
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <limits.h>
 #include <dirent.h>
 #include <pwd.h>
 #include "logo.h"
+#include "hashmap.h"
+#include "profile.h"
+#include "trace.h"
+#include "thumbnail.h"
+#include "mime.h"
 
 static ThemeNode* theme_chain = NULL;
 static char default_file_icon[MAX_PATH_LENGTH];
 static char default_directory_icon[MAX_PATH_LENGTH];
 
-// Icon cache entry with proper XDG compliance
-typedef struct IconCacheEntry {
-    char* name;
-    char* path;
-    char* context;
-    char* theme_name;
-    IconDirectory dir_info; // Full directory info for proper size matching
-    struct IconCacheEntry* next;
-} IconCacheEntry;
+// The icon cache holds one record per icon file in the theme chain. Its
+// strings live in a single pool addressed by offset, so the pool can
+// grow. Strings that repeat (contexts, theme names) are stored once, and
+// everything about a theme directory is kept once for all of its icons.
+#define NO_STRING UINT32_MAX
 
-static IconCacheEntry* icon_cache = NULL;
+typedef enum {
+    ICON_DIRECTORY_THRESHOLD,
+    ICON_DIRECTORY_FIXED,
+    ICON_DIRECTORY_SCALABLE,
+    ICON_DIRECTORY_OTHER
+} IconDirectoryType;
+
+typedef struct {
+    uint32_t path;
+    uint32_t context;
+    uint32_t theme_name;
+    int size;
+    int min_size;
+    int max_size;
+    int threshold;
+    IconDirectoryType type;
+} IconDirectoryInfo;
+
+// The icon name is the file name up to its extension
+typedef struct {
+    uint32_t file;
+    uint32_t directory;
+    uint32_t name_length;
+} IconRecord;
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} StringPool;
+
+static StringPool icon_strings = {0};
+static HashMap* interned_strings = NULL;    // String -> offset + 1
+static IconDirectoryInfo* icon_directories = NULL;
+static int icon_directory_count = 0;
+static int icon_directory_capacity = 0;
+static IconRecord* icon_records = NULL;
+static int icon_record_count = 0;
+static int icon_record_capacity = 0;
 
 static const ExtensionMapping extension_mappings[] = {
     {".py", "text/x-python"},
@@ -195,16 +237,6 @@ static const char* get_icon_search_paths(void) {
     return search_paths;
 }
 
-static char* trim(char* str) {
-    char* end;
-    while(isspace((unsigned char)*str)) str++;
-    if(*str == 0) return str;
-    end = str + strlen(str) - 1;
-    while(end > str && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-    return str;
-}
-
 static bool directory_exists(const char* path) {
     struct stat st;
     return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
@@ -250,6 +282,7 @@ static bool has_icon_subdirs(const char* theme_path) {
     
     struct dirent* entry;
     while ((entry = readdir(dir)) != NULL) {
+        profile_count(PROFILE_READDIRS, 1);
         if (entry->d_type == DT_DIR && entry->d_name[0] != '.') {
             // Check if this looks like an icon size directory
             if (extract_size_from_dirname(entry->d_name) > 0 || 
@@ -268,22 +301,14 @@ static bool has_icon_subdirs(const char* theme_path) {
 static void scan_theme_fallback(const ThemeConfig* theme);
 
 // XDG-compliant size matching function
-static int directory_size_distance(const IconDirectory* dir, int size) {
-    if (!dir->type) return INT_MAX;
-    
-    int dir_size = dir->size ? atoi(dir->size) : 48;
-    
-    // If directory name contains size info, prefer that over Size field
-    int dirname_size = extract_size_from_dirname(dir->name);
-    if (dirname_size > 0) {
-        dir_size = dirname_size;
-    }
+static int directory_size_distance(const IconDirectoryInfo* dir, int size) {
+    int dir_size = dir->size;
     
-    if (strcmp(dir->type, "Fixed") == 0) {
+    if (dir->type == ICON_DIRECTORY_FIXED) {
         return (dir_size == size) ? 0 : INT_MAX;
     }
     
-    if (strcmp(dir->type, "Scalable") == 0) {
+    if (dir->type == ICON_DIRECTORY_SCALABLE) {
         int min_size = dir->min_size > 0 ? dir->min_size : 1;
         int max_size = dir->max_size > 0 ? dir->max_size : 512;
         
@@ -292,7 +317,7 @@ static int directory_size_distance(const IconDirectory* dir, int size) {
         return 0;
     }
     
-    if (strcmp(dir->type, "Threshold") == 0) {
+    if (dir->type == ICON_DIRECTORY_THRESHOLD) {
         int threshold = dir->threshold > 0 ? dir->threshold : 2;
         int min_size = dir_size - threshold;
         int max_size = dir_size + threshold;
@@ -305,121 +330,205 @@ static int directory_size_distance(const IconDirectory* dir, int size) {
     return abs(dir_size - size);
 }
 
-static void add_to_cache(const char* name, const char* path, const char* context, 
-                        const char* theme_name, const IconDirectory* dir_info) {
-    IconCacheEntry* entry = malloc(sizeof(IconCacheEntry));
-    if (!entry) return;
-    
-    entry->name = strdup(name);
-    entry->path = strdup(path);
-    entry->context = context ? strdup(context) : NULL;
-    entry->theme_name = theme_name ? strdup(theme_name) : NULL;
-    
-    // Copy directory info for size matching
-    memset(&entry->dir_info, 0, sizeof(IconDirectory));
-    if (dir_info) {
-        entry->dir_info.size = dir_info->size ? strdup(dir_info->size) : strdup("48");
-        entry->dir_info.type = dir_info->type ? strdup(dir_info->type) : strdup("Threshold");
-        entry->dir_info.context = dir_info->context ? strdup(dir_info->context) : NULL;
-        entry->dir_info.min_size = dir_info->min_size;
-        entry->dir_info.max_size = dir_info->max_size;
-        entry->dir_info.threshold = dir_info->threshold;
+static uint32_t pool_add(const char* text, size_t length) {
+    if (icon_strings.length + length + 1 >= NO_STRING) return NO_STRING;
+    
+    if (icon_strings.length + length + 1 > icon_strings.capacity) {
+        size_t capacity = icon_strings.capacity ? icon_strings.capacity * 2 : 65536;
+        while (capacity < icon_strings.length + length + 1) capacity *= 2;
+        char* tmp = realloc(icon_strings.data, capacity);
+        if (!tmp) return NO_STRING;
+        icon_strings.data = tmp;
+        icon_strings.capacity = capacity;
+    }
+    
+    uint32_t offset = (uint32_t)icon_strings.length;
+    memcpy(icon_strings.data + offset, text, length);
+    icon_strings.data[offset + length] = '\0';
+    icon_strings.length += length + 1;
+    return offset;
+}
+
+static uint32_t pool_intern(const char* text) {
+    if (!text) return NO_STRING;
+    if (!interned_strings) interned_strings = hashmap_create(64);
+    
+    void* known = interned_strings ? hashmap_get(interned_strings, text) : NULL;
+    if (known) return (uint32_t)((uintptr_t)known - 1);
+    
+    uint32_t offset = pool_add(text, strlen(text));
+    if (offset != NO_STRING && interned_strings) {
+        hashmap_put(interned_strings, text, (void*)((uintptr_t)offset + 1));
+    }
+    return offset;
+}
+
+static const char* pool_string(uint32_t offset) {
+    return offset == NO_STRING ? NULL : icon_strings.data + offset;
+}
+
+static bool reserve_items(void** items, int* capacity, int count, size_t item_size) {
+    if (count < *capacity) return true;
+    
+    int grown = *capacity ? *capacity * 2 : 256;
+    void* tmp = realloc(*items, (size_t)grown * item_size);
+    if (!tmp) return false;
+    *items = tmp;
+    *capacity = grown;
+    return true;
+}
+
+// Sizes and the type are parsed here once, not on every lookup. Missing
+// values get the defaults index.theme implies.
+static int add_icon_directory(const char* dir_path, const IconDirectory* dir_info, const char* theme_name) {
+    if (!reserve_items((void**)&icon_directories, &icon_directory_capacity,
+                       icon_directory_count, sizeof(IconDirectoryInfo))) {
+        return -1;
+    }
+    
+    IconDirectoryInfo* dir = &icon_directories[icon_directory_count];
+    dir->path = pool_add(dir_path, strlen(dir_path));
+    if (dir->path == NO_STRING) return -1;
+    dir->context = pool_intern(dir_info->context);
+    dir->theme_name = pool_intern(theme_name);
+    dir->size = dir_info->size ? atoi(dir_info->size) : 48;
+    dir->min_size = dir_info->min_size;
+    dir->max_size = dir_info->max_size;
+    dir->threshold = dir_info->threshold;
+    
+    if (!dir_info->type || strcmp(dir_info->type, "Threshold") == 0) {
+        dir->type = ICON_DIRECTORY_THRESHOLD;
+    } else if (strcmp(dir_info->type, "Fixed") == 0) {
+        dir->type = ICON_DIRECTORY_FIXED;
+    } else if (strcmp(dir_info->type, "Scalable") == 0) {
+        dir->type = ICON_DIRECTORY_SCALABLE;
     } else {
-        entry->dir_info.size = strdup("48");
-        entry->dir_info.type = strdup("Threshold");
-        entry->dir_info.threshold = 2;
+        dir->type = ICON_DIRECTORY_OTHER;
     }
+    return icon_directory_count++;
+}
+
+static void add_to_cache(const char* file_name, size_t name_length, int directory) {
+    if (!reserve_items((void**)&icon_records, &icon_record_capacity,
+                       icon_record_count, sizeof(IconRecord))) {
+        return;
+    }
+    
+    uint32_t file = pool_add(file_name, strlen(file_name));
+    if (file == NO_STRING) return;
     
-    entry->next = icon_cache;
-    icon_cache = entry;
+    IconRecord* record = &icon_records[icon_record_count++];
+    record->file = file;
+    record->directory = (uint32_t)directory;
+    record->name_length = (uint32_t)name_length;
+}
+
+static char* icon_record_path(const IconRecord* record) {
+    const char* dir_path = pool_string(icon_directories[record->directory].path);
+    const char* file = pool_string(record->file);
+    size_t dir_length = strlen(dir_path);
+    size_t file_length = strlen(file);
+    
+    char* path = malloc(dir_length + file_length + 2);
+    if (!path) return NULL;
+    memcpy(path, dir_path, dir_length);
+    path[dir_length] = '/';
+    memcpy(path + dir_length + 1, file, file_length + 1);
+    return path;
 }
 
-// Find best matching icon using XDG algorithm with case-insensitive context matching
+// Find best matching icon using XDG algorithm with case-insensitive context
+// matching. Records are visited newest first, so ties go to the icon that
+// was scanned last.
 static char* find_best_icon_match(const char* name, int size, const char* preferred_context) {
-    IconCacheEntry* best_match = NULL;
+    const IconRecord* best_match = NULL;
     int best_distance = INT_MAX;
     bool found_exact_context = false;
+    size_t name_length = strlen(name);
     
-    IconCacheEntry* entry = icon_cache;
-    while (entry) {
-        if (!entry->name || strcmp(entry->name, name) != 0) {
-            entry = entry->next;
+    for (int i = icon_record_count - 1; i >= 0; i--) {
+        const IconRecord* record = &icon_records[i];
+        if (record->name_length != name_length ||
+            memcmp(icon_strings.data + record->file, name, name_length) != 0) {
             continue;
         }
         
         // Calculate size distance using XDG algorithm
-        int distance = directory_size_distance(&entry->dir_info, size);
+        const IconDirectoryInfo* dir = &icon_directories[record->directory];
+        int distance = directory_size_distance(dir, size);
         if (distance == INT_MAX) {
-            entry = entry->next;
             continue;
         }
         
         bool context_matches = false;
-        if (preferred_context && entry->context) {
-            context_matches = (strcasecmp(entry->context, preferred_context) == 0);
+        if (preferred_context && dir->context != NO_STRING) {
+            context_matches = (strcasecmp(pool_string(dir->context), preferred_context) == 0);
         }
         
         // Prefer exact context matches
         if (preferred_context) {
             if (context_matches && !found_exact_context) {
                 // First exact context match
-                best_match = entry;
+                best_match = record;
                 best_distance = distance;
                 found_exact_context = true;
             } else if (context_matches && found_exact_context && distance < best_distance) {
                 // Better exact context match
-                best_match = entry;
+                best_match = record;
                 best_distance = distance;
             } else if (!found_exact_context && distance < best_distance) {
                 // Better non-context match (only if no exact context found yet)
-                best_match = entry;
+                best_match = record;
                 best_distance = distance;
             }
         } else {
             // No context preference
             if (distance < best_distance) {
-                best_match = entry;
+                best_match = record;
                 best_distance = distance;
             }
         }
-        
-        entry = entry->next;
     }
     
-    if (getenv("DEBUG_ICONS") && best_match) {
-        printf("Found icon '%s' for size %d: %s (distance: %d, context: %s)\n", 
-               name, size, best_match->path, best_distance, 
-               best_match->context ? best_match->context : "none");
+    char* path = best_match ? icon_record_path(best_match) : NULL;
+    if (getenv("DEBUG_ICONS") && path) {
+        const char* context = pool_string(icon_directories[best_match->directory].context);
+        fprintf(stderr, "Found icon '%s' for size %d: %s (distance: %d, context: %s)\n", 
+                        name, size, path, best_distance, context ? context : "none");
     }
     
-    return best_match ? strdup(best_match->path) : NULL;
+    return path;
 }
 
 static void cleanup_cache(void) {
-    IconCacheEntry* entry = icon_cache;
-    while (entry) {
-        IconCacheEntry* next = entry->next;
-        free(entry->name);
-        free(entry->path);
-        free(entry->context);
-        free(entry->theme_name);
-        free(entry->dir_info.name);
-        free(entry->dir_info.size);
-        free(entry->dir_info.context);
-        free(entry->dir_info.type);
-        free(entry);
-        entry = next;
-    }
-    icon_cache = NULL;
+    free(icon_strings.data);
+    memset(&icon_strings, 0, sizeof(icon_strings));
+    if (interned_strings) hashmap_free(interned_strings, NULL);
+    interned_strings = NULL;
+    
+    free(icon_directories);
+    icon_directories = NULL;
+    icon_directory_count = icon_directory_capacity = 0;
+    free(icon_records);
+    icon_records = NULL;
+    icon_record_count = icon_record_capacity = 0;
 }
 
 // Scan directory and add icons to cache with proper directory info
 static void scan_icon_directory(const char* dir_path, const IconDirectory* dir_info, const char* theme_name) {
+    long long start = trace_now();
     DIR* dir = opendir(dir_path);
     if (!dir) return;
     
+    int directory = add_icon_directory(dir_path, dir_info, theme_name);
+    if (directory < 0) {
+        closedir(dir);
+        return;
+    }
+    
     struct dirent* entry;
     while ((entry = readdir(dir)) != NULL) {
+        profile_count(PROFILE_READDIRS, 1);
         if (entry->d_type != DT_REG && entry->d_type != DT_LNK) continue;
         
         char* dot = strrchr(entry->d_name, '.');
@@ -432,22 +541,11 @@ static void scan_icon_directory(const char* dir_path, const IconDirectory* dir_i
             continue;
         }
         
-        // Extract icon name (without extension)
-        size_t name_len = dot - entry->d_name;
-        char* icon_name = malloc(name_len + 1);
-        if (!icon_name) continue;
-        
-        strncpy(icon_name, entry->d_name, name_len);
-        icon_name[name_len] = '\0';
-        
-        char full_path[MAX_PATH_LENGTH];
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-        
-        add_to_cache(icon_name, full_path, dir_info->context, theme_name, dir_info);
-        free(icon_name);
+        add_to_cache(entry->d_name, dot - entry->d_name, directory);
     }
     
     closedir(dir);
+    trace_span("theme", "scan directory", dir_path, start);
 }
 
 static bool theme_already_loaded(const char* theme_name) {
@@ -493,169 +591,185 @@ static void cleanup_theme_config(ThemeConfig* config) {
     }
     free(config->inherits);
     
-    for (int i = 0; i < config->directory_count; i++) {
-        IconDirectory* dir = &config->directories[i];
-        free(dir->name);
-        free(dir->size);
-        free(dir->context);
-        free(dir->type);
-    }
+    // Directory strings live in the same block as the table
     free(config->directories);
     
     memset(config, 0, sizeof(ThemeConfig));
 }
 
-// Parse a single section of index.theme
-static void parse_icon_theme_section(FILE* file, const char* section_name, ThemeConfig* theme) {
-    char line[1024];
-    IconDirectory* dir = NULL;
+// Spans of the mapped index.theme text. The file is not NUL-terminated,
+// so nothing here may read past `end`.
+static void trim_span(const char** start, const char** end) {
+    while (*start < *end && isspace((unsigned char)**start)) (*start)++;
+    while (*end > *start && isspace((unsigned char)(*end)[-1])) (*end)--;
+}
+
+static bool span_equals(const char* start, const char* end, const char* text) {
+    size_t length = strlen(text);
+    return (size_t)(end - start) == length && memcmp(start, text, length) == 0;
+}
+
+static int span_to_int(const char* start, const char* end) {
+    char number[16];
+    size_t length = (size_t)(end - start);
+    if (length >= sizeof(number)) length = sizeof(number) - 1;
+    memcpy(number, start, length);
+    number[length] = '\0';
+    return atoi(number);
+}
+
+// Copy a span into the string area that follows the directory table
+static char* area_copy(char** area, const char* start, const char* end) {
+    char* copy = *area;
+    memcpy(copy, start, end - start);
+    copy[end - start] = '\0';
+    *area += end - start + 1;
+    return copy;
+}
+
+static void parse_inherits(ThemeConfig* theme, const char* start, const char* end) {
+    int count = 1;
+    for (const char* p = start; p < end; p++) {
+        if (*p == ',') count++;
+    }
+    if (count > 16) count = 16;
     
-    if (strcmp(section_name, "Icon Theme") == 0) {
-        // Parse main theme section
-        while (fgets(line, sizeof(line), file)) {
-            // Check for next section
-            if (line[0] == '[') {
-                fseek(file, -(long)strlen(line), SEEK_CUR);
-                break;
-            }
-            
-            char* equals = strchr(line, '=');
-            if (!equals) continue;
-            
-            *equals = '\0';
-            char* key = trim(line);
-            char* value = trim(equals + 1);
-            
-            // Remove quotes if present
-            if (value[0] == '"' && value[strlen(value)-1] == '"') {
-                value[strlen(value)-1] = '\0';
-                value++;
-            }
-            
-            if (strcmp(key, "Name") == 0) {
-                free(theme->theme_name);
-                theme->theme_name = strdup(value);
-            } else if (strcmp(key, "Comment") == 0) {
-                free(theme->comment);
-                theme->comment = strdup(value);
-            } else if (strcmp(key, "Example") == 0) {
-                free(theme->example);
-                theme->example = strdup(value);
-            } else if (strcmp(key, "Hidden") == 0) {
-                theme->hidden = (strcasecmp(value, "true") == 0);
-            } else if (strcmp(key, "Inherits") == 0) {
-                // Parse inherited themes
-                char* value_copy = strdup(value);
-                char* token = strtok(value_copy, ",");
-                theme->inherits_count = 0;
-                
-                while (token && theme->inherits_count < 16) {
-                    theme->inherits = realloc(theme->inherits, 
-                        (theme->inherits_count + 1) * sizeof(char*));
-                    if (!theme->inherits) break;
-                    theme->inherits[theme->inherits_count] = strdup(trim(token));
-                    theme->inherits_count++;
-                    token = strtok(NULL, ",");
-                }
-                free(value_copy);
-            } else if (strcmp(key, "Directories") == 0) {
-                // Parse directory list
-                char* value_copy = strdup(value);
-                char* token = strtok(value_copy, ",");
-                theme->directory_count = 0;
-                
-                while (token) {
-                    theme->directories = realloc(theme->directories,
-                        (theme->directory_count + 1) * sizeof(IconDirectory));
-                    if (!theme->directories) break;
-                    
-                    IconDirectory* new_dir = &theme->directories[theme->directory_count];
-                    memset(new_dir, 0, sizeof(IconDirectory));
-                    new_dir->name = strdup(trim(token));
-                    // Set defaults - will be overridden by directory section
-                    new_dir->type = strdup("Threshold");
-                    new_dir->size = strdup("48");
-                    new_dir->threshold = 2;
-                    new_dir->min_size = 1;
-                    new_dir->max_size = 512;
-                    
-                    theme->directory_count++;
-                    token = strtok(NULL, ",");
-                }
-                free(value_copy);
-            }
-        }
-    } else {
-        // Parse directory-specific section
-        for (int i = 0; i < theme->directory_count; i++) {
-            if (strcmp(theme->directories[i].name, section_name) == 0) {
-                dir = &theme->directories[i];
-                break;
-            }
+    char** inherits = malloc(count * sizeof(char*));
+    if (!inherits) return;
+    
+    for (int i = 0; i < theme->inherits_count; i++) {
+        free(theme->inherits[i]);
+    }
+    free(theme->inherits);
+    theme->inherits = inherits;
+    theme->inherits_count = 0;
+    
+    while (start < end && theme->inherits_count < count) {
+        const char* comma = memchr(start, ',', end - start);
+        const char* token_end = comma ? comma : end;
+        const char* token = start;
+        trim_span(&token, &token_end);
+        if (token < token_end) {
+            inherits[theme->inherits_count] = strndup(token, token_end - token);
+            if (inherits[theme->inherits_count]) theme->inherits_count++;
         }
-        
-        if (!dir) return; // Directory not found in main list
-        
-        while (fgets(line, sizeof(line), file)) {
-            // Check for next section
-            if (line[0] == '[') {
-                fseek(file, -(long)strlen(line), SEEK_CUR);
-                break;
-            }
-            
-            char* equals = strchr(line, '=');
-            if (!equals) continue;
-            
-            *equals = '\0';
-            char* key = trim(line);
-            char* value = trim(equals + 1);
-            
-            // Remove quotes if present
-            if (value[0] == '"' && value[strlen(value)-1] == '"') {
-                value[strlen(value)-1] = '\0';
-                value++;
-            }
-            
-            if (strcmp(key, "Size") == 0) {
-                free(dir->size);
-                dir->size = strdup(value);
-            } else if (strcmp(key, "Context") == 0) {
-                free(dir->context);
-                dir->context = strdup(value);
-            } else if (strcmp(key, "Type") == 0) {
-                free(dir->type);
-                dir->type = strdup(value);
-            } else if (strcmp(key, "MinSize") == 0) {
-                dir->min_size = atoi(value);
-            } else if (strcmp(key, "MaxSize") == 0) {
-                dir->max_size = atoi(value);
-            } else if (strcmp(key, "Threshold") == 0) {
-                dir->threshold = atoi(value);
-            }
+        start = comma ? comma + 1 : end;
+    }
+}
+
+// The directory table and every string it points to share one block: the
+// table, then a string area. Each string is copied from a distinct line of
+// the file, so the area never needs more than the file size plus the two
+// shared defaults.
+static bool build_directory_table(ThemeConfig* theme, const char* start, const char* end,
+                                  size_t file_size, char** area) {
+    int count = 1;
+    for (const char* p = start; p < end; p++) {
+        if (*p == ',') count++;
+    }
+    
+    IconDirectory* table = malloc(count * sizeof(IconDirectory) + file_size + sizeof("Threshold") + sizeof("48"));
+    if (!table) return false;
+    
+    *area = (char*)(table + count);
+    static const char threshold_type[] = "Threshold";
+    static const char default_size[] = "48";
+    char* type = area_copy(area, threshold_type, threshold_type + strlen(threshold_type));
+    char* size = area_copy(area, default_size, default_size + strlen(default_size));
+    
+    int directory_count = 0;
+    while (start < end) {
+        const char* comma = memchr(start, ',', end - start);
+        const char* token_end = comma ? comma : end;
+        const char* token = start;
+        trim_span(&token, &token_end);
+        if (token < token_end) {
+            // Defaults, overridden by the directory's own section
+            IconDirectory* dir = &table[directory_count++];
+            memset(dir, 0, sizeof(IconDirectory));
+            dir->name = area_copy(area, token, token_end);
+            dir->type = type;
+            dir->size = size;
+            dir->threshold = 2;
+            dir->min_size = 1;
+            dir->max_size = 512;
         }
-        
-        // Validate and set defaults for directory
-        if (!dir->size) dir->size = strdup("48");
-        if (!dir->type) dir->type = strdup("Threshold");
-        
-        if (strcmp(dir->type, "Scalable") == 0) {
-            if (dir->min_size <= 0) dir->min_size = 1;
-            if (dir->max_size <= 0) dir->max_size = 512;
-        } else if (strcmp(dir->type, "Threshold") == 0) {
-            if (dir->threshold <= 0) dir->threshold = 2;
+        start = comma ? comma + 1 : end;
+    }
+    
+    theme->directories = table;
+    theme->directory_count = directory_count;
+    return true;
+}
+
+static IconDirectory* find_directory_section(ThemeConfig* theme, const char* start, const char* end, int* hint) {
+    // Sections almost always follow the order of Directories=, so start
+    // looking just after the previous match
+    for (int n = 0; n < theme->directory_count; n++) {
+        int i = (*hint + n) % theme->directory_count;
+        if (span_equals(start, end, theme->directories[i].name)) {
+            *hint = i + 1;
+            return &theme->directories[i];
         }
     }
+    return NULL;
 }
 
-// Parse index.theme file completely with better error handling
+static void parse_theme_key(ThemeConfig* theme, const char* key, const char* key_end,
+                            const char* value, const char* value_end,
+                            size_t file_size, char** area) {
+    if (span_equals(key, key_end, "Name")) {
+        free(theme->theme_name);
+        theme->theme_name = strndup(value, value_end - value);
+    } else if (span_equals(key, key_end, "Comment")) {
+        free(theme->comment);
+        theme->comment = strndup(value, value_end - value);
+    } else if (span_equals(key, key_end, "Example")) {
+        free(theme->example);
+        theme->example = strndup(value, value_end - value);
+    } else if (span_equals(key, key_end, "Hidden")) {
+        theme->hidden = value_end - value == 4 && strncasecmp(value, "true", 4) == 0;
+    } else if (span_equals(key, key_end, "Inherits")) {
+        parse_inherits(theme, value, value_end);
+    } else if (span_equals(key, key_end, "Directories") && !theme->directories) {
+        build_directory_table(theme, value, value_end, file_size, area);
+    }
+}
+
+static void parse_directory_key(IconDirectory* dir, const char* key, const char* key_end,
+                                const char* value, const char* value_end, char** area) {
+    if (span_equals(key, key_end, "Size")) {
+        dir->size = area_copy(area, value, value_end);
+    } else if (span_equals(key, key_end, "Context")) {
+        dir->context = area_copy(area, value, value_end);
+    } else if (span_equals(key, key_end, "Type")) {
+        dir->type = area_copy(area, value, value_end);
+    } else if (span_equals(key, key_end, "MinSize")) {
+        dir->min_size = span_to_int(value, value_end);
+    } else if (span_equals(key, key_end, "MaxSize")) {
+        dir->max_size = span_to_int(value, value_end);
+    } else if (span_equals(key, key_end, "Threshold")) {
+        dir->threshold = span_to_int(value, value_end);
+    }
+}
+
+// Parse index.theme in one pass over a read-only mapping. Lines can be any
+// length; Directories= in large themes runs to several kilobytes.
 static bool parse_index_theme(const char* theme_path, ThemeConfig* theme) {
     char index_path[MAX_PATH_LENGTH];
     snprintf(index_path, sizeof(index_path), "%s/index.theme", theme_path);
     
-    FILE* file = fopen(index_path, "r");
-    if (!file) {
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char* text = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0) close(fd);
+    
+    if (text == MAP_FAILED) {
         if (getenv("DEBUG_ICONS")) {
-            printf("Cannot open %s\n", index_path);
+            fprintf(stderr, "Cannot open %s\n", index_path);
         }
         
         // Create a minimal theme config for themes without index.theme
@@ -665,26 +779,62 @@ static bool parse_index_theme(const char* theme_path, ThemeConfig* theme) {
         return true; // Let fallback scanning handle it
     }
     
-    char line[1024];
-    
-    while (fgets(line, sizeof(line), file)) {
-        // Remove newline
-        char* newline = strchr(line, '\n');
-        if (newline) *newline = '\0';
-        
-        // Skip comments and empty lines
-        if (line[0] == '#' || line[0] == '\0') continue;
+    size_t size = st.st_size;
+    const char* end = text + size;
+    bool in_theme_section = false;
+    IconDirectory* dir = NULL;
+    char* area = NULL;
+    int hint = 0;
+    
+    for (const char* line = text; line < end; ) {
+        const char* newline = memchr(line, '\n', end - line);
+        const char* line_end = newline ? newline : end;
+        const char* next = newline ? newline + 1 : end;
+        trim_span(&line, &line_end);
         
-        // Check for section headers
-        if (line[0] == '[' && line[strlen(line) - 1] == ']') {
-            line[strlen(line) - 1] = '\0';
-            char* section_name = line + 1;
-            
-            parse_icon_theme_section(file, section_name, theme);
+        if (line == line_end || *line == '#' || *line == ';') {
+            // Blank line or comment
+        } else if (*line == '[' && line_end[-1] == ']') {
+            in_theme_section = span_equals(line + 1, line_end - 1, "Icon Theme");
+            dir = in_theme_section ? NULL : find_directory_section(theme, line + 1, line_end - 1, &hint);
+        } else if (in_theme_section || dir) {
+            const char* equals = memchr(line, '=', line_end - line);
+            if (equals) {
+                const char* key = line;
+                const char* key_end = equals;
+                const char* value = equals + 1;
+                const char* value_end = line_end;
+                trim_span(&key, &key_end);
+                trim_span(&value, &value_end);
+                
+                // Remove quotes if present
+                if (value_end - value >= 2 && *value == '"' && value_end[-1] == '"') {
+                    value++;
+                    value_end--;
+                }
+                
+                if (in_theme_section) {
+                    parse_theme_key(theme, key, key_end, value, value_end, size, &area);
+                } else {
+                    parse_directory_key(dir, key, key_end, value, value_end, &area);
+                }
+            }
         }
+        line = next;
     }
     
-    fclose(file);
+    munmap((void*)text, size);
+    
+    // Validate directories against their type
+    for (int i = 0; i < theme->directory_count; i++) {
+        IconDirectory* entry = &theme->directories[i];
+        if (strcmp(entry->type, "Scalable") == 0) {
+            if (entry->min_size <= 0) entry->min_size = 1;
+            if (entry->max_size <= 0) entry->max_size = 512;
+        } else if (strcmp(entry->type, "Threshold") == 0) {
+            if (entry->threshold <= 0) entry->threshold = 2;
+        }
+    }
     
     // Set theme name if not set
     if (!theme->theme_name) {
@@ -693,8 +843,8 @@ static bool parse_index_theme(const char* theme_path, ThemeConfig* theme) {
     }
     
     if (getenv("DEBUG_ICONS")) {
-        printf("Parsed theme: %s (%d directories)\n", 
-               theme->theme_name, theme->directory_count);
+        fprintf(stderr, "Parsed theme: %s (%d directories)\n", 
+                        theme->theme_name, theme->directory_count);
     }
     
     return true; // Always return true, let fallback handle missing directories
@@ -746,15 +896,15 @@ static void scan_theme_icons(const ThemeConfig* theme) {
             scanned_count++;
             
             if (getenv("DEBUG_ICONS")) {
-                printf("Scanned %s/%s (context: %s, type: %s, size: %s)\n", 
-                       theme->theme_name, dir->name,
-                       dir->context ? dir->context : "none",
-                       dir->type ? dir->type : "none",
-                       dir->size ? dir->size : "none");
+                fprintf(stderr, "Scanned %s/%s (context: %s, type: %s, size: %s)\n", 
+                                theme->theme_name, dir->name,
+                                dir->context ? dir->context : "none",
+                                dir->type ? dir->type : "none",
+                                dir->size ? dir->size : "none");
             }
         } else {
             if (getenv("DEBUG_ICONS")) {
-                printf("Directory not found: %s\n", dir_path);
+                fprintf(stderr, "Directory not found: %s\n", dir_path);
             }
         }
     }
@@ -762,7 +912,7 @@ static void scan_theme_icons(const ThemeConfig* theme) {
     // If very few directories were found from index.theme, do a fallback scan
     if (scanned_count < 3) {
         if (getenv("DEBUG_ICONS")) {
-            printf("Few directories found from index.theme (%d), doing fallback scan\n", scanned_count);
+            fprintf(stderr, "Few directories found from index.theme (%d), doing fallback scan\n", scanned_count);
         }
         scan_theme_fallback(theme);
     }
@@ -772,11 +922,13 @@ static void scan_theme_icons(const ThemeConfig* theme) {
 static void scan_theme_fallback(const ThemeConfig* theme) {
     if (!theme || !theme->theme_path) return;
     
+    long long start = trace_now();
     DIR* theme_dir = opendir(theme->theme_path);
     if (!theme_dir) return;
     
     struct dirent* entry;
     while ((entry = readdir(theme_dir)) != NULL) {
+        profile_count(PROFILE_READDIRS, 1);
         if (entry->d_type != DT_DIR || entry->d_name[0] == '.') continue;
         
         char size_dir_path[MAX_PATH_LENGTH];
@@ -794,6 +946,7 @@ static void scan_theme_fallback(const ThemeConfig* theme) {
         
         struct dirent* context_entry;
         while ((context_entry = readdir(size_dir)) != NULL) {
+            profile_count(PROFILE_READDIRS, 1);
             if (context_entry->d_type != DT_DIR || context_entry->d_name[0] == '.') continue;
             
             char context_dir_path[MAX_PATH_LENGTH];
@@ -846,9 +999,9 @@ static void scan_theme_fallback(const ThemeConfig* theme) {
             scan_icon_directory(context_dir_path, &fake_dir, theme->theme_name);
             
             if (getenv("DEBUG_ICONS")) {
-                printf("Fallback scanned %s/%s/%s (context: %s, size: %s)\n", 
-                       theme->theme_name, entry->d_name, context_entry->d_name,
-                       fake_dir.context, fake_dir.size);
+                fprintf(stderr, "Fallback scanned %s/%s/%s (context: %s, size: %s)\n", 
+                                theme->theme_name, entry->d_name, context_entry->d_name,
+                                fake_dir.context, fake_dir.size);
             }
         }
         
@@ -856,13 +1009,27 @@ static void scan_theme_fallback(const ThemeConfig* theme) {
     }
     
     closedir(theme_dir);
+    trace_span("theme", "fallback scan", theme->theme_path, start);
+}
+
+// Zero when there is no index.theme
+static void index_theme_mtime(const char* theme_path, struct timespec* mtime) {
+    char index_path[MAX_PATH_LENGTH];
+    snprintf(index_path, sizeof(index_path), "%s/index.theme", theme_path);
+    
+    struct stat st;
+    if (stat(index_path, &st) == 0) {
+        *mtime = st.st_mtim;
+    } else {
+        memset(mtime, 0, sizeof(*mtime));
+    }
 }
 
 // Load theme with proper inheritance handling
 static bool load_theme_recursive(const char* theme_name, int depth) {
     if (depth > 10) {
         if (getenv("DEBUG_ICONS")) {
-            printf("Theme inheritance too deep: %s\n", theme_name);
+            fprintf(stderr, "Theme inheritance too deep: %s\n", theme_name);
         }
         return false;
     }
@@ -874,7 +1041,7 @@ static bool load_theme_recursive(const char* theme_name, int depth) {
     char* theme_path = find_theme_path(theme_name);
     if (!theme_path) {
         if (getenv("DEBUG_ICONS")) {
-            printf("Theme not found: %s\n", theme_name);
+            fprintf(stderr, "Theme not found: %s\n", theme_name);
         }
         return false;
     }
@@ -886,8 +1053,12 @@ static bool load_theme_recursive(const char* theme_name, int depth) {
     }
     
     node->theme.theme_path = theme_path;
+    index_theme_mtime(theme_path, &node->index_mtime);
     
-    if (!parse_index_theme(theme_path, &node->theme)) {
+    long long parse_start = trace_now();
+    bool parsed = parse_index_theme(theme_path, &node->theme);
+    trace_span("theme", "parse index.theme", theme_path, parse_start);
+    if (!parsed) {
         cleanup_theme_config(&node->theme);
         free(node);
         return false;
@@ -903,8 +1074,8 @@ static bool load_theme_recursive(const char* theme_name, int depth) {
     scan_theme_icons(&node->theme);
     
     if (getenv("DEBUG_ICONS")) {
-        printf("Loaded theme: %s (%d directories, %d inherited)\n", 
-               theme_name, node->theme.directory_count, node->theme.inherits_count);
+        fprintf(stderr, "Loaded theme: %s (%d directories, %d inherited)\n", 
+                        theme_name, node->theme.directory_count, node->theme.inherits_count);
     }
     
     return true;
@@ -943,8 +1114,8 @@ const char* get_mimetype_for_extension(const char* extension) {
     return NULL;
 }
 
-// Find icon with comprehensive fallback strategy
-static char* find_icon_with_fallbacks(const char* icon_name, int size, const char* context) {
+// The icon by exactly this name, in the context if it has one there
+static char* lookup_exact_icon(const char* icon_name, int size, const char* context) {
     if (!icon_name) return NULL;
     
     // Try different context variations for better compatibility
@@ -955,21 +1126,35 @@ static char* find_icon_with_fallbacks(const char* icon_name, int size, const cha
         NULL
     };
     
-    // 1. Try with context variants
     for (int i = 0; context_variants[i]; i++) {
         char* result = find_best_icon_match(icon_name, size, context_variants[i]);
         if (result) return result;
     }
+    return find_best_icon_match(icon_name, size, NULL);
+}
+
+// Find icon with comprehensive fallback strategy
+static char* lookup_icon_with_fallbacks(const char* icon_name, int size, const char* context) {
+    if (!icon_name) return NULL;
     
-    // 2. Try without context preference  
-    char* result = find_best_icon_match(icon_name, size, NULL);
+    // Try different context variations for better compatibility
+    const char* context_variants[] = {
+        context,
+        context ? (strcasecmp(context, "mimetypes") == 0 ? "MimeTypes" : 
+                  strcasecmp(context, "MimeTypes") == 0 ? "mimetypes" : context) : NULL,
+        NULL
+    };
+    
+    // 1. Try the name itself, with and without the context
+    char* result = lookup_exact_icon(icon_name, size, context);
     if (result) return result;
     
-    // 3. Try generic versions for MIME types
+    // 2. Try generic versions for MIME types
     if (strstr(icon_name, "-")) {
-        // Try application-x-generic, text-x-generic, etc.
-        char* generic = strdup(icon_name);
-        char* dash = strrchr(generic, '-');
+        // Try application-x-generic, text-x-generic, etc.: the media type
+        // with the suffix, which may be longer than what it replaces
+        char* generic = malloc(strlen(icon_name) + sizeof("-x-generic"));
+        char* dash = generic ? strchr(strcpy(generic, icon_name), '-') : NULL;
         if (dash) {
             strcpy(dash, "-x-generic");
             for (int i = 0; context_variants[i]; i++) {
@@ -1010,7 +1195,7 @@ static char* find_icon_with_fallbacks(const char* icon_name, int size, const cha
         free(category);
     }
     
-    // 4. Try without common suffixes
+    // 3. Try without common suffixes
     const char* suffixes[] = {"-symbolic", "-dark", "-light", "-color", NULL};
     for (int i = 0; suffixes[i]; i++) {
         if (strstr(icon_name, suffixes[i])) {
@@ -1036,45 +1221,87 @@ static char* find_icon_with_fallbacks(const char* icon_name, int size, const cha
     }
     
     if (getenv("DEBUG_ICONS")) {
-        printf("No icon found for '%s' (size: %d, context: %s)\n", 
-               icon_name, size, context ? context : "none");
+        fprintf(stderr, "No icon found for '%s' (size: %d, context: %s)\n", 
+                        icon_name, size, context ? context : "none");
     }
     
     return NULL;
 }
 
-static char* find_icon_for_extension(const char* extension, int size) {
-    if (!extension) return NULL;
+static char* find_icon_with_fallbacks(const char* icon_name, int size, const char* context) {
+    long long start = trace_now();
+    char* result = lookup_icon_with_fallbacks(icon_name, size, context);
+    trace_span("lookup", "icon", icon_name, start);
+    return result;
+}
+
+static char* find_exact_icon(const char* icon_name, int size, const char* context) {
+    long long start = trace_now();
+    char* result = lookup_exact_icon(icon_name, size, context);
+    trace_span("lookup", "icon", icon_name, start);
+    return result;
+}
+
+static char* find_exact_icon_for_mimetype(const char* mimetype, int size) {
+    char* icon_name = mimetype_to_icon_name(mimetype);
+    if (!icon_name) return NULL;
     
-    // Get MIME type for extension
-    const char* mimetype = get_mimetype_for_extension(extension);
-    if (mimetype) {
-        char* icon_name = mimetype_to_icon_name(mimetype);
-        if (icon_name) {
-            // Try with MimeTypes context first, then mimetypes, then no context
-            char* result = find_icon_with_fallbacks(icon_name, size, "MimeTypes");
-            if (!result) {
-                result = find_icon_with_fallbacks(icon_name, size, "mimetypes");
-            }
-            if (!result) {
-                result = find_icon_with_fallbacks(icon_name, size, NULL);
-            }
-            
-            free(icon_name);
-            if (result) return result;
-        }
+    char* result = find_exact_icon(icon_name, size, "MimeTypes");
+    free(icon_name);
+    return result;
+}
+
+static char* find_icon_for_mimetype(const char* mimetype, int size) {
+    char* icon_name = mimetype_to_icon_name(mimetype);
+    if (!icon_name) return NULL;
+    
+    // Try with MimeTypes context first, then mimetypes, then no context
+    char* result = find_icon_with_fallbacks(icon_name, size, "MimeTypes");
+    if (!result) {
+        result = find_icon_with_fallbacks(icon_name, size, "mimetypes");
+    }
+    if (!result) {
+        result = find_icon_with_fallbacks(icon_name, size, NULL);
     }
     
-    // Fallback: try extension name directly
-    char ext_name[64];
-    snprintf(ext_name, sizeof(ext_name), "%s", extension + 1); // Skip dot
+    free(icon_name);
+    return result;
+}
+
+// Icon by file name: the shared-mime-info type, then the built-in
+// extension table, then an icon named after the extension. Only exact names
+// count until all three are tried; the generic icon for the media type, as
+// file managers use, and the other fallbacks come last
+static char* find_icon_for_name(const char* filename, int size) {
+    const char* extension = get_file_extension(filename);
+    const char* glob_type = mime_type_for_name(filename);
+    const char* table_type = get_mimetype_for_extension(extension);
     
-    // Convert to lowercase
-    for (int i = 0; ext_name[i]; i++) {
-        ext_name[i] = tolower(ext_name[i]);
+    if (glob_type) {
+        char* result = find_exact_icon_for_mimetype(glob_type, size);
+        if (result) return result;
+    }
+    if (table_type && (!glob_type || strcmp(table_type, glob_type) != 0)) {
+        char* result = find_exact_icon_for_mimetype(table_type, size);
+        if (result) return result;
     }
     
-    return find_icon_with_fallbacks(ext_name, size, NULL);
+    if (extension) {
+        // Fallback: try extension name directly
+        char ext_name[64];
+        snprintf(ext_name, sizeof(ext_name), "%s", extension + 1); // Skip dot
+        
+        // Convert to lowercase
+        for (int i = 0; ext_name[i]; i++) {
+            ext_name[i] = tolower(ext_name[i]);
+        }
+        
+        char* result = find_exact_icon(ext_name, size, NULL);
+        if (result) return result;
+    }
+    
+    const char* type = glob_type ? glob_type : table_type;
+    return type ? find_icon_for_mimetype(type, size) : NULL;
 }
 
 bool is_image_file(const char* filename) {
@@ -1094,92 +1321,6 @@ bool is_image_file(const char* filename) {
             strcasecmp(extension, ".xcf") == 0);
 }
 
-char* get_thumbnail_path(const char* filename) {
-    const char* home = getenv("HOME");
-    if (!home) {
-        struct passwd *pw = getpwuid(getuid());
-        home = pw ? pw->pw_dir : "/tmp";
-    }
-    
-    char cache_dir[MAX_PATH_LENGTH];
-    snprintf(cache_dir, sizeof(cache_dir), "%s/%s", home, CACHE_DIRECTORY_PATH);
-    
-    // Create cache directory if it doesn't exist
-    char* dir_copy = strdup(cache_dir);
-    if (dir_copy) {
-        char* slash = strchr(dir_copy + 1, '/');
-        while (slash) {
-            *slash = '\0';
-            mkdir(dir_copy, 0755);
-            *slash = '/';
-            slash = strchr(slash + 1, '/');
-        }
-        mkdir(dir_copy, 0755);
-        free(dir_copy);
-    }
-    
-    char* thumbnail_path = malloc(MAX_PATH_LENGTH);
-    if (!thumbnail_path) return NULL;
-    
-    // Create a safe filename from the original filename
-    char safe_name[256];
-    const char* base_name = strrchr(filename, '/');
-    base_name = base_name ? base_name + 1 : filename;
-    
-    int j = 0;
-    for (int i = 0; base_name[i] && j < 200; i++) {
-        if (isalnum(base_name[i]) || base_name[i] == '.' || base_name[i] == '-' || base_name[i] == '_') {
-            safe_name[j++] = base_name[i];
-        } else {
-            safe_name[j++] = '_';
-        }
-    }
-    safe_name[j] = '\0';
-    
-    if (strlen(cache_dir) + strlen(safe_name) + 50 < MAX_PATH_LENGTH) {
-        snprintf(thumbnail_path, MAX_PATH_LENGTH, "%s/thumb_%s_%dx%d.png", 
-                 cache_dir, safe_name, current_icon_size, current_icon_size);
-    } else {
-        // Fallback for very long paths
-        snprintf(thumbnail_path, MAX_PATH_LENGTH, "%s/thumb_%dx%d.png", 
-                 cache_dir, current_icon_size, current_icon_size);
-    }
-    
-    return thumbnail_path;
-}
-
-bool generate_thumbnail(const char* source_path, const char* thumbnail_path) {
-    if (!source_path || !thumbnail_path) return false;
-    
-    // Check if thumbnail already exists and is newer than source
-    struct stat source_stat, thumb_stat;
-    if (stat(source_path, &source_stat) != 0) return false;
-    
-    if (stat(thumbnail_path, &thumb_stat) == 0) {
-        if (thumb_stat.st_mtime >= source_stat.st_mtime) {
-            return true; // Thumbnail is up to date
-        }
-    }
-    
-    char cmd[MAX_PATH_LENGTH * 2 + 100];
-    const char* extension = get_file_extension(source_path);
-    
-    if (extension && strcasecmp(extension, ".svg") == 0) {
-        // Use rsvg-convert for SVG files
-        snprintf(cmd, sizeof(cmd), 
-                "rsvg-convert \"%s\" -o \"%s\" --width=%d --height=%d 2>/dev/null", 
-                source_path, thumbnail_path, current_icon_size, current_icon_size);
-    } else {
-        // Use ImageMagick for other formats
-        snprintf(cmd, sizeof(cmd), 
-                "convert \"%s[0]\" -thumbnail %dx%d \"%s\" 2>/dev/null", 
-                source_path, current_icon_size, current_icon_size, thumbnail_path);
-    }
-    
-    int result = system(cmd);
-    return result == 0 && file_exists(thumbnail_path);
-}
-
 const char* get_file_extension(const char* filename) {
     if (!filename) return NULL;
     
@@ -1190,30 +1331,8 @@ const char* get_file_extension(const char* filename) {
     return dot;
 }
 
-// Initialize theme system
-void init_theme(const char* theme_name) {
-    // Clear existing state
-    cleanup_theme();
-    
-    // Load the requested theme (this will load inherited themes first)
-    bool theme_loaded = load_theme(theme_name);
-    
-    // Always ensure hicolor is loaded as final fallback
-    if (!theme_already_loaded("hicolor")) {
-        load_theme("hicolor");
-    }
-    
-    // If primary theme failed, try common fallbacks
-    if (!theme_loaded) {
-        const char* fallback_themes[] = {"Adwaita", "gnome", "oxygen", "breeze", NULL};
-        for (int i = 0; fallback_themes[i]; i++) {
-            if (load_theme(fallback_themes[i])) {
-                break;
-            }
-        }
-    }
-    
-    // Find default icons
+// The default file and folder icons are the ones that fit current_icon_size
+static void pick_default_icons(void) {
     const char* file_icon_candidates[] = {
         "text-x-generic", "text-plain", "unknown", 
         "application-x-generic", "gtk-file", "file", 
@@ -1244,31 +1363,68 @@ void init_theme(const char* theme_name) {
             free(icon_path);
         }
     }
+}
+
+// Initialize theme system
+void init_theme(const char* theme_name) {
+    // Clear existing state
+    cleanup_theme();
+    mime_init();
+    
+    // Load the requested theme (this will load inherited themes first)
+    bool theme_loaded = load_theme(theme_name);
+    
+    // Always ensure hicolor is loaded as final fallback
+    if (!theme_already_loaded("hicolor")) {
+        load_theme("hicolor");
+    }
+    
+    // If primary theme failed, try common fallbacks
+    if (!theme_loaded) {
+        const char* fallback_themes[] = {"Adwaita", "gnome", "oxygen", "breeze", NULL};
+        for (int i = 0; fallback_themes[i]; i++) {
+            if (load_theme(fallback_themes[i])) {
+                break;
+            }
+        }
+    }
+    
+    pick_default_icons();
     
     if (getenv("DEBUG_ICONS")) {
-        printf("Theme initialization complete:\n");
-        printf("Default file icon: %s\n", default_file_icon[0] ? default_file_icon : "NONE");
-        printf("Default directory icon: %s\n", default_directory_icon[0] ? default_directory_icon : "NONE");
+        fprintf(stderr, "Theme initialization complete:\n");
+        fprintf(stderr, "Default file icon: %s\n", default_file_icon[0] ? default_file_icon : "NONE");
+        fprintf(stderr, "Default directory icon: %s\n", default_directory_icon[0] ? default_directory_icon : "NONE");
         
         ThemeNode* current = theme_chain;
-        printf("Loaded themes:\n");
+        fprintf(stderr, "Loaded themes:\n");
         while (current) {
-            printf("  - %s (%s) - %d directories\n", 
-                   current->theme.theme_name ? current->theme.theme_name : "unnamed",
-                   current->theme.theme_path ? current->theme.theme_path : "no path",
-                   current->theme.directory_count);
+            fprintf(stderr, "  - %s (%s) - %d directories\n", 
+                            current->theme.theme_name ? current->theme.theme_name : "unnamed",
+                            current->theme.theme_path ? current->theme.theme_path : "no path",
+                            current->theme.directory_count);
             current = current->next;
         }
         
-        // Count icons in cache
-        int icon_count = 0;
-        IconCacheEntry* entry = icon_cache;
-        while (entry) {
-            icon_count++;
-            entry = entry->next;
+        fprintf(stderr, "Total icons in cache: %d in %d directories, %zu bytes of strings\n",
+                        icon_record_count, icon_directory_count, icon_strings.length);
+    }
+}
+
+void theme_set_icon_size(int size) {
+    current_icon_size = size;
+    pick_default_icons();
+}
+
+bool theme_sources_changed(void) {
+    for (ThemeNode* node = theme_chain; node; node = node->next) {
+        struct timespec mtime;
+        index_theme_mtime(node->theme.theme_path, &mtime);
+        if (mtime.tv_sec != node->index_mtime.tv_sec || mtime.tv_nsec != node->index_mtime.tv_nsec) {
+            return true;
         }
-        printf("Total icons in cache: %d\n", icon_count);
     }
+    return false;
 }
 
 // Clean up theme system
@@ -1283,18 +1439,17 @@ void cleanup_theme(void) {
     theme_chain = NULL;
     
     cleanup_cache();
+    mime_cleanup();
     
     default_file_icon[0] = '\0';
     default_directory_icon[0] = '\0';
 }
 
-// Main function to get file logo/icon
-char* get_file_logo(const char* filename, mode_t permissions, uid_t owner) {
-    (void)owner; // Unused parameter
-    
+// Icon for the file's type alone, never a thumbnail of its contents.
+// The returned path is always owned by the caller.
+char* get_file_type_logo(const char* filename, mode_t permissions) {
     if (!filename) return NULL;
     
-    
     // Handle directories
     if (S_ISDIR(permissions)) {
         // Try context-specific directory icons
@@ -1330,11 +1485,38 @@ char* get_file_logo(const char* filename, mode_t permissions, uid_t owner) {
         }
         
         // Return default directory icon
-        return default_directory_icon[0] ? default_directory_icon : NULL;
+        return default_directory_icon[0] ? strdup(default_directory_icon) : NULL;
     }
     
+    // Handle regular files by name and extension
+    char* icon_path = find_icon_for_name(filename, current_icon_size);
+    if (icon_path) {
+        return icon_path;
+    }
+    
+    // Try executable detection
+    if (permissions & S_IXUSR) {
+        char* exec_icon = find_icon_with_fallbacks("application-x-executable", current_icon_size, "MimeTypes");
+        if (exec_icon) return exec_icon;
+    }
+    
+    // Return default file icon
+    return default_file_icon[0] ? strdup(default_file_icon) : NULL;
+}
+
+// Icon for a type found some other way, such as by content
+char* get_mimetype_logo(const char* mimetype) {
+    return find_icon_for_mimetype(mimetype, current_icon_size);
+}
+
+// Main function to get file logo/icon
+char* get_file_logo(const char* filename, mode_t permissions, uid_t owner) {
+    (void)owner; // Unused parameter
+    
+    if (!filename) return NULL;
+    
     // Handle image files - try to generate thumbnail
-    if (is_image_file(filename)) {
+    if (!S_ISDIR(permissions) && is_image_file(filename)) {
         char* thumb_path = get_thumbnail_path(filename);
         if (thumb_path) {
             if (generate_thumbnail(filename, thumb_path)) {
@@ -1344,21 +1526,5 @@ char* get_file_logo(const char* filename, mode_t permissions, uid_t owner) {
         }
     }
     
-    // Handle regular files by extension
-    const char* extension = get_file_extension(filename);
-    if (extension) {
-        char* icon_path = find_icon_for_extension(extension, current_icon_size);
-        if (icon_path) {
-            return icon_path;
-        }
-    }
-    
-    // Try executable detection
-    if (permissions & S_IXUSR) {
-        char* exec_icon = find_icon_with_fallbacks("application-x-executable", current_icon_size, "MimeTypes");
-        if (exec_icon) return exec_icon;
-    }
-    
-    // Return default file icon
-    return default_file_icon[0] ? default_file_icon : NULL;
+    return get_file_type_logo(filename, permissions);
 }
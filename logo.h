@@ -2,6 +2,8 @@
 #define LOGO_H
 
 #include <sys/types.h>
+#include <stdbool.h>
+#include <time.h>
 #include "config.h"
 
 extern int current_icon_size;
@@ -30,6 +32,7 @@ typedef struct {
 
 typedef struct ThemeNode {
     ThemeConfig theme;
+    struct timespec index_mtime;    // Of index.theme when it was loaded
     struct ThemeNode* next;
 } ThemeNode;
 
@@ -40,11 +43,17 @@ typedef struct {
 
 void init_theme(const char* theme_name);
 void cleanup_theme(void);
+
+// Switching sizes only picks new default icons; the index is size-free
+void theme_set_icon_size(int size);
+
+// Whether an index.theme in the loaded chain changed since init_theme()
+bool theme_sources_changed(void);
 char* get_file_logo(const char* filename, mode_t permissions, uid_t owner);
+char* get_file_type_logo(const char* filename, mode_t permissions);
+char* get_mimetype_logo(const char* mimetype);
 const char* get_file_extension(const char* filename);
 const char* get_mimetype_for_extension(const char* extension);
 bool is_image_file(const char* filename);
-char* get_thumbnail_path(const char* filename);
-bool generate_thumbnail(const char* source_path, const char* thumbnail_path);
 
 #endif
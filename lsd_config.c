@@ -4,13 +4,71 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pwd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "lsd_config.h"
 #include "logo.h"
+#include "cache.h"
+#include "hashmap.h"
 
-LsdConfig lsd_config = {0};
+// Bump when the layout or hash_string changes
+#define LSD_CACHE_MAGIC "ILSLSD1\n"
+
+typedef enum {
+    LSD_NAMES,
+    LSD_EXTENSIONS,
+    LSD_FILETYPES,
+    LSD_TABLE_COUNT
+} LsdTable;
+
+// The compiled config is one block: this header, the three slot tables
+// and the string pool. It is written to the cache byte for byte.
+typedef struct {
+    char magic[8];
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    int64_t source_size;
+    uint32_t slot_counts[LSD_TABLE_COUNT];
+    uint32_t pool_size;
+} LsdCacheHeader;
+
+// Open addressing, at most half full. Offsets point into the pool, whose
+// first byte is reserved so a zero name marks an empty slot.
+typedef struct {
+    uint32_t hash;
+    uint32_t name;
+    uint32_t icon;
+} LsdSlot;
+
+typedef struct {
+    uint32_t name;
+    uint32_t icon;
+} LsdEntry;
+
+typedef struct {
+    LsdEntry* entries;
+    int count;
+    int capacity;
+} LsdEntryList;
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} LsdPool;
+
+static struct {
+    void* data;
+    size_t size;
+    bool mapped;
+    const LsdSlot* tables[LSD_TABLE_COUNT];
+    uint32_t slot_counts[LSD_TABLE_COUNT];
+    const char* pool;
+} lsd_config = {0};
 
 static char* trim(char* str) {
     while(isspace(*str)) str++;
@@ -31,113 +89,322 @@ static char* unquote(char* str) {
     return str;
 }
 
-static void add_entry(IconEntry** entries, int* count, const char* name, const char* icon) {
-    *entries = realloc(*entries, (*count + 1) * sizeof(IconEntry));
-    if (!*entries) return;
-    
-    (*entries)[*count].name = strdup(name);
-    (*entries)[*count].icon = strdup(icon);
-    (*count)++;
+static uint32_t pool_add(LsdPool* pool, const char* text) {
+    size_t length = strlen(text) + 1;
+    if (pool->size + length > pool->capacity) {
+        size_t capacity = pool->capacity ? pool->capacity : 4096;
+        while (capacity < pool->size + length) capacity *= 2;
+        char* tmp = realloc(pool->data, capacity);
+        if (!tmp) return 0;
+        pool->data = tmp;
+        pool->capacity = capacity;
+    }
+    uint32_t offset = (uint32_t)pool->size;
+    memcpy(pool->data + offset, text, length);
+    pool->size += length;
+    return offset;
+}
+
+static void add_entry(LsdEntryList* list, LsdPool* pool, const char* name, const char* icon) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        LsdEntry* tmp = realloc(list->entries, capacity * sizeof(LsdEntry));
+        if (!tmp) return;
+        list->entries = tmp;
+        list->capacity = capacity;
+    }
+
+    uint32_t name_offset = pool_add(pool, name);
+    uint32_t icon_offset = pool_add(pool, icon);
+    if (!name_offset || !icon_offset) return;
+    list->entries[list->count].name = name_offset;
+    list->entries[list->count].icon = icon_offset;
+    list->count++;
 }
 
-static bool load_config(const char* path) {
+static bool parse_yaml(const char* path, LsdEntryList* lists, LsdPool* pool) {
     FILE* file = fopen(path, "r");
     if (!file) return false;
-    
+
     char line[1024];
-    enum { NONE, NAME, EXT, TYPE } section = NONE;
-    
+    int section = -1;
+
     while (fgets(line, sizeof(line), file)) {
         char* newline = strchr(line, '\n');
         if (newline) *newline = '\0';
-        
+
         char* trimmed = trim(line);
         if (!*trimmed || *trimmed == '#') continue;
-        
-        if (strcmp(trimmed, "name:") == 0) { section = NAME; continue; }
-        if (strcmp(trimmed, "extension:") == 0) { section = EXT; continue; }
-        if (strcmp(trimmed, "filetype:") == 0) { section = TYPE; continue; }
-        
-        if (section != NONE) {
+
+        if (strcmp(trimmed, "name:") == 0) { section = LSD_NAMES; continue; }
+        if (strcmp(trimmed, "extension:") == 0) { section = LSD_EXTENSIONS; continue; }
+        if (strcmp(trimmed, "filetype:") == 0) { section = LSD_FILETYPES; continue; }
+
+        if (section >= 0) {
             char* colon = strchr(trimmed, ':');
             if (colon) {
                 *colon = '\0';
                 char* key = unquote(trimmed);
                 char* value = unquote(colon + 1);
-                
+
                 if (*value) {
-                    switch (section) {
-                        case NAME: add_entry(&lsd_config.names, &lsd_config.name_count, key, value); break;
-                        case EXT: add_entry(&lsd_config.extensions, &lsd_config.ext_count, key, value); break;
-                        case TYPE: add_entry(&lsd_config.filetypes, &lsd_config.type_count, key, value); break;
-                        default: break;
-                    }
+                    add_entry(&lists[section], pool, key, value);
                 }
             }
         }
     }
-    
+
     fclose(file);
     return true;
 }
 
-void init_lsd_config(void) {
+static uint32_t table_slots(int count) {
+    if (count == 0) return 0;
+    uint32_t slots = 8;
+    while (slots < (uint32_t)count * 2) slots *= 2;
+    return slots;
+}
+
+static void use_compiled(void* data, size_t size, bool mapped) {
+    const LsdCacheHeader* header = data;
+    const char* cursor = (const char*)data + sizeof(LsdCacheHeader);
+
+    lsd_config.data = data;
+    lsd_config.size = size;
+    lsd_config.mapped = mapped;
+    for (int t = 0; t < LSD_TABLE_COUNT; t++) {
+        lsd_config.tables[t] = (const LsdSlot*)cursor;
+        lsd_config.slot_counts[t] = header->slot_counts[t];
+        cursor += header->slot_counts[t] * sizeof(LsdSlot);
+    }
+    lsd_config.pool = cursor;
+}
+
+// Build the block from parsed entries. The first entry for a key wins,
+// as it did with the old linear scans.
+static void* compile_config(const struct stat* source, const LsdEntryList* lists,
+                            const LsdPool* pool, size_t* size) {
+    LsdCacheHeader header = {0};
+    memcpy(header.magic, LSD_CACHE_MAGIC, sizeof(header.magic));
+    header.source_mtime_sec = source->st_mtim.tv_sec;
+    header.source_mtime_nsec = source->st_mtim.tv_nsec;
+    header.source_size = source->st_size;
+    header.pool_size = (uint32_t)pool->size;
+
+    size_t total_slots = 0;
+    for (int t = 0; t < LSD_TABLE_COUNT; t++) {
+        header.slot_counts[t] = table_slots(lists[t].count);
+        total_slots += header.slot_counts[t];
+    }
+
+    *size = sizeof(header) + total_slots * sizeof(LsdSlot) + pool->size;
+    char* data = calloc(1, *size);
+    if (!data) return NULL;
+    memcpy(data, &header, sizeof(header));
+
+    LsdSlot* slots = (LsdSlot*)(data + sizeof(header));
+    char* pool_copy = (char*)(slots + total_slots);
+    memcpy(pool_copy, pool->data, pool->size);
+
+    for (int t = 0; t < LSD_TABLE_COUNT; t++) {
+        uint32_t mask = header.slot_counts[t] - 1;
+        for (int i = 0; i < lists[t].count; i++) {
+            const LsdEntry* entry = &lists[t].entries[i];
+            const char* name = pool_copy + entry->name;
+            uint32_t hash = hash_string(name);
+            uint32_t index = hash & mask;
+
+            while (slots[index].name &&
+                   (slots[index].hash != hash || strcmp(pool_copy + slots[index].name, name) != 0)) {
+                index = (index + 1) & mask;
+            }
+            if (slots[index].name) continue;
+
+            slots[index].hash = hash;
+            slots[index].name = entry->name;
+            slots[index].icon = entry->icon;
+        }
+        slots += header.slot_counts[t];
+    }
+
+    return data;
+}
+
+static void cache_file_path(char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/lsd-icons.cache", cache_state_directory());
+}
+
+// Map the compiled cache if it was built from this exact icons.yaml.
+// Anything that does not check out is ignored and rebuilt.
+static bool load_cached(const struct stat* source) {
+    char path[MAX_PATH_LENGTH + 32];
+    cache_file_path(path, sizeof(path));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(LsdCacheHeader)) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    size_t size = st.st_size;
+    const LsdCacheHeader* header = data;
+    size_t total_slots = 0;
+    bool valid = memcmp(header->magic, LSD_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->source_mtime_sec == source->st_mtim.tv_sec &&
+                 header->source_mtime_nsec == source->st_mtim.tv_nsec &&
+                 header->source_size == source->st_size;
+    for (int t = 0; valid && t < LSD_TABLE_COUNT; t++) {
+        uint32_t slots = header->slot_counts[t];
+        valid = slots <= size && (slots & (slots - 1)) == 0;
+        total_slots += slots;
+    }
+    valid = valid && header->pool_size > 0 &&
+            size == sizeof(LsdCacheHeader) + total_slots * sizeof(LsdSlot) + header->pool_size;
+
+    if (valid) {
+        // Every offset must land inside a NUL-terminated pool, and every
+        // table needs an empty slot to end its probes
+        const LsdSlot* slots = (const LsdSlot*)((const char*)data + sizeof(LsdCacheHeader));
+        const char* pool = (const char*)(slots + total_slots);
+        valid = pool[0] == '\0' && pool[header->pool_size - 1] == '\0';
+        for (int t = 0; valid && t < LSD_TABLE_COUNT; t++) {
+            uint32_t used = 0;
+            for (uint32_t i = 0; valid && i < header->slot_counts[t]; i++) {
+                valid = slots[i].name < header->pool_size && slots[i].icon < header->pool_size;
+                if (slots[i].name) used++;
+            }
+            valid = valid && (header->slot_counts[t] == 0 || used < header->slot_counts[t]);
+            slots += header->slot_counts[t];
+        }
+    }
+
+    if (!valid) {
+        munmap(data, size);
+        return false;
+    }
+    use_compiled(data, size, true);
+    return true;
+}
+
+static void write_cached(const void* data, size_t size) {
+    char path[MAX_PATH_LENGTH + 32];
+    cache_file_path(path, sizeof(path));
+    ensure_cache_directory();
+
+    char temp_path[MAX_PATH_LENGTH + 96];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) return;
+
+    bool ok = fwrite(data, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path, path) != 0) unlink(temp_path);
+}
+
+// What icons.yaml looked like when it was loaded, to notice edits
+static struct {
+    bool exists;
+    struct timespec mtime;
+    off_t size;
+} loaded_source = {0};
+
+static void source_path(char* path, size_t size) {
     const char* home = getenv("HOME");
     if (!home) {
         struct passwd *pw = getpwuid(getuid());
         home = pw ? pw->pw_dir : "/tmp";
     }
-    
+    snprintf(path, size, "%s/.config/lsd/icons.yaml", home);
+}
+
+void init_lsd_config(void) {
+    char path[1024];
+    source_path(path, sizeof(path));
+
+    struct stat source;
+    loaded_source.exists = stat(path, &source) == 0;
+    if (!loaded_source.exists) return;
+    loaded_source.mtime = source.st_mtim;
+    loaded_source.size = source.st_size;
+    if (load_cached(&source)) return;
+
+    LsdEntryList lists[LSD_TABLE_COUNT] = {{0}};
+    LsdPool pool = {0};
+    void* data = NULL;
+    size_t size = 0;
+
+    // Offset 0 stays empty so it can mean "no entry"
+    if (pool_add(&pool, "") == 0 && pool.size == 1 && parse_yaml(path, lists, &pool)) {
+        data = compile_config(&source, lists, &pool, &size);
+    }
+
+    for (int t = 0; t < LSD_TABLE_COUNT; t++) {
+        free(lists[t].entries);
+    }
+    free(pool.data);
+
+    if (data) {
+        use_compiled(data, size, false);
+        write_cached(data, size);
+    }
+}
+
+bool lsd_config_changed(void) {
     char path[1024];
-    snprintf(path, sizeof(path), "%s/.config/lsd/icons.yaml", home);
-    load_config(path);
+    source_path(path, sizeof(path));
+
+    struct stat source;
+    if (stat(path, &source) != 0) return loaded_source.exists;
+    return !loaded_source.exists || source.st_size != loaded_source.size ||
+           source.st_mtim.tv_sec != loaded_source.mtime.tv_sec ||
+           source.st_mtim.tv_nsec != loaded_source.mtime.tv_nsec;
 }
 
 void cleanup_lsd_config(void) {
-    for (int i = 0; i < lsd_config.name_count; i++) {
-        free(lsd_config.names[i].name);
-        free(lsd_config.names[i].icon);
-    }
-    for (int i = 0; i < lsd_config.ext_count; i++) {
-        free(lsd_config.extensions[i].name);
-        free(lsd_config.extensions[i].icon);
-    }
-    for (int i = 0; i < lsd_config.type_count; i++) {
-        free(lsd_config.filetypes[i].name);
-        free(lsd_config.filetypes[i].icon);
-    }
-    
-    free(lsd_config.names);
-    free(lsd_config.extensions);
-    free(lsd_config.filetypes);
+    if (lsd_config.mapped) {
+        munmap(lsd_config.data, lsd_config.size);
+    } else {
+        free(lsd_config.data);
+    }
     memset(&lsd_config, 0, sizeof(lsd_config));
 }
 
-const char* get_lsd_icon(const char* filename, mode_t mode) {
-    for (int i = 0; i < lsd_config.name_count; i++) {
-        if (strcmp(lsd_config.names[i].name, filename) == 0) {
-            return lsd_config.names[i].icon;
+static const char* lookup(LsdTable table, const char* key) {
+    uint32_t slot_count = lsd_config.slot_counts[table];
+    if (slot_count == 0) return NULL;
+
+    const LsdSlot* slots = lsd_config.tables[table];
+    uint32_t hash = hash_string(key);
+    for (uint32_t index = hash & (slot_count - 1); slots[index].name; index = (index + 1) & (slot_count - 1)) {
+        if (slots[index].hash == hash && strcmp(lsd_config.pool + slots[index].name, key) == 0) {
+            return lsd_config.pool + slots[index].icon;
         }
     }
-    
+    return NULL;
+}
+
+const char* get_lsd_icon(const char* filename, mode_t mode) {
+    const char* icon = lookup(LSD_NAMES, filename);
+    if (icon) return icon;
+
     const char* ext = get_file_extension(filename);
     if (ext && *ext == '.') ext++;
     if (ext) {
-        for (int i = 0; i < lsd_config.ext_count; i++) {
-            if (strcmp(lsd_config.extensions[i].name, ext) == 0) {
-                return lsd_config.extensions[i].icon;
-            }
-        }
+        icon = lookup(LSD_EXTENSIONS, ext);
+        if (icon) return icon;
     }
-    
-    const char* type = S_ISDIR(mode) ? "dir" : 
+
+    return get_lsd_filetype_icon(mode);
+}
+
+const char* get_lsd_filetype_icon(mode_t mode) {
+    const char* type = S_ISDIR(mode) ? "dir" :
                       (mode & S_IXUSR) ? "executable" : "file";
-    
-    for (int i = 0; i < lsd_config.type_count; i++) {
-        if (strcmp(lsd_config.filetypes[i].name, type) == 0) {
-            return lsd_config.filetypes[i].icon;
-        }
-    }
-    
-    return NULL;
+
+    return lookup(LSD_FILETYPES, type);
 }
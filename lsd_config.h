@@ -1,26 +1,22 @@
 #ifndef LSD_CONFIG_H
 #define LSD_CONFIG_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
-typedef struct {
-    char* name;
-    char* icon;
-} IconEntry;
-
-typedef struct {
-    IconEntry* names;
-    IconEntry* extensions;
-    IconEntry* filetypes;
-    int name_count;
-    int ext_count;
-    int type_count;
-} LsdConfig;
-
-extern LsdConfig lsd_config;
+// ~/.config/lsd/icons.yaml is compiled into hash tables for the name,
+// extension and filetype sections. The compiled form is cached in the
+// state directory, keyed by the YAML's mtime and size, and mapped
+// directly on later runs.
 
 void init_lsd_config(void);
 void cleanup_lsd_config(void);
+
+// Whether icons.yaml was edited, created or removed since init_lsd_config()
+bool lsd_config_changed(void);
 const char* get_lsd_icon(const char* filename, mode_t mode);
 
+// The generic icon get_lsd_icon falls back to when no name or extension matches
+const char* get_lsd_filetype_icon(mode_t mode);
+
 #endif
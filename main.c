@@ -8,9 +8,29 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <pwd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <zlib.h>
 #include "config.h"
 #include "logo.h"
 #include "lsd_config.h"
+#include "thumbnail.h"
+#include "cache.h"
+#include "png.h"
+#include "hashmap.h"
+#include "daemon.h"
+#include "glyph.h"
+#include "atlas.h"
+#include "sixel.h"
+#include "term.h"
+#include "profile.h"
+#include "trace.h"
+#include "mime.h"
+#include "sniff.h"
+#include "details.h"
+#include "watch.h"
 
 #define move_cursor(X, Y) printf("\033[%d;%dH", Y, X)
 #define go_up(N) printf("\033[%dA", N)
@@ -18,28 +38,50 @@
 #define go_right(N) printf("\033[%dC", N)
 #define go_left(N) printf("\033[%dD", N)
 
-static char CACHE_PATH[MAX_PATH_LENGTH];
+// Listings only draw icons on a terminal; anything else gets plain names,
+// or one JSON object per entry
+typedef enum {
+    OUTPUT_TERMINAL,
+    OUTPUT_PLAIN,
+    OUTPUT_JSON,
+    OUTPUT_NDJSON
+} OutputMode;
+
 int current_icon_size = DEFAULT_ICON_SIZE;
+static bool auto_icon_size = true;
+static int cell_width = DEFAULT_CELL_WIDTH;
+static int cell_height = DEFAULT_CELL_HEIGHT;
 static GraphicsProtocol graphics_protocol = PROTOCOL_KITTY;
+static bool defer_thumbnails = DEFER_THUMBNAILS;
+static int daemon_fd = -1;
+static bool kitty_atlas = KITTY_ATLAS;
+static bool kitty_placeholders = KITTY_PLACEHOLDERS;
+static KittyTransfer kitty_transfer = KITTY_TRANSFER;
+static OutputMode output_mode = OUTPUT_TERMINAL;
 
 typedef struct {
     char* name;
+    char* path;
     const char* color;
     char* icon_path;
     char* cached_png_path;
-    char* cached_sixel_path;
     mode_t permissions;
     uid_t owner;
+    gid_t group;
+    nlink_t links;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
     size_t name_length;
+    const char* mimetype;   // Set when sniffed
     bool is_thumbnail;
     bool is_emoji;
     const char* emoji_text;
+    char* payload;
+    size_t payload_length;
 } FileEntry;
 
-static char* get_cached_sixel_path(const char* png_path);
-static bool cache_sixel(const char* png_path, const char* sixel_path);
-static void draw_cached_sixel(const char* sixel_path);
-
 static const char* get_color_code(mode_t mode) {
     if (S_ISDIR(mode)) return BLUE;
     if (mode & S_IXUSR) return GREEN;
@@ -55,31 +97,22 @@ static char *base64_encode(const unsigned char *data, size_t len) {
     if (!out) return NULL;
 
     size_t i, j;
-    for (i = 0, j = 0; i < len; ) {
-        unsigned octet_a = i < len ? data[i++] : 0;
-        unsigned octet_b = i < len ? data[i++] : 0;
-        unsigned octet_c = i < len ? data[i++] : 0;
+    for (i = 0, j = 0; i < len; i += 3) {
+        unsigned octet_a = data[i];
+        unsigned octet_b = i + 1 < len ? data[i + 1] : 0;
+        unsigned octet_c = i + 2 < len ? data[i + 2] : 0;
 
         unsigned triple = (octet_a << 16) | (octet_b << 8) | (octet_c);
 
         out[j++] = b64_table[(triple >> 18) & 0x3F];
         out[j++] = b64_table[(triple >> 12) & 0x3F];
-        out[j++] = (i > (len + 1)) ? '=' : b64_table[(triple >> 6) & 0x3F];
-        out[j++] = (i > len)      ? '=' : b64_table[triple & 0x3F];
+        out[j++] = i + 1 < len ? b64_table[(triple >> 6) & 0x3F] : '=';
+        out[j++] = i + 2 < len ? b64_table[triple & 0x3F] : '=';
     }
     out[j] = '\0';
     return out;
 }
 
-static void init_cache_path(void) {
-    const char* home = getenv("HOME");
-    if (!home) {
-        struct passwd *pw = getpwuid(getuid());
-        home = pw->pw_dir;
-    }
-    snprintf(CACHE_PATH, sizeof(CACHE_PATH), "%s/%s", home, CACHE_DIRECTORY_PATH);
-}
-
 static char* get_emoji_png_path(const char* emoji_text, const char* color_hash) {
     if (!emoji_text) return NULL;
     
@@ -100,22 +133,54 @@ static char* get_emoji_png_path(const char* emoji_text, const char* color_hash)
         }
     }
     
-    char* emoji_path = malloc(strlen(CACHE_PATH) + strlen(safe_name) + 50);
+    const char* cache_path = cache_directory();
+    char* emoji_path = malloc(strlen(cache_path) + strlen(safe_name) + 50);
     if (!emoji_path) return NULL;
     
-    snprintf(emoji_path, strlen(CACHE_PATH) + strlen(safe_name) + 50, 
-             "%s/emoji_%s_%dx%d_%08x.png", CACHE_PATH, safe_name, 
+    snprintf(emoji_path, strlen(cache_path) + strlen(safe_name) + 50, 
+             "%s/emoji_%s_%dx%d_%08x.png", cache_path, safe_name, 
              current_icon_size, current_icon_size, color_code);
     
     return emoji_path;
 }
 
-static bool generate_emoji_png(const char* emoji_text, const char* png_path, const char* ansi_color) {
+// A render of a missing glyph comes out fully transparent; small icon
+// sizes make even good renders tiny, so look at the pixels
+static bool emoji_render_ok(const char* path) {
+    int width, height;
+    unsigned char* pixels = png_is_complete(path) ? png_read_rgba(path, &width, &height) : NULL;
+    if (!pixels) return false;
+    
+    bool drawn = false;
+    for (size_t i = 3; !drawn && i < (size_t)width * height * 4; i += 4) {
+        drawn = pixels[i] != 0;
+    }
+    free(pixels);
+    return drawn;
+}
+
+// Same colours the ImageMagick fallback asks for by name
+static uint32_t ansi_to_rgb(const char* ansi_color) {
+    if (!ansi_color) return 0xFFFFFF;
+    if (strcmp(ansi_color, BLUE) == 0) return 0x0000FF;
+    if (strcmp(ansi_color, GREEN) == 0) return 0x008000;
+    if (strcmp(ansi_color, RED) == 0) return 0xFF0000;
+    if (strcmp(ansi_color, YELLOW) == 0) return 0xFFFF00;
+    if (strcmp(ansi_color, MAGENTA) == 0) return 0xFF00FF;
+    if (strcmp(ansi_color, CYAN) == 0) return 0x00FFFF;
+    return 0xFFFFFF;
+}
+
+static bool render_emoji_png(const char* emoji_text, const char* png_path, const char* ansi_color) {
+    if (glyph_render_png(emoji_text, current_icon_size, ansi_to_rgb(ansi_color), png_path)) {
+        return true;
+    }
+    
     if (getenv("DEBUG_ICONS")) {
-        printf("=== Generating emoji PNG ===\n");
-        printf("Text: '%s'\n", emoji_text);
-        printf("Path: '%s'\n", png_path);
-        printf("Icon size: %d\n", current_icon_size);
+        fprintf(stderr, "=== Generating emoji PNG ===\n");
+        fprintf(stderr, "Text: '%s'\n", emoji_text);
+        fprintf(stderr, "Path: '%s'\n", png_path);
+        fprintf(stderr, "Icon size: %d\n", current_icon_size);
     }
     
     char cmd[2048];
@@ -138,8 +203,8 @@ static bool generate_emoji_png(const char* emoji_text, const char* png_path, con
     if (font_size > current_icon_size - 4) font_size = current_icon_size - 4;
     
     if (getenv("DEBUG_ICONS")) {
-        printf("Calculated font size: %d\n", font_size);
-        printf("Color arg: %s\n", color_arg);
+        fprintf(stderr, "Calculated font size: %d\n", font_size);
+        fprintf(stderr, "Color arg: %s\n", color_arg);
     }
     
     snprintf(cmd, sizeof(cmd), 
@@ -148,15 +213,15 @@ static bool generate_emoji_png(const char* emoji_text, const char* png_path, con
              current_icon_size, current_icon_size, font_size, color_arg, emoji_text, png_path);
     
     if (getenv("DEBUG_ICONS")) {
-        printf("Trying label approach: %s\n", cmd);
+        fprintf(stderr, "Trying label approach: %s\n", cmd);
     }
     
+    profile_count(PROFILE_SPAWNS, 1);
     system(cmd);
     
-    struct stat st;
-    if (stat(png_path, &st) == 0 && st.st_size > 500) {
+    if (emoji_render_ok(png_path)) {
         if (getenv("DEBUG_ICONS")) {
-            printf("SUCCESS with label: %ld bytes\n", st.st_size);
+            fprintf(stderr, "SUCCESS with label\n");
         }
         return true;
     }
@@ -171,14 +236,15 @@ static bool generate_emoji_png(const char* emoji_text, const char* png_path, con
              emoji_text, png_path);
     
     if (getenv("DEBUG_ICONS")) {
-        printf("Trying pango approach: %s\n", cmd);
+        fprintf(stderr, "Trying pango approach: %s\n", cmd);
     }
     
+    profile_count(PROFILE_SPAWNS, 1);
     system(cmd);
     
-    if (stat(png_path, &st) == 0 && st.st_size > 500) {
+    if (emoji_render_ok(png_path)) {
         if (getenv("DEBUG_ICONS")) {
-            printf("SUCCESS with pango: %ld bytes\n", st.st_size);
+            fprintf(stderr, "SUCCESS with pango\n");
         }
         return true;
     }
@@ -192,26 +258,47 @@ static bool generate_emoji_png(const char* emoji_text, const char* png_path, con
                  current_icon_size, current_icon_size, fonts[i], font_size, color_arg, emoji_text, png_path);
         
         if (getenv("DEBUG_ICONS")) {
-            printf("Trying font %s: %s\n", fonts[i], cmd);
+            fprintf(stderr, "Trying font %s: %s\n", fonts[i], cmd);
         }
         
+        profile_count(PROFILE_SPAWNS, 1);
         system(cmd);
         
-        if (stat(png_path, &st) == 0 && st.st_size > 500) {
+        if (emoji_render_ok(png_path)) {
             if (getenv("DEBUG_ICONS")) {
-                printf("SUCCESS with %s: %ld bytes\n", fonts[i], st.st_size);
+                fprintf(stderr, "SUCCESS with %s\n", fonts[i]);
             }
             return true;
         }
     }
     
     if (getenv("DEBUG_ICONS")) {
-        printf("All approaches failed\n");
+        fprintf(stderr, "All approaches failed\n");
     }
     
     return false;
 }
 
+static bool generate_emoji_png(const char* emoji_text, const char* png_path, const char* ansi_color) {
+    // Keyed by the cache file, which already encodes glyph, colour and size
+    if (cache_known_failure("emoji", png_path, current_icon_size, "magick")) {
+        return false;
+    }
+    
+    CacheFill fill;
+    if (!cache_begin_fill(png_path, &fill)) {
+        return access(png_path, F_OK) == 0;
+    }
+    
+    long long start = trace_now();
+    bool rendered = render_emoji_png(emoji_text, fill.temp_path, ansi_color);
+    trace_span("raster", "glyph", emoji_text, start);
+    if (!rendered) {
+        cache_record_failure("emoji", png_path, current_icon_size, "magick");
+    }
+    return cache_end_fill(png_path, &fill, rendered);
+}
+
 static char* get_cached_png_path(const char* svg_path) {
     if (!svg_path) return NULL;
     
@@ -222,76 +309,37 @@ static char* get_cached_png_path(const char* svg_path) {
     char* dot = strrchr(filename, '.');
     size_t base_len = dot ? (size_t)(dot - filename) : strlen(filename);
     
-    char* cached_path = malloc(strlen(CACHE_PATH) + base_len + 20);
+    const char* cache_path = cache_directory();
+    char* cached_path = malloc(strlen(cache_path) + base_len + 20);
     if (!cached_path) return NULL;
     
-    snprintf(cached_path, strlen(CACHE_PATH) + base_len + 20, "%s/%.*s_%dx%d.png", 
-             CACHE_PATH, (int)base_len, filename, current_icon_size, current_icon_size);
+    snprintf(cached_path, strlen(cache_path) + base_len + 20, "%s/%.*s_%dx%d.png", 
+             cache_path, (int)base_len, filename, current_icon_size, current_icon_size);
     
     return cached_path;
 }
 
-static char* get_cached_sixel_path(const char* png_path) {
-    if (!png_path) return NULL;
-    
-    char* sixel_path = malloc(strlen(png_path) + 10);
-    if (!sixel_path) return NULL;
-    
-    strcpy(sixel_path, png_path);
-    char* dot = strrchr(sixel_path, '.');
-    if (dot) {
-        strcpy(dot, ".sixel");
-    } else {
-        strcat(sixel_path, ".sixel");
-    }
-    
-    return sixel_path;
-}
-
 static bool cache_svg(const char* svg_path, const char* png_path) {
-    char cmd[2048];
-    snprintf(cmd, sizeof(cmd), "rsvg-convert \"%s\" -o \"%s\" --width=%d --height=%d 2>/dev/null", 
-             svg_path, png_path, current_icon_size, current_icon_size);
-    return system(cmd) == 0;
-}
-
-static bool cache_sixel(const char* png_path, const char* sixel_path) {
-    char cmd[MAX_PATH_LENGTH * 2 + 100];
-    snprintf(cmd, sizeof(cmd), "convert \"%s\" -resize %dx%d sixel:\"%s\" 2>/dev/null", 
-             png_path, current_icon_size, current_icon_size, sixel_path);
-    return system(cmd) == 0;
-}
-
-static void ensure_cache_directory(void) {
-    struct stat st = {0};
-    
-    const char* home = getenv("HOME");
-    if (!home) {
-        struct passwd *pw = getpwuid(getuid());
-        home = pw->pw_dir;
-    }
-    
-    char local_path[MAX_PATH_LENGTH];
-    snprintf(local_path, sizeof(local_path), "%s/.local", home);
-    if (stat(local_path, &st) == -1) {
-        mkdir(local_path, 0755);
+    if (cache_known_failure("svg", svg_path, current_icon_size, "rsvg-convert")) {
+        return false;
     }
     
-    char share_path[MAX_PATH_LENGTH];
-    snprintf(share_path, sizeof(share_path), "%s/.local/share", home);
-    if (stat(share_path, &st) == -1) {
-        mkdir(share_path, 0755);
+    CacheFill fill;
+    if (!cache_begin_fill(png_path, &fill)) {
+        return access(png_path, F_OK) == 0;
     }
     
-    char ils_path[MAX_PATH_LENGTH];
-    snprintf(ils_path, sizeof(ils_path), "%s/.local/share/ils", home);
-    if (stat(ils_path, &st) == -1) {
-        mkdir(ils_path, 0755);
-    }
-    
-    if (stat(CACHE_PATH, &st) == -1) {
-        mkdir(CACHE_PATH, 0755);
+    char cmd[MAX_PATH_LENGTH * 2 + 200];
+    snprintf(cmd, sizeof(cmd), "rsvg-convert \"%s\" -o \"%s\" --width=%d --height=%d 2>/dev/null", 
+             svg_path, fill.temp_path, current_icon_size, current_icon_size);
+    profile_count(PROFILE_SPAWNS, 1);
+    long long start = trace_now();
+    bool produced = system(cmd) == 0;
+    trace_span("raster", "rsvg-convert", svg_path, start);
+    if (!produced) {
+        cache_record_failure("svg", svg_path, current_icon_size, "rsvg-convert");
     }
+    return cache_end_fill(png_path, &fill, produced);
 }
 
 static bool ensure_png_exists(const char* icon_path, const char* cached_png_path, bool is_thumbnail) {
@@ -303,60 +351,84 @@ static bool ensure_png_exists(const char* icon_path, const char* cached_png_path
     }
     
     struct stat st;
+    profile_count(PROFILE_STATS, 1);
     if (stat(cached_png_path, &st) == 0) {
         return true;
     }
     
     struct stat svg_st;
+    profile_count(PROFILE_STATS, 1);
     if (stat(icon_path, &svg_st) == 0) {
-        return cache_svg(icon_path, cached_png_path);
+        profile_begin(PROFILE_CACHE_FILL);
+        bool filled = cache_svg(icon_path, cached_png_path);
+        profile_end(PROFILE_CACHE_FILL);
+        return filled;
     }
     
     return false;
 }
 
+// Icon for entries without an lsd glyph: a thumbnail for images, otherwise
+// the theme icon for the file type. With deferred thumbnails an image whose
+// thumbnail is missing or stale shows its MIME type icon for now and the
+// thumbnail is queued for the background generator. Images that cannot be
+// thumbnailed fall back to their type icon as well. JSON output only
+// reports thumbnails that already exist.
+static void classify_file_icon(FileEntry* entry) {
+    char* thumbnail_path = is_image_file(entry->name) ? get_thumbnail_path(entry->path) : NULL;
+    
+    if (thumbnail_path) {
+        bool valid = thumbnail_is_valid(entry->path, thumbnail_path);
+        // Plain and JSON output never draw the thumbnail, so it isn't a use
+        if (output_mode == OUTPUT_TERMINAL) {
+            cache_record_access(thumbnail_path, valid);
+        }
+        
+        if (!valid && !defer_thumbnails && output_mode == OUTPUT_TERMINAL) {
+            profile_begin(PROFILE_CACHE_FILL);
+            if (generate_thumbnail(entry->path, thumbnail_path)) {
+                cache_filled(thumbnail_path);
+                valid = true;
+            }
+            profile_end(PROFILE_CACHE_FILL);
+        }
+        
+        if (valid) {
+            entry->icon_path = thumbnail_path;
+            entry->is_thumbnail = true;
+            entry->cached_png_path = strdup(thumbnail_path);
+            return;
+        }
+        
+        // Unreadable images get their type icon, like pending thumbnails do
+        if (defer_thumbnails && output_mode == OUTPUT_TERMINAL) {
+            thumbnail_defer(entry->path, thumbnail_path);
+        }
+        free(thumbnail_path);
+    }
+    
+    entry->icon_path = get_file_type_logo(entry->name, entry->permissions);
+    entry->is_thumbnail = false;
+    entry->cached_png_path = get_cached_png_path(entry->icon_path);
+}
+
 static void cache_all_icons(FileEntry* files, int file_count) {
     ensure_cache_directory();
     
     for (int i = 0; i < file_count; i++) {
         if (files[i].is_emoji) {
             if (files[i].cached_png_path && files[i].emoji_text) {
-                struct stat st;
-                if (stat(files[i].cached_png_path, &st) != 0) {
-                    if (!generate_emoji_png(files[i].emoji_text, files[i].cached_png_path, files[i].color)) {
+                if (!cache_lookup(files[i].cached_png_path)) {
+                    if (generate_emoji_png(files[i].emoji_text, files[i].cached_png_path, files[i].color)) {
+                        cache_filled(files[i].cached_png_path);
+                    } else {
                         if (getenv("DEBUG_ICONS")) {
-                            printf("Emoji failed, falling back to SVG for: %s\n", files[i].name);
+                            fprintf(stderr, "Emoji failed, falling back to SVG for: %s\n", files[i].name);
                         }
                         files[i].is_emoji = false;
                         free(files[i].cached_png_path);
-                        free(files[i].cached_sixel_path);
-                        
-                        if (is_image_file(files[i].name)) {
-                            files[i].icon_path = get_thumbnail_path(files[i].name);
-                            files[i].is_thumbnail = true;
-                            files[i].cached_png_path = strdup(files[i].icon_path);
-                            
-                            struct stat thumb_st;
-                            if (stat(files[i].icon_path, &thumb_st) != 0) {
-                                generate_thumbnail(files[i].name, files[i].icon_path);
-                            }
-                        } else {
-                            files[i].icon_path = get_file_logo(files[i].name, files[i].permissions, files[i].owner);
-                            files[i].is_thumbnail = false;
-                            files[i].cached_png_path = get_cached_png_path(files[i].icon_path);
-                        }
                         
-                        files[i].cached_sixel_path = NULL;
-                        if (graphics_protocol == PROTOCOL_SIXEL && files[i].cached_png_path) {
-                            files[i].cached_sixel_path = get_cached_sixel_path(files[i].cached_png_path);
-                        }
-                    }
-                }
-                
-                if (files[i].is_emoji && graphics_protocol == PROTOCOL_SIXEL && files[i].cached_sixel_path) {
-                    struct stat sixel_st;
-                    if (stat(files[i].cached_sixel_path, &sixel_st) != 0) {
-                        cache_sixel(files[i].cached_png_path, files[i].cached_sixel_path);
+                        classify_file_icon(&files[i]);
                     }
                 }
             }
@@ -374,9 +446,10 @@ static void cache_all_icons(FileEntry* files, int file_count) {
         
         if (!files[i].cached_png_path) continue;
         
-        struct stat st;
-        if (stat(files[i].cached_png_path, &st) != 0) {
-            if (!cache_svg(files[i].icon_path, files[i].cached_png_path)) {
+        if (!cache_lookup(files[i].cached_png_path)) {
+            if (cache_svg(files[i].icon_path, files[i].cached_png_path)) {
+                cache_filled(files[i].cached_png_path);
+            } else {
                 struct stat svg_st;
                 if (stat(files[i].icon_path, &svg_st) != 0) {
                     free(files[i].cached_png_path);
@@ -384,17 +457,23 @@ static void cache_all_icons(FileEntry* files, int file_count) {
                 }
             }
         }
-        
-        if (graphics_protocol == PROTOCOL_SIXEL && files[i].cached_png_path && files[i].cached_sixel_path) {
-            struct stat sixel_st;
-            if (stat(files[i].cached_sixel_path, &sixel_st) != 0) {
-                cache_sixel(files[i].cached_png_path, files[i].cached_sixel_path);
-            }
-        }
     }
 }
 
-static void detect_graphics_protocol(void) {
+static const char* protocol_name(void) {
+    if (output_mode == OUTPUT_PLAIN) return "plain";
+    if (output_mode != OUTPUT_TERMINAL) return "json";
+    
+    switch (graphics_protocol) {
+        case PROTOCOL_KITTY: return "kitty";
+        case PROTOCOL_SIXEL: return "sixel";
+        case PROTOCOL_LSD: return "lsd";
+    }
+    return "unknown";
+}
+
+// Fallback when the terminal cannot be asked, e.g. output is redirected
+static void guess_graphics_protocol(void) {
     const char* term = getenv("TERM");
     const char* term_program = getenv("TERM_PROGRAM");
     
@@ -406,7 +485,7 @@ static void detect_graphics_protocol(void) {
     }
     
     if (term) {
-        if (strstr(term, "st") || strstr(term, "kitty") || strstr(term, "ghostty") ||
+        if (strcmp(term, "st") == 0 || strncmp(term, "st-", 3) == 0 || strstr(term, "kitty") || strstr(term, "ghostty") ||
             strstr(term, "wezterm") || strstr(term, "xterm-kitty")) {
             graphics_protocol = PROTOCOL_KITTY;
             return;
@@ -427,87 +506,386 @@ static void detect_graphics_protocol(void) {
     graphics_protocol = PROTOCOL_LSD;
 }
 
-static void draw_png_kitty(int x, int y, int col, int row, const char *png_path) {
-    FILE *fp = fopen(png_path, "rb");
+static void detect_graphics_protocol(void) {
+    if (!term_probe_graphics(&graphics_protocol)) {
+        guess_graphics_protocol();
+    }
+}
+
+static unsigned char* read_whole_file(const char* path, size_t* length) {
+    FILE *fp = fopen(path, "rb");
     if (!fp) {
-        return;
+        return NULL;
     }
 
     fseek(fp, 0, SEEK_END);
-    long png_size = ftell(fp);
+    long size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
 
-    unsigned char *png_data = malloc(png_size);
-    if (!png_data) {
+    unsigned char *data = size > 0 ? malloc(size) : NULL;
+    if (!data) {
         fclose(fp);
-        return;
+        return NULL;
     }
 
-    if (fread(png_data, 1, png_size, fp) != (size_t)png_size) {
-        free(png_data);
+    if (fread(data, 1, size, fp) != (size_t)size) {
+        free(data);
         fclose(fp);
-        return;
+        return NULL;
     }
     fclose(fp);
 
-    char *encoded = base64_encode(png_data, png_size);
-    free(png_data);
-    
+    *length = size;
+    return data;
+}
+
+// Build the escape sequence that transmits `data` with the given control
+// keys, base64 encoded and split into chunks
+static char* build_kitty_sequence(const char *control, const unsigned char *data, size_t size, size_t* length) {
+    char *encoded = base64_encode(data, size);
     if (!encoded) {
-        return;
+        return NULL;
     }
 
     size_t chunk_size = 4096;
     size_t len_encoded = strlen(encoded);
     size_t pos = 0;
 
-    printf("\033_G");
-    printf("f=100,a=T,x=%d,y=%d,c=%d,r=%d,", x, y, col, row);
+    char *out = malloc(len_encoded + (len_encoded / chunk_size + 1) * 16 + strlen(control) + 16);
+    if (!out) {
+        free(encoded);
+        return NULL;
+    }
+
+    size_t out_len = sprintf(out, "\033_G%s,", control);
     
     while (pos < len_encoded) {
         size_t remaining = len_encoded - pos;
         size_t this_chunk = (remaining > chunk_size) ? chunk_size : remaining;
+        const char *prefix;
         
         if (pos == 0 && this_chunk < len_encoded) {
-            printf("m=1;");
+            prefix = "m=1;";
         } else if (pos == 0 && this_chunk == len_encoded) {
-            printf("m=0;");
+            prefix = "m=0;";
         } else if (pos + this_chunk < len_encoded) {
-            printf("\033\\\033_Gm=1;");
+            prefix = "\033\\\033_Gm=1;";
         } else {
-            printf("\033\\\033_Gm=0;");
+            prefix = "\033\\\033_Gm=0;";
         }
         
-        fwrite(&encoded[pos], 1, this_chunk, stdout);
+        memcpy(out + out_len, prefix, strlen(prefix));
+        out_len += strlen(prefix);
+        memcpy(out + out_len, &encoded[pos], this_chunk);
+        out_len += this_chunk;
         pos += this_chunk;
     }
 
-    printf("\033\\");
+    memcpy(out + out_len, "\033\\", 2);
+    out_len += 2;
+    free(encoded);
+
+    *length = out_len;
+    return out;
+}
+
+// Raw icons are cached as "ILSRGBZ1", the width and height as 32-bit
+// little-endian numbers and the zlib-compressed RGBA rows, so icons are
+// compressed once rather than on every run. `fit_size` bounds the pixel
+// size (thumbnails are larger than the cell box); 0 keeps the image as is.
+#define RGBA_CACHE_MAGIC "ILSRGBZ1"
+#define RGBA_CACHE_HEADER 16
+
+static char* get_cached_rgba_path(const char* png_path, int fit_size) {
+    const char* filename = strrchr(png_path, '/');
+    filename = filename ? filename + 1 : png_path;
+    const char* dot = strrchr(filename, '.');
+    size_t base_len = dot ? (size_t)(dot - filename) : strlen(filename);
+    
+    const char* cache_path = cache_directory();
+    size_t size = strlen(cache_path) + base_len + 32;
+    char* rgba_path = malloc(size);
+    if (!rgba_path) return NULL;
+    
+    snprintf(rgba_path, size, "%s/%.*s@%d.rgbz", cache_path, (int)base_len, filename, fit_size);
+    return rgba_path;
+}
+
+static void put_le32(unsigned char* out, uint32_t value) {
+    out[0] = value & 0xFF;
+    out[1] = (value >> 8) & 0xFF;
+    out[2] = (value >> 16) & 0xFF;
+    out[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t get_le32(const unsigned char* in) {
+    return in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static bool cache_rgba(const char* png_path, const char* rgba_path, int fit_size) {
+    CacheFill fill;
+    if (!cache_begin_fill(rgba_path, &fill)) {
+        return access(rgba_path, F_OK) == 0;
+    }
+    
+    int width, height;
+    unsigned char* pixels = png_read_rgba(png_path, &width, &height);
+    if (pixels && fit_size > 0 && (width > fit_size || height > fit_size)) {
+        unsigned char* fitted = calloc((size_t)fit_size * fit_size, 4);
+        if (fitted) png_blit_scaled(fitted, fit_size, 0, 0, fit_size, fit_size, pixels, width, height);
+        free(pixels);
+        pixels = fitted;
+        width = height = fit_size;
+    }
+    
+    bool produced = false;
+    uLong raw_size = pixels ? (uLong)width * height * 4 : 0;
+    uLongf packed_size = compressBound(raw_size);
+    unsigned char* packed = pixels ? malloc(RGBA_CACHE_HEADER + packed_size) : NULL;
+    if (packed && compress2(packed + RGBA_CACHE_HEADER, &packed_size, pixels, raw_size, Z_BEST_COMPRESSION) == Z_OK) {
+        memcpy(packed, RGBA_CACHE_MAGIC, 8);
+        put_le32(packed + 8, (uint32_t)width);
+        put_le32(packed + 12, (uint32_t)height);
+        
+        FILE* file = fopen(fill.temp_path, "wb");
+        if (file) {
+            produced = fwrite(packed, 1, RGBA_CACHE_HEADER + packed_size, file) == RGBA_CACHE_HEADER + packed_size;
+            produced = fclose(file) == 0 && produced;
+        }
+    }
+    free(packed);
+    free(pixels);
+    
+    bool ok = cache_end_fill(rgba_path, &fill, produced);
+    if (ok) cache_filled(rgba_path);
+    return ok;
+}
+
+// f=32 with o=z from the raw cache, built from the PNG when it is missing
+// or older than it
+static char* build_rgba_kitty(const char *control, const char *png_path, int fit_size, size_t* length) {
+    char* rgba_path = get_cached_rgba_path(png_path, fit_size);
+    if (!rgba_path) return NULL;
+    
+    struct stat png_st, rgba_st;
+    profile_count(PROFILE_STATS, 2);
+    bool fresh = stat(png_path, &png_st) == 0 && stat(rgba_path, &rgba_st) == 0 &&
+                 rgba_st.st_mtime >= png_st.st_mtime;
+    cache_record_access(rgba_path, fresh);
+    if (!fresh && !cache_rgba(png_path, rgba_path, fit_size)) {
+        free(rgba_path);
+        return NULL;
+    }
+    
+    size_t size;
+    unsigned char* data = read_whole_file(rgba_path, &size);
+    free(rgba_path);
+    if (!data) return NULL;
+    
+    char* sequence = NULL;
+    if (size > RGBA_CACHE_HEADER && memcmp(data, RGBA_CACHE_MAGIC, 8) == 0) {
+        char rgba_control[160];
+        snprintf(rgba_control, sizeof(rgba_control), "f=32,s=%u,v=%u,o=z,%s",
+                 get_le32(data + 8), get_le32(data + 12), control);
+        sequence = build_kitty_sequence(rgba_control, data + RGBA_CACHE_HEADER, size - RGBA_CACHE_HEADER, length);
+    }
+    free(data);
+    return sequence;
+}
+
+// Encode an icon in the transfer format for this link. `control` holds
+// the action and placement keys; RGBA that cannot be built falls back to
+// PNG.
+static char* encode_kitty_icon(const char *control, const char *png_path, int fit_size, size_t* length) {
+    profile_begin(PROFILE_ENCODING);
+    char format[160];
+    char* sequence = NULL;
+    
+    if (kitty_transfer == KITTY_TRANSFER_FILE) {
+        snprintf(format, sizeof(format), "f=100,t=f,%s", control);
+        sequence = build_kitty_sequence(format, (const unsigned char*)png_path, strlen(png_path), length);
+    } else {
+        if (kitty_transfer == KITTY_TRANSFER_RGBA) {
+            sequence = build_rgba_kitty(control, png_path, fit_size, length);
+        }
+        
+        size_t size;
+        unsigned char *png_data = sequence ? NULL : read_whole_file(png_path, &size);
+        if (png_data) {
+            snprintf(format, sizeof(format), "f=100,%s", control);
+            sequence = build_kitty_sequence(format, png_data, size, length);
+            free(png_data);
+        }
+    }
+    
+    profile_end(PROFILE_ENCODING);
+    return sequence;
+}
+
+static void draw_png_kitty(int x, int y, int col, int row, const char *png_path) {
+    char control[96];
+    snprintf(control, sizeof(control), "a=T,x=%d,y=%d,c=%d,r=%d", x, y, col, row);
+    
+    size_t length;
+    char *sequence = encode_kitty_icon(control, png_path, current_icon_size, &length);
+    if (!sequence) {
+        return;
+    }
+
+    fwrite(sequence, 1, length, stdout);
     fflush(stdout);
+    free(sequence);
+}
 
-    free(encoded);
+// Atlases already sent during this run; the terminal keeps them by id
+static unsigned int transmitted_atlases[16];
+static int transmitted_atlas_count = 0;
+
+static void transmit_atlas(const Atlas* atlas) {
+    for (int i = 0; i < transmitted_atlas_count; i++) {
+        if (transmitted_atlases[i] == atlas->image_id) return;
+    }
+    
+    char control[64];
+    snprintf(control, sizeof(control), "a=t,i=%u,q=2", atlas->image_id);
+    
+    long long start = trace_now();
+    size_t length;
+    char *sequence = encode_kitty_icon(control, atlas->png_path, 0, &length);
+    if (!sequence) return;
+    fwrite(sequence, 1, length, stdout);
+    free(sequence);
+    trace_span("emit", "atlas upload", atlas->png_path, start);
+    
+    if (transmitted_atlas_count < (int)(sizeof(transmitted_atlases) / sizeof(transmitted_atlases[0]))) {
+        transmitted_atlases[transmitted_atlas_count++] = atlas->image_id;
+    }
+}
+
+// Place one tile of an uploaded atlas through its source rectangle
+static void place_atlas_tile(const Atlas* atlas, int tile, int col, int row) {
+    printf("\033_Ga=p,i=%u,x=%d,y=%d,w=%d,h=%d,c=%d,r=%d,q=2\033\\",
+           atlas->image_id,
+           (tile % atlas->columns) * atlas->tile_size,
+           (tile / atlas->columns) * atlas->tile_size,
+           atlas->tile_size, atlas->tile_size, col, row);
 }
 
-static void draw_cached_sixel(const char* sixel_path) {
-    FILE* fp = fopen(sixel_path, "r");
-    if (!fp) return;
+// Unicode placeholder mode: each icon is uploaded once as a virtual
+// placement (U=1), and cells are drawn as U+10EEEE characters whose
+// foreground color carries the image id and whose diacritics give the row
+// and column. The listing itself is then plain text, so it survives
+// scrolling, pagers and tmux.
+#define PLACEHOLDER "\xF4\x8E\xBB\xAE"
+
+static const char* placeholder_diacritics[] = {
+    "\xCC\x85", "\xCC\x8D", "\xCC\x8E", "\xCC\x90",
+    "\xCC\x92", "\xCC\xBD", "\xCC\xBE", "\xCC\xBF",
+};
+
+static HashMap* placeholder_images = NULL;
+static unsigned int placeholder_ids[1024];
+static int placeholder_id_count = 0;
+
+// tmux only forwards graphics commands inside its passthrough sequence
+static void write_graphics(const char* sequence, size_t length) {
+    if (!getenv("TMUX")) {
+        fwrite(sequence, 1, length, stdout);
+        return;
+    }
     
-    char buffer[4096];
-    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-        printf("%s", buffer);
+    fputs("\033Ptmux;", stdout);
+    for (size_t i = 0; i < length; i++) {
+        if (sequence[i] == '\033') putchar('\033');
+        putchar(sequence[i]);
+    }
+    fputs("\033\\", stdout);
+}
+
+static bool placeholder_id_used(unsigned int id) {
+    for (int i = 0; i < placeholder_id_count; i++) {
+        if (placeholder_ids[i] == id) return true;
     }
+    return false;
+}
+
+static bool transmit_placeholder_image(unsigned int id, const char* png_path) {
+    char control[96];
+    snprintf(control, sizeof(control), "a=T,U=1,i=%u,c=%d,r=%d,q=2", id, ICON_CELL_COLUMNS, ICON_CELL_ROWS);
     
-    fclose(fp);
+    long long start = trace_now();
+    size_t length;
+    char* sequence = encode_kitty_icon(control, png_path, current_icon_size, &length);
+    if (!sequence) return false;
+    write_graphics(sequence, length);
+    free(sequence);
+    trace_span("emit", "placeholder upload", png_path, start);
+    return true;
+}
+
+// Ids fit in 24 bits so the color can carry them. They come from the path,
+// so a later run replaces the same images instead of adding new ones.
+static unsigned int upload_placeholder_image(const char* png_path) {
+    if (!placeholder_images) placeholder_images = hashmap_create(256);
+    if (!placeholder_images) return 0;
+    
+    void* known = hashmap_get(placeholder_images, png_path);
+    if (known) return (unsigned int)(uintptr_t)known;
+    if (placeholder_id_count == (int)(sizeof(placeholder_ids) / sizeof(placeholder_ids[0]))) return 0;
+    
+    unsigned int id = hash_string(png_path) & 0xFFFFFF;
+    while (id == 0 || placeholder_id_used(id)) id = (id + 1) & 0xFFFFFF;
+    if (!transmit_placeholder_image(id, png_path)) return 0;
+    
+    placeholder_ids[placeholder_id_count++] = id;
+    hashmap_put(placeholder_images, png_path, (void*)(uintptr_t)id);
+    return id;
+}
+
+// A regenerated thumbnail goes out again under its old id, and every cell
+// showing it picks up the new pixels
+static void refresh_placeholder_image(const char* png_path) {
+    void* known = placeholder_images ? hashmap_get(placeholder_images, png_path) : NULL;
+    if (known) transmit_placeholder_image((unsigned int)(uintptr_t)known, png_path);
+}
+
+// One row of an icon's cells. Only the first cell carries diacritics;
+// the rest continue it with the next column.
+static void print_placeholder_row(unsigned int id, int row) {
+    if (id == 0) {
+        printf("%*s", ICON_CELL_COLUMNS, "");
+        return;
+    }
+    
+    printf("\033[38;2;%u;%u;%um" PLACEHOLDER "%s%s", (id >> 16) & 0xFF, (id >> 8) & 0xFF, id & 0xFF,
+           placeholder_diacritics[row], placeholder_diacritics[0]);
+    for (int col = 1; col < ICON_CELL_COLUMNS; col++) {
+        fputs(PLACEHOLDER, stdout);
+    }
+    fputs("\033[39m", stdout);
 }
 
-static void fallback_to_lsd(void) {
-    execvp("lsd", (char*[]){ "lsd", NULL });
+// lsd gets the same operands, and -l when a long listing was asked for
+static void fallback_to_lsd(const char** paths, int path_count, bool long_format) {
+    char** argv = malloc((path_count + 4) * sizeof(char*));
+    if (argv) {
+        int argc = 0;
+        argv[argc++] = "lsd";
+        if (long_format) argv[argc++] = "-l";
+        argv[argc++] = "--";
+        for (int i = 0; i < path_count; i++) {
+            argv[argc++] = (char*)paths[i];
+        }
+        argv[argc] = NULL;
+        execvp("lsd", argv);
+        free(argv);
+    }
     fprintf(stderr, "Failed to execute lsd. Please install lsd for better file listing.\n");
     exit(1);
 }
 
-static void draw_image(int x, int y, int col, int row, const char *image_path, const char* sixel_path) {
-    (void)x; (void)y; (void)col; (void)row;
+// Sixel icons are drawn a whole row at a time by print_sixel_listing()
+static void draw_image(int x, int y, int col, int row, const char *image_path) {
     switch (graphics_protocol) {
         case PROTOCOL_KITTY:
             if (image_path) {
@@ -515,23 +893,146 @@ static void draw_image(int x, int y, int col, int row, const char *image_path, c
             }
             break;
         case PROTOCOL_SIXEL:
-            if (sixel_path) {
-                draw_cached_sixel(sixel_path);
-            }
-            break;
         case PROTOCOL_LSD:
             break;
     }
 }
 
+typedef struct {
+    const char* path;
+    FileEntry* files;
+    int file_count;
+    int capacity;
+    size_t max_filename_length;
+    int error;
+    bool resolved_by_daemon;
+} Listing;
+
+typedef struct {
+    Listing* listings;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} EnumerationQueue;
+
+static const char** path_arguments = NULL;
+static int path_argument_count = 0;
+static bool show_cache_stats = false;
+static long long cache_max_bytes = 0;
+static long long cache_max_entries = 0;
+static bool run_daemon = false;
+static bool allow_daemon = true;
+static bool protocol_forced = false;
+static bool show_profile = false;
+static bool sniff_contents = false;
+static bool long_listing = false;
+static bool watch_mode = false;
+
+// Over SSH the terminal cannot read our files and bytes on the wire are
+// what costs; locally the terminal reads the cached PNG itself
+static void choose_kitty_transfer(void) {
+    if (kitty_transfer != KITTY_TRANSFER_AUTO) return;
+    
+    bool remote = getenv("SSH_CONNECTION") || getenv("SSH_CLIENT") || getenv("SSH_TTY");
+    kitty_transfer = remote ? KITTY_TRANSFER_RGBA : KITTY_TRANSFER_FILE;
+}
+
+// Icons are rasterized at the pixel size of the box they are drawn into,
+// so the terminal never has to rescale them. Each size gets its own cache
+// entries, so a font size is only ever rasterized once.
+static void measure_icon_box(void) {
+    int width, height;
+    if (!term_cell_size(&width, &height)) return;
+    
+    cell_width = width;
+    cell_height = height;
+    
+    if (auto_icon_size) {
+        int size = ICON_CELL_COLUMNS * cell_width;
+        if (size > ICON_CELL_ROWS * cell_height) size = ICON_CELL_ROWS * cell_height;
+        if (size < MIN_ICON_SIZE) size = MIN_ICON_SIZE;
+        if (size > MAX_ICON_SIZE) size = MAX_ICON_SIZE;
+        current_icon_size = size;
+    }
+    
+    if (getenv("DEBUG_ICONS")) {
+        fprintf(stderr, "Cell: %dx%d pixels, icon size: %d\n", cell_width, cell_height, current_icon_size);
+    }
+}
+
 static void parse_arguments(int argc, char* argv[]) {
+    path_arguments = malloc(argc * sizeof(char*));
+    bool options_done = false;
+    
     for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--icon-size") == 0 && i + 1 < argc) {
+        if (!options_done && strcmp(argv[i], "-l") == 0) {
+            long_listing = true;
+        } else if (!options_done && argv[i][0] == '-' && argv[i][1] != '-' && argv[i][1] != '\0') {
+            // Only -l is supported; names starting with '-' go after --
+            fprintf(stderr, "ils: unrecognized option '%s'\n", argv[i]);
+            exit(1);
+        } else if (options_done || strncmp(argv[i], "--", 2) != 0) {
+            if (path_arguments) {
+                path_arguments[path_argument_count++] = argv[i];
+            }
+        } else if (strcmp(argv[i], "--") == 0) {
+            options_done = true;
+        } else if (strcmp(argv[i], "--icon-size") == 0 && i + 1 < argc) {
             int size = atoi(argv[i + 1]);
-            if (size == ICON_SIZE_16 || size == ICON_SIZE_32 || size == ICON_SIZE_64) {
+            if (strcmp(argv[i + 1], "auto") == 0) {
+                auto_icon_size = true;
+            } else if (size >= MIN_ICON_SIZE && size <= MAX_ICON_SIZE) {
                 current_icon_size = size;
+                auto_icon_size = false;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--defer-thumbnails") == 0) {
+            defer_thumbnails = true;
+        } else if (strcmp(argv[i], "--sync-thumbnails") == 0) {
+            defer_thumbnails = false;
+        } else if (strcmp(argv[i], "--atlas") == 0) {
+            kitty_atlas = true;
+        } else if (strcmp(argv[i], "--no-atlas") == 0) {
+            kitty_atlas = false;
+        } else if (strcmp(argv[i], "--kitty-transfer") == 0 && i + 1 < argc) {
+            if (strcmp(argv[i + 1], "png") == 0) {
+                kitty_transfer = KITTY_TRANSFER_PNG;
+            } else if (strcmp(argv[i + 1], "rgba") == 0) {
+                kitty_transfer = KITTY_TRANSFER_RGBA;
+            } else if (strcmp(argv[i + 1], "file") == 0) {
+                kitty_transfer = KITTY_TRANSFER_FILE;
+            } else if (strcmp(argv[i + 1], "auto") == 0) {
+                kitty_transfer = KITTY_TRANSFER_AUTO;
             }
             i++;
+        } else if (strcmp(argv[i], "--placeholders") == 0) {
+            kitty_placeholders = true;
+        } else if (strcmp(argv[i], "--no-placeholders") == 0) {
+            kitty_placeholders = false;
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            run_daemon = true;
+        } else if (strcmp(argv[i], "--no-daemon") == 0) {
+            allow_daemon = false;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            show_profile = true;
+        } else if (strcmp(argv[i], "--long") == 0) {
+            long_listing = true;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watch_mode = true;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            output_mode = OUTPUT_JSON;
+        } else if (strcmp(argv[i], "--ndjson") == 0) {
+            output_mode = OUTPUT_NDJSON;
+        } else if (strcmp(argv[i], "--sniff") == 0) {
+            sniff_contents = true;
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            show_cache_stats = true;
+        } else if (strcmp(argv[i], "--cache-max-bytes") == 0 && i + 1 < argc) {
+            cache_max_bytes = strtoll(argv[i + 1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "--cache-max-entries") == 0 && i + 1 < argc) {
+            cache_max_entries = strtoll(argv[i + 1], NULL, 10);
+            i++;
         } else if (strcmp(argv[i], "--protocol") == 0 && i + 1 < argc) {
             if (strcmp(argv[i + 1], "kitty") == 0) {
                 graphics_protocol = PROTOCOL_KITTY;
@@ -540,146 +1041,541 @@ static void parse_arguments(int argc, char* argv[]) {
             } else if (strcmp(argv[i + 1], "lsd") == 0) {
                 graphics_protocol = PROTOCOL_LSD;
             }
+            protocol_forced = true;
             i++;
         }
     }
 }
 
-int main(int argc, char* argv[]) {
-    DIR *dir;
-    struct dirent *entry;
-    struct winsize w;
+static char* join_path(const char* directory, const char* name) {
+    size_t dir_len = strlen(directory);
+    size_t name_len = strlen(name);
+    char* path = malloc(dir_len + name_len + 2);
+    if (!path) return NULL;
     
-    parse_arguments(argc, argv);
-    detect_graphics_protocol();
+    memcpy(path, directory, dir_len);
+    size_t pos = dir_len;
+    if (pos > 0 && path[pos - 1] != '/') {
+        path[pos++] = '/';
+    }
+    memcpy(path + pos, name, name_len + 1);
+    return path;
+}
+
+// Resolve the icon for a freshly enumerated entry; runs on the enumeration
+// threads. The theme index and lsd config are only read. What it writes is
+// shared under locks: thumbnails made in place (system(), lock-file fills),
+// the failure cache and the access journal under cache_lock, and queued
+// thumbnails under deferred_lock. Emoji glyphs are rendered later, on the
+// main thread, under glyph_lock.
+static void classify_entry(FileEntry* entry) {
+    profile_begin(PROFILE_RESOLUTION);
+    entry->color = get_color_code(entry->permissions);
+    entry->is_emoji = false;
+    entry->emoji_text = NULL;
     
-    if (graphics_protocol == PROTOCOL_LSD) {
-        fallback_to_lsd();
+    const char* lsd_icon = get_lsd_icon(entry->name, entry->permissions);
+    if (lsd_icon) {
+        entry->is_emoji = true;
+        entry->emoji_text = lsd_icon;
+        entry->icon_path = NULL;
+        entry->cached_png_path = get_emoji_png_path(lsd_icon, entry->color);
+        entry->is_thumbnail = false;
+    } else {
+        classify_file_icon(entry);
+    }
+    profile_end(PROFILE_RESOLUTION);
+}
+
+static bool add_listing_entry(Listing* listing, const char* name, char* path, const struct stat* st) {
+    if (listing->file_count >= listing->capacity) {
+        int capacity = listing->capacity ? listing->capacity * 2 : INITIAL_CAPACITY;
+        FileEntry* tmp = realloc(listing->files, capacity * sizeof(FileEntry));
+        if (!tmp) {
+            listing->error = ENOMEM;
+            return false;
+        }
+        listing->files = tmp;
+        listing->capacity = capacity;
     }
     
-    init_cache_path();
-    init_theme(DEFAULT_THEME);
-    init_lsd_config();
+    FileEntry* entry = &listing->files[listing->file_count];
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->permissions = st->st_mode;
+    entry->owner = st->st_uid;
+    entry->group = st->st_gid;
+    entry->links = st->st_nlink;
+    entry->device = st->st_dev;
+    entry->inode = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->name_length = strlen(name);
+    entry->mimetype = NULL;
+    entry->payload = NULL;
+    entry->payload_length = 0;
     
-    int capacity = INITIAL_CAPACITY;
-    FileEntry* files = malloc(capacity * sizeof(FileEntry));
-    int file_count = 0;
-    size_t max_filename_length = 0;
+    if (daemon_fd >= 0 || output_mode == OUTPUT_PLAIN) {
+        // The daemon resolves the icon, or none is drawn; keep just what
+        // the layout needs
+        entry->color = get_color_code(entry->permissions);
+        entry->icon_path = NULL;
+        entry->cached_png_path = NULL;
+        entry->is_thumbnail = false;
+        entry->is_emoji = false;
+        entry->emoji_text = NULL;
+    } else {
+        classify_entry(entry);
+    }
     
-    printf("\n");
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    if (entry->name_length > listing->max_filename_length) {
+        listing->max_filename_length = entry->name_length;
+    }
     
-    dir = opendir(".");
+    listing->file_count++;
+    return true;
+}
+
+static void enumerate_directory(Listing* listing) {
+    long long start = trace_now();
+    DIR* dir = opendir(listing->path);
     if (!dir) {
-        fprintf(stderr, "Error opening directory\n");
-        return 1;
+        listing->error = errno;
+        return;
     }
-
+    
+    int fd = dirfd(dir);
+    struct dirent* entry;
     while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_name[0] != '.') {
-            struct stat st;
-            if (stat(entry->d_name, &st) == -1) {
-                continue;
-            }
-
-            if (file_count >= capacity) {
-                capacity *= 2;
-                FileEntry* tmp = realloc(files, capacity * sizeof(FileEntry));
-                if (!tmp) {
-                    fprintf(stderr, "Memory allocation failed\n");
-                    free(files);
-                    closedir(dir);
-                    return 1;
-                }
-                files = tmp;
-            }
-            
-            files[file_count].name = strdup(entry->d_name);
-            files[file_count].permissions = st.st_mode;
-            files[file_count].owner = st.st_uid;
-            files[file_count].color = get_color_code(st.st_mode);
-            files[file_count].cached_sixel_path = NULL;
-            files[file_count].is_emoji = false;
-            files[file_count].emoji_text = NULL;
-            
-            const char* lsd_icon = get_lsd_icon(entry->d_name, st.st_mode);
-            if (lsd_icon) {
-                files[file_count].is_emoji = true;
-                files[file_count].emoji_text = lsd_icon;
-                files[file_count].icon_path = NULL;
-                files[file_count].cached_png_path = get_emoji_png_path(lsd_icon, files[file_count].color);
-                files[file_count].is_thumbnail = false;
-                
-                if (graphics_protocol == PROTOCOL_SIXEL && files[file_count].cached_png_path) {
-                    files[file_count].cached_sixel_path = get_cached_sixel_path(files[file_count].cached_png_path);
-                }
-            } else if (is_image_file(entry->d_name)) {
-                files[file_count].icon_path = get_thumbnail_path(entry->d_name);
-                files[file_count].is_thumbnail = true;
-                files[file_count].cached_png_path = strdup(files[file_count].icon_path);
-                
-                struct stat thumb_st;
-                if (stat(files[file_count].icon_path, &thumb_st) != 0) {
-                    generate_thumbnail(entry->d_name, files[file_count].icon_path);
-                }
-            } else {
-                files[file_count].icon_path = get_file_logo(entry->d_name, st.st_mode, st.st_uid);
-                files[file_count].is_thumbnail = false;
-                files[file_count].cached_png_path = get_cached_png_path(files[file_count].icon_path);
-                
-                if (graphics_protocol == PROTOCOL_SIXEL && files[file_count].cached_png_path) {
-                    files[file_count].cached_sixel_path = get_cached_sixel_path(files[file_count].cached_png_path);
-                }
-            }
-            
-            files[file_count].name_length = strlen(entry->d_name);
-            
-            if (files[file_count].name_length > max_filename_length) {
-                max_filename_length = files[file_count].name_length;
-            }
-            
-            file_count++;
+        profile_count(PROFILE_READDIRS, 1);
+        if (entry->d_name[0] == '.') continue;
+        
+        struct stat st;
+        profile_count(PROFILE_STATS, 1);
+        if (fstatat(fd, entry->d_name, &st, 0) == -1) {
+            continue;
+        }
+        
+        char* path = join_path(listing->path, entry->d_name);
+        if (!path || !add_listing_entry(listing, entry->d_name, path, &st)) {
+            free(path);
+            break;
         }
     }
     closedir(dir);
+    trace_span("enumerate", "read directory", listing->path, start);
+}
 
-    if (graphics_protocol != PROTOCOL_LSD) {
-        cache_all_icons(files, file_count);
+static void* enumeration_worker(void* arg) {
+    EnumerationQueue* queue = arg;
+    
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next < queue->count ? queue->next++ : -1;
+        pthread_mutex_unlock(&queue->lock);
+        
+        if (index < 0) return NULL;
+        enumerate_directory(&queue->listings[index]);
     }
+}
 
-    size_t column_width = max_filename_length + COLUMN_PADDING;
-    if (column_width < MIN_COLUMN_WIDTH) column_width = MIN_COLUMN_WIDTH;
+static void enumerate_directories(Listing* listings, int count) {
+    EnumerationQueue queue = { listings, count, 0, PTHREAD_MUTEX_INITIALIZER };
     
-    int num_columns = w.ws_col / column_width;
-    if (num_columns == 0) num_columns = 1;
+    int thread_count = count < MAX_ENUMERATION_THREADS ? count : MAX_ENUMERATION_THREADS;
+    pthread_t threads[MAX_ENUMERATION_THREADS];
+    int started = 0;
     
-    int num_rows = (file_count + num_columns - 1) / num_columns;
+    // Extra workers are an optimisation; whatever fails to start is
+    // drained by the calling thread below.
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, enumeration_worker, &queue) != 0) break;
+        started++;
+    }
+    
+    enumeration_worker(&queue);
+    
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
 
+// Only regular files whose name says nothing about their type are read
+static bool needs_sniff(const FileEntry* entry) {
+    if (!S_ISREG(entry->permissions) || entry->size == 0) return false;
+    if (entry->is_thumbnail) return false;
+    if (entry->is_emoji && entry->emoji_text != get_lsd_filetype_icon(entry->permissions)) return false;
+    return !mime_type_for_name(entry->name) &&
+           !get_mimetype_for_extension(get_file_extension(entry->name));
+}
+
+static void collect_listing_files(Listing* listing, FileEntry** entries, int* count) {
+    for (int i = 0; i < listing->file_count; i++) {
+        entries[(*count)++] = &listing->files[i];
+    }
+}
+
+// With --sniff, extensionless files get the icon for what they contain
+static void sniff_entries(FileEntry** candidates, int candidate_count) {
+    if (candidate_count == 0) return;
+    
+    SniffRequest* requests = malloc(candidate_count * sizeof(SniffRequest));
+    FileEntry** entries = malloc(candidate_count * sizeof(FileEntry*));
+    if (!requests || !entries) {
+        free(requests);
+        free(entries);
+        return;
+    }
+    
+    int count = 0;
+    for (int i = 0; i < candidate_count; i++) {
+        FileEntry* entry = candidates[i];
+        if (!needs_sniff(entry)) continue;
+        
+        requests[count] = (SniffRequest){ entry->path, entry->device, entry->inode, entry->mtime,
+                                          entry->size, entry->permissions, NULL };
+        entries[count++] = entry;
+    }
+    if (count > 0) sniff_files(requests, count);
+    
+    for (int i = 0; i < count; i++) {
+        if (!requests[i].mimetype) continue;
+        entries[i]->mimetype = requests[i].mimetype;
+        
+        char* icon_path = get_mimetype_logo(requests[i].mimetype);
+        if (!icon_path) continue;
+        
+        if (getenv("DEBUG_ICONS")) {
+            fprintf(stderr, "Sniffed %s: %s\n", entries[i]->name, requests[i].mimetype);
+        }
+        free(entries[i]->icon_path);
+        free(entries[i]->cached_png_path);
+        entries[i]->is_emoji = false;
+        entries[i]->emoji_text = NULL;
+        entries[i]->icon_path = icon_path;
+        entries[i]->cached_png_path = get_cached_png_path(icon_path);
+    }
+    
+    free(requests);
+    free(entries);
+}
+
+static void sniff_listings(Listing* file_listing, Listing* directories, int directory_count) {
+    int total = file_listing->file_count;
+    for (int i = 0; i < directory_count; i++) {
+        total += directories[i].file_count;
+    }
+    if (total == 0) return;
+    
+    FileEntry** entries = malloc(total * sizeof(FileEntry*));
+    if (!entries) return;
+    
+    int count = 0;
+    collect_listing_files(file_listing, entries, &count);
+    for (int i = 0; i < directory_count; i++) {
+        collect_listing_files(&directories[i], entries, &count);
+    }
+    sniff_entries(entries, count);
+    free(entries);
+}
+
+static bool icon_ready(FileEntry* entry) {
+    struct stat png_st;
+    if (entry->cached_png_path) profile_count(PROFILE_STATS, 1);
+    return entry->cached_png_path &&
+           (stat(entry->cached_png_path, &png_st) == 0 ||
+            (!entry->is_emoji && ensure_png_exists(entry->icon_path, entry->cached_png_path, entry->is_thumbnail)));
+}
+
+// Pack the listing's distinct icons into one atlas and upload it
+static bool prepare_atlas(Listing* listing, Atlas* atlas) {
+    const char** paths = malloc((listing->file_count ? listing->file_count : 1) * sizeof(char*));
+    if (!paths) return false;
+    
+    int count = 0;
+    for (int i = 0; i < listing->file_count; i++) {
+        if (icon_ready(&listing->files[i])) {
+            paths[count++] = listing->files[i].cached_png_path;
+        }
+    }
+    
+    profile_begin(PROFILE_CACHE_FILL);
+    long long start = trace_now();
+    bool ok = count > 0 && atlas_build(atlas, paths, count, current_icon_size);
+    trace_span("raster", "atlas", listing->path, start);
+    profile_end(PROFILE_CACHE_FILL);
+    free(paths);
+    if (!ok) {
+        atlas_free(atlas);
+        return false;
+    }
+    
+    transmit_atlas(atlas);
+    return true;
+}
+
+typedef struct {
+    unsigned char* pixels;
+    int width;
+    int height;
+} DecodedIcon;
+
+static void free_decoded_icon(void* value) {
+    DecodedIcon* icon = value;
+    free(icon->pixels);
+    free(icon);
+}
+
+static const DecodedIcon* decode_icon(HashMap* decoded, const char* path) {
+    DecodedIcon* icon = hashmap_get(decoded, path);
+    if (icon) return icon->pixels ? icon : NULL;
+    
+    // Failed decodes are remembered too, as an empty entry
+    icon = calloc(1, sizeof(DecodedIcon));
+    if (!icon) return NULL;
+    icon->pixels = png_read_rgba(path, &icon->width, &icon->height);
+    if (!hashmap_put(decoded, path, icon)) {
+        free_decoded_icon(icon);
+        return NULL;
+    }
+    return icon->pixels ? icon : NULL;
+}
+
+typedef struct {
+    int links;
+    int owner;
+    int group;
+    int size;
+} DetailWidths;
+
+static DetailWidths measure_details(const Listing* listing) {
+    DetailWidths widths = {0};
+    for (int i = 0; i < listing->file_count; i++) {
+        const FileEntry* entry = &listing->files[i];
+        char number[32];
+        int length = snprintf(number, sizeof(number), "%lu", (unsigned long)entry->links);
+        if (length > widths.links) widths.links = length;
+        length = snprintf(number, sizeof(number), "%lld", (long long)entry->size);
+        if (length > widths.size) widths.size = length;
+        length = (int)strlen(details_user(entry->owner));
+        if (length > widths.owner) widths.owner = length;
+        length = (int)strlen(details_group(entry->group));
+        if (length > widths.group) widths.group = length;
+    }
+    return widths;
+}
+
+// Everything on a long listing row up to the name
+static void print_details(const FileEntry* entry, const DetailWidths* widths) {
+    char mode[11];
+    char date[32];
+    details_mode(entry->permissions, mode);
+    details_time(entry->mtime.tv_sec, date);
+    
+    printf("%s %*lu %-*s %-*s %*lld %s ",
+           mode,
+           widths->links, (unsigned long)entry->links,
+           widths->owner, details_user(entry->owner),
+           widths->group, details_group(entry->group),
+           widths->size, (long long)entry->size,
+           date);
+}
+
+// Sixel: each grid row's icons are composed into one canvas and sent as a
+// single image with a shared palette. Icons fill the same ICON_CELL_COLUMNS
+// x ICON_CELL_ROWS box kitty uses, and names are printed beside them.
+static void print_sixel_listing(Listing* listing, const struct winsize* w) {
+    FileEntry* files = listing->files;
+    int file_count = listing->file_count;
+    
+    int box_width = ICON_CELL_COLUMNS * cell_width;
+    int box_height = ICON_CELL_ROWS * cell_height;
+    
+    size_t column_width = listing->max_filename_length + COLUMN_PADDING;
+    if (column_width < MIN_COLUMN_WIDTH) column_width = MIN_COLUMN_WIDTH;
+    int cell_columns = ICON_CELL_COLUMNS + (int)column_width;
+    
+    int num_columns = long_listing ? 1 : w->ws_col / cell_columns;
+    if (num_columns == 0) num_columns = 1;
+    int num_rows = (file_count + num_columns - 1) / num_columns;
+    DetailWidths widths = long_listing ? measure_details(listing) : (DetailWidths){0};
+    
+    int canvas_width = ((num_columns - 1) * cell_columns + ICON_CELL_COLUMNS) * cell_width;
+    unsigned char* canvas = malloc((size_t)canvas_width * box_height * 4);
+    HashMap* decoded = hashmap_create(64);
+    
     for (int row = 0; row < num_rows; row++) {
+        bool has_icons = false;
+        profile_begin(PROFILE_ENCODING);
+        if (canvas && decoded) {
+            memset(canvas, 0, (size_t)canvas_width * box_height * 4);
+            for (int col = 0; col < num_columns; col++) {
+                int index = col * num_rows + row;
+                if (index >= file_count || !icon_ready(&files[index])) continue;
+                
+                const DecodedIcon* icon = decode_icon(decoded, files[index].cached_png_path);
+                if (!icon) continue;
+                png_blit_scaled(canvas, canvas_width, col * cell_columns * cell_width, 0,
+                                box_width, box_height, icon->pixels, icon->width, icon->height);
+                has_icons = true;
+            }
+        }
+        profile_end(PROFILE_ENCODING);
+        
+        // Make room first so drawing never scrolls, then draw from the
+        // saved cursor position and come back to it
+        for (int i = 0; i < ICON_CELL_ROWS; i++) printf("\n");
+        go_up(ICON_CELL_ROWS);
+        
+        if (has_icons) {
+            size_t length;
+            profile_begin(PROFILE_ENCODING);
+            char* sixel = sixel_encode(canvas, canvas_width, box_height, &length);
+            profile_end(PROFILE_ENCODING);
+            if (sixel) {
+                long long start = trace_now();
+                printf("\0337");
+                fwrite(sixel, 1, length, stdout);
+                printf("\0338");
+                trace_span("emit", "sixel row", listing->path, start);
+                free(sixel);
+            }
+        }
+        
+        if (ICON_CELL_ROWS > 1) go_down(ICON_CELL_ROWS - 1);
         for (int col = 0; col < num_columns; col++) {
             int index = col * num_rows + row;
+            if (index >= file_count) continue;
             
-            if (index < file_count) {
-                if (graphics_protocol != PROTOCOL_SIXEL) {
-                    go_up(1);
-                }
+            if (long_listing) {
+                printf("\033[%dG", ICON_CELL_COLUMNS + 1);
+                print_details(&files[index], &widths);
+                printf("%s%s%s", files[index].color, files[index].name, RESET);
+                continue;
+            }
+            printf("\033[%dG%s%-*s%s",
+                   col * cell_columns + ICON_CELL_COLUMNS + 1,
+                   files[index].color,
+                   (int)column_width,
+                   files[index].name,
+                   RESET);
+        }
+        printf("\n");
+    }
+    
+    if (decoded) hashmap_free(decoded, free_decoded_icon);
+    free(canvas);
+}
+
+// All icons are uploaded before any text, then each grid row is printed
+// line by line without moving the cursor
+static void print_placeholder_listing(Listing* listing, const struct winsize* w) {
+    FileEntry* files = listing->files;
+    int file_count = listing->file_count;
+    unsigned int* ids = calloc(file_count ? file_count : 1, sizeof(unsigned int));
+    if (!ids) return;
+    
+    for (int i = 0; i < file_count; i++) {
+        if (icon_ready(&files[i])) ids[i] = upload_placeholder_image(files[i].cached_png_path);
+    }
+    
+    size_t column_width = listing->max_filename_length + COLUMN_PADDING;
+    if (column_width < MIN_COLUMN_WIDTH) column_width = MIN_COLUMN_WIDTH;
+    int cell_columns = ICON_CELL_COLUMNS + (int)column_width;
+    
+    int num_columns = long_listing ? 1 : w->ws_col / cell_columns;
+    if (num_columns == 0) num_columns = 1;
+    int num_rows = (file_count + num_columns - 1) / num_columns;
+    DetailWidths widths = long_listing ? measure_details(listing) : (DetailWidths){0};
+    
+    for (int row = 0; row < num_rows; row++) {
+        for (int line = 0; line < ICON_CELL_ROWS; line++) {
+            bool last_line = line == ICON_CELL_ROWS - 1;
+            for (int col = 0; col < num_columns; col++) {
+                int index = col * num_rows + row;
+                if (index >= file_count) continue;
                 
-                if (files[index].cached_png_path) {
-                    struct stat png_st;
-                    if (stat(files[index].cached_png_path, &png_st) == 0 || 
-                        (!files[index].is_emoji && ensure_png_exists(files[index].icon_path, files[index].cached_png_path, files[index].is_thumbnail))) {
-                        
-                        if (graphics_protocol == PROTOCOL_SIXEL && files[index].cached_sixel_path) {
-                            struct stat sixel_st;
-                            if (stat(files[index].cached_sixel_path, &sixel_st) == 0) {
-                                draw_image(0, 0, 4, 2, files[index].cached_png_path, files[index].cached_sixel_path);
-                            }
-                        } else {
-                            draw_image(0, 0, 4, 2, files[index].cached_png_path, NULL);
-                        }
-                    }
+                print_placeholder_row(ids[index], line);
+                if (last_line) {
+                    if (long_listing) print_details(&files[index], &widths);
+                    printf("%s%-*s%s", files[index].color, long_listing ? 0 : (int)column_width,
+                           files[index].name, RESET);
+                } else if (col + 1 < num_columns && index + num_rows < file_count) {
+                    printf("%*s", (int)column_width, "");
                 }
-                
+            }
+            printf("\n");
+        }
+    }
+    
+    free(ids);
+}
+
+static void draw_entry_icon(Listing* listing, Atlas* atlas, bool use_atlas, FileEntry* entry) {
+    long long start = trace_now();
+    int tile = use_atlas && entry->cached_png_path ? atlas_tile(atlas, entry->cached_png_path) : -1;
+    
+    if (tile >= 0) {
+        place_atlas_tile(atlas, tile, 4, 2);
+    } else if (listing->resolved_by_daemon) {
+        if (entry->payload) fwrite(entry->payload, 1, entry->payload_length, stdout);
+    } else if (icon_ready(entry)) {
+        draw_image(0, 0, 4, 2, entry->cached_png_path);
+    }
+    trace_span("emit", "icon", entry->name, start);
+}
+
+static void print_listing(Listing* listing, const struct winsize* w) {
+    FileEntry* files = listing->files;
+    int file_count = listing->file_count;
+    
+    if (graphics_protocol != PROTOCOL_LSD && !listing->resolved_by_daemon) {
+        profile_begin(PROFILE_CACHE_FILL);
+        cache_all_icons(files, file_count);
+        profile_end(PROFILE_CACHE_FILL);
+    }
+    
+    if (graphics_protocol == PROTOCOL_SIXEL) {
+        print_sixel_listing(listing, w);
+        return;
+    }
+    
+    if (kitty_placeholders && graphics_protocol == PROTOCOL_KITTY && !listing->resolved_by_daemon) {
+        print_placeholder_listing(listing, w);
+        return;
+    }
+    
+    Atlas atlas = {0};
+    bool use_atlas = kitty_atlas && graphics_protocol == PROTOCOL_KITTY &&
+                     !listing->resolved_by_daemon && prepare_atlas(listing, &atlas);
+
+    if (long_listing) {
+        DetailWidths widths = measure_details(listing);
+        for (int index = 0; index < file_count; index++) {
+            go_up(1);
+            draw_entry_icon(listing, &atlas, use_atlas, &files[index]);
+            print_details(&files[index], &widths);
+            printf("%s%s%s\n\n", files[index].color, files[index].name, RESET);
+        }
+        if (use_atlas) atlas_free(&atlas);
+        return;
+    }
+    
+    size_t column_width = listing->max_filename_length + COLUMN_PADDING;
+    if (column_width < MIN_COLUMN_WIDTH) column_width = MIN_COLUMN_WIDTH;
+    
+    int num_columns = w->ws_col / column_width;
+    if (num_columns == 0) num_columns = 1;
+    
+    int num_rows = (file_count + num_columns - 1) / num_columns;
+
+    for (int row = 0; row < num_rows; row++) {
+        for (int col = 0; col < num_columns; col++) {
+            int index = col * num_rows + row;
+            
+            if (index < file_count) {
+                go_up(1);
+                draw_entry_icon(listing, &atlas, use_atlas, &files[index]);
                 printf("%s%-*s%s", 
                        files[index].color,
                        (int)column_width, 
@@ -687,22 +1583,1055 @@ int main(int argc, char* argv[]) {
                        RESET);
             }
         }
+        printf("\n\n");
+    }
+    
+    if (use_atlas) {
+        atlas_free(&atlas);
+    }
+}
+
+// Names one per line, as ls prints them into a pipe
+static void print_plain_listing(const Listing* listing) {
+    DetailWidths widths = {0};
+    if (long_listing) widths = measure_details(listing);
+    
+    for (int i = 0; i < listing->file_count; i++) {
+        if (long_listing) print_details(&listing->files[i], &widths);
+        printf("%s\n", listing->files[i].name);
+    }
+}
+
+// Length of the UTF-8 sequence at `text`, or 0 when it is malformed
+static int utf8_sequence_length(const unsigned char* text) {
+    int length = text[0] >= 0xF0 && text[0] <= 0xF4 ? 4 :
+                 text[0] >= 0xE0 ? 3 : text[0] >= 0xC2 ? 2 : 0;
+    for (int i = 1; i < length; i++) {
+        if ((text[i] & 0xC0) != 0x80) return 0;
+    }
+    return length;
+}
+
+// File names are bytes; anything that is not UTF-8 becomes U+FFFD
+static void print_json_string(const char* text) {
+    if (!text) {
+        fputs("null", stdout);
+        return;
+    }
+    
+    putchar('"');
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else if (*c < 0x80) {
+            putchar(*c);
+        } else {
+            int length = utf8_sequence_length(c);
+            if (length == 0) {
+                fputs("\\ufffd", stdout);
+                continue;
+            }
+            fwrite(c, 1, length, stdout);
+            c += length - 1;
+        }
+    }
+    putchar('"');
+}
+
+static const char* file_type_name(mode_t mode) {
+    if (S_ISDIR(mode)) return "directory";
+    if (S_ISREG(mode)) return "file";
+    if (S_ISLNK(mode)) return "symlink";
+    if (S_ISCHR(mode)) return "char-device";
+    if (S_ISBLK(mode)) return "block-device";
+    if (S_ISFIFO(mode)) return "fifo";
+    if (S_ISSOCK(mode)) return "socket";
+    return "unknown";
+}
+
+static bool json_entries_printed = false;
+
+static void print_json_entry(const FileEntry* entry, const char* directory) {
+    const char* mimetype = entry->mimetype;
+    if (!mimetype && S_ISREG(entry->permissions)) {
+        mimetype = mime_type_for_name(entry->name);
+        if (!mimetype) mimetype = get_mimetype_for_extension(get_file_extension(entry->name));
+    }
+    char mode[11];
+    details_mode(entry->permissions, mode);
+    
+    fputs("{\"name\":", stdout);
+    print_json_string(entry->name);
+    fputs(",\"path\":", stdout);
+    print_json_string(entry->path);
+    fputs(",\"directory\":", stdout);
+    print_json_string(directory);
+    printf(",\"type\":\"%s\",\"mode\":\"%s\",\"size\":%lld,\"mtime\":%lld,\"mimetype\":",
+           file_type_name(entry->permissions), mode, (long long)entry->size, (long long)entry->mtime.tv_sec);
+    print_json_string(mimetype);
+    fputs(",\"icon\":", stdout);
+    print_json_string(entry->icon_path);
+    fputs(",\"glyph\":", stdout);
+    print_json_string(entry->emoji_text);
+    putchar('}');
+}
+
+// --json writes one array for the whole run, --ndjson a line per entry
+static void print_json_listing(const Listing* listing, const char* directory) {
+    for (int i = 0; i < listing->file_count; i++) {
+        if (output_mode == OUTPUT_JSON) {
+            fputs(json_entries_printed ? ",\n" : "\n", stdout);
+        }
+        print_json_entry(&listing->files[i], directory);
+        if (output_mode == OUTPUT_NDJSON) putchar('\n');
+        json_entries_printed = true;
+    }
+}
+
+static void print_group(Listing* listing, const char* directory, const struct winsize* w) {
+    if (output_mode == OUTPUT_PLAIN) {
+        print_plain_listing(listing);
+    } else if (output_mode == OUTPUT_TERMINAL) {
         printf("\n");
-        if (graphics_protocol != PROTOCOL_SIXEL) {
-            printf("\n");
+        print_listing(listing, w);
+    } else {
+        print_json_listing(listing, directory);
+    }
+}
+
+static void free_entry(FileEntry* entry) {
+    free(entry->name);
+    free(entry->path);
+    free(entry->icon_path);
+    free(entry->cached_png_path);
+    free(entry->payload);
+}
+
+static void free_listing(Listing* listing) {
+    for (int i = 0; i < listing->file_count; i++) {
+        free_entry(&listing->files[i]);
+    }
+    free(listing->files);
+}
+
+typedef struct {
+    int num_columns;
+    int num_rows;
+    int visible_rows;
+    int column_width;
+    int cell_columns;
+    DetailWidths widths;
+} WatchLayout;
+
+// What is on screen: the layout, and a signature per cell
+typedef struct {
+    WatchLayout layout;
+    unsigned int* signatures;
+    int slots;
+} WatchScreen;
+
+static WatchLayout watch_layout(Listing* listing, const struct winsize* w) {
+    WatchLayout layout = {0};
+    listing->max_filename_length = 0;
+    for (int i = 0; i < listing->file_count; i++) {
+        if (listing->files[i].name_length > listing->max_filename_length) {
+            listing->max_filename_length = listing->files[i].name_length;
         }
     }
+    
+    layout.column_width = (int)listing->max_filename_length + COLUMN_PADDING;
+    if (layout.column_width < MIN_COLUMN_WIDTH) layout.column_width = MIN_COLUMN_WIDTH;
+    layout.cell_columns = ICON_CELL_COLUMNS + layout.column_width;
+    
+    layout.num_columns = long_listing ? 1 : w->ws_col / layout.cell_columns;
+    if (layout.num_columns == 0) layout.num_columns = 1;
+    layout.num_rows = (listing->file_count + layout.num_columns - 1) / layout.num_columns;
+    if (layout.num_rows == 0) layout.num_rows = 1;
+    if (long_listing) {
+        // Rows are not padded, so only the detail columns matter
+        layout.widths = measure_details(listing);
+        layout.column_width = 0;
+    }
+    
+    // The bottom line stays free, so drawing there never scrolls
+    layout.visible_rows = (w->ws_row - 1) / ICON_CELL_ROWS;
+    return layout;
+}
 
-    for (int i = 0; i < file_count; i++) {
-        free(files[i].name);
-        if (files[i].is_thumbnail) {
-            free(files[i].icon_path);
+// Cells run down the columns, so a new row count moves them all, except
+// in a single column, which just grows or shrinks at the end
+static bool same_layout(const WatchLayout* a, const WatchLayout* b) {
+    return a->num_columns == b->num_columns && a->column_width == b->column_width &&
+           a->visible_rows == b->visible_rows &&
+           (a->num_columns == 1 || a->num_rows == b->num_rows) &&
+           memcmp(&a->widths, &b->widths, sizeof(DetailWidths)) == 0;
+}
+
+static int cell_row(const WatchLayout* layout, int slot) {
+    return layout->num_columns == 1 ? slot : slot % layout->num_rows;
+}
+
+// Everything a cell shows; a cell is redrawn when this changes
+static unsigned int cell_signature(const FileEntry* entry) {
+    unsigned int signature = hash_string(entry->name);
+    signature = signature * 31 + (entry->cached_png_path ? hash_string(entry->cached_png_path) : 0);
+    signature = signature * 31 + (unsigned int)entry->mtime.tv_sec;
+    signature = signature * 31 + (unsigned int)entry->mtime.tv_nsec;
+    signature = signature * 31 + (unsigned int)entry->size;
+    signature = signature * 31 + (unsigned int)entry->permissions;
+    if (long_listing) {
+        signature = signature * 31 + (unsigned int)entry->owner;
+        signature = signature * 31 + (unsigned int)entry->group;
+        signature = signature * 31 + (unsigned int)entry->links;
+    }
+    return signature ? signature : 1;
+}
+
+static void draw_sixel_cell_icon(HashMap* decoded, FileEntry* entry) {
+    const DecodedIcon* icon = decode_icon(decoded, entry->cached_png_path);
+    if (!icon) return;
+    
+    int box_width = ICON_CELL_COLUMNS * cell_width;
+    int box_height = ICON_CELL_ROWS * cell_height;
+    unsigned char* canvas = calloc((size_t)box_width * box_height, 4);
+    if (!canvas) return;
+    
+    profile_begin(PROFILE_ENCODING);
+    png_blit_scaled(canvas, box_width, 0, 0, box_width, box_height, icon->pixels, icon->width, icon->height);
+    size_t length;
+    char* sixel = sixel_encode(canvas, box_width, box_height, &length);
+    profile_end(PROFILE_ENCODING);
+    if (sixel) {
+        printf("\0337");
+        fwrite(sixel, 1, length, stdout);
+        printf("\0338");
+        free(sixel);
+    }
+    free(canvas);
+}
+
+// Text goes down first, blanking whatever was under the icon, then the
+// icon. Kitty icons are placeholder text themselves, and their images
+// stay uploaded from one redraw to the next.
+static void draw_watch_cell(const WatchLayout* layout, int index, FileEntry* entry, HashMap* decoded) {
+    int line = cell_row(layout, index) * ICON_CELL_ROWS + 1;
+    int column = layout->num_columns == 1 ? 1 : (index / layout->num_rows) * layout->cell_columns + 1;
+    bool kitty = graphics_protocol == PROTOCOL_KITTY;
+    unsigned int id = kitty && entry && icon_ready(entry) ? upload_placeholder_image(entry->cached_png_path) : 0;
+    
+    for (int i = 0; i < ICON_CELL_ROWS; i++) {
+        printf("\033[%d;%dH", line + i, column);
+        if (!entry) {
+            if (long_listing) {
+                printf("\033[K");
+            } else {
+                printf("%*s", layout->cell_columns, "");
+            }
+            continue;
+        }
+        
+        if (kitty) {
+            print_placeholder_row(id, i);
+        } else {
+            printf("\033[%dX\033[%dC", ICON_CELL_COLUMNS, ICON_CELL_COLUMNS);
+        }
+        if (i == ICON_CELL_ROWS - 1) {
+            if (long_listing) print_details(entry, &layout->widths);
+            printf("%s%-*s%s", entry->color, long_listing ? 0 : layout->column_width, entry->name, RESET);
+        } else if (!long_listing) {
+            printf("%*s", layout->column_width, "");
+        }
+        if (long_listing) printf("\033[K");
+    }
+    
+    if (!kitty && entry && icon_ready(entry)) {
+        printf("\033[%d;%dH", line, column);
+        draw_sixel_cell_icon(decoded, entry);
+    }
+}
+
+static void redraw_watch(Listing* listing, const struct winsize* w, WatchScreen* screen, bool full) {
+    long long start = trace_now();
+    WatchLayout layout = watch_layout(listing, w);
+    int slots = layout.num_rows * layout.num_columns;
+    
+    // A new geometry moves every cell, so the screen starts over
+    bool reflow = full || !screen->signatures || !same_layout(&layout, &screen->layout);
+    int shown = reflow ? 0 : screen->slots;
+    int total = slots > shown ? slots : shown;
+    unsigned int* signatures = realloc(screen->signatures, (total ? total : 1) * sizeof(unsigned int));
+    if (!signatures) return;
+    memset(signatures + shown, 0, (total - shown) * sizeof(unsigned int));
+    screen->signatures = signatures;
+    screen->layout = layout;
+    screen->slots = slots;
+    if (reflow) printf("\033[H\033[2J");
+    
+    // Cells past the end are blanked if they showed something
+    HashMap* decoded = graphics_protocol == PROTOCOL_SIXEL ? hashmap_create(64) : NULL;
+    for (int slot = 0; slot < total; slot++) {
+        if (cell_row(&layout, slot) >= layout.visible_rows) continue;
+        
+        FileEntry* entry = slot < listing->file_count ? &listing->files[slot] : NULL;
+        unsigned int signature = entry ? cell_signature(entry) : 0;
+        if (signature == signatures[slot]) continue;
+        
+        draw_watch_cell(&layout, slot, entry, decoded);
+        signatures[slot] = signature;
+    }
+    if (decoded) hashmap_free(decoded, free_decoded_icon);
+    
+    int rows = layout.num_rows < layout.visible_rows ? layout.num_rows : layout.visible_rows;
+    printf("\033[%d;1H", rows * ICON_CELL_ROWS + 1);
+    fflush(stdout);
+    trace_span("emit", "watch redraw", listing->path, start);
+}
+
+static bool same_file(const FileEntry* entry, const struct stat* st) {
+    return entry->inode == st->st_ino && entry->device == st->st_dev &&
+           entry->size == st->st_size && entry->permissions == st->st_mode &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           entry->owner == st->st_uid && entry->group == st->st_gid && entry->links == st->st_nlink;
+}
+
+// Re-stats the named entries and classifies only those that were added or
+// changed. Entries that are gone are dropped; the rest keep their place.
+static void apply_watch_changes(Listing* listing, char** names, int count) {
+    int fd = open(listing->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    HashMap* indexes = hashmap_create(listing->file_count + count);
+    int* changed = malloc((count ? count : 1) * sizeof(int));
+    if (fd < 0 || !indexes || !changed) {
+        if (fd >= 0) close(fd);
+        if (indexes) hashmap_free(indexes, NULL);
+        free(changed);
+        return;
+    }
+    
+    for (int i = 0; i < listing->file_count; i++) {
+        hashmap_put(indexes, listing->files[i].name, (void*)(uintptr_t)(i + 1));
+    }
+    
+    int changed_count = 0;
+    bool removed = false;
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        int index = (int)(uintptr_t)hashmap_get(indexes, names[i]) - 1;
+        profile_count(PROFILE_STATS, 1);
+        bool exists = fstatat(fd, names[i], &st, 0) == 0;
+        
+        if (index < 0) {
+            if (!exists) continue;
+            char* path = join_path(listing->path, names[i]);
+            if (!path || !add_listing_entry(listing, names[i], path, &st)) {
+                free(path);
+                continue;
+            }
+            changed[changed_count++] = listing->file_count - 1;
+            hashmap_put(indexes, names[i], (void*)(uintptr_t)listing->file_count);
+            continue;
         }
+        
+        FileEntry* entry = &listing->files[index];
+        if (!entry->name) continue;
+        if (!exists) {
+            free_entry(entry);
+            entry->name = NULL;
+            removed = true;
+            continue;
+        }
+        if (same_file(entry, &st)) continue;
+        
+        entry->permissions = st.st_mode;
+        entry->owner = st.st_uid;
+        entry->group = st.st_gid;
+        entry->links = st.st_nlink;
+        entry->device = st.st_dev;
+        entry->inode = st.st_ino;
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtim;
+        entry->mimetype = NULL;
+        free(entry->icon_path);
+        free(entry->cached_png_path);
+        classify_entry(entry);
+        changed[changed_count++] = index;
+    }
+    close(fd);
+    hashmap_free(indexes, NULL);
+    
+    FileEntry** entries = malloc((changed_count ? changed_count : 1) * sizeof(FileEntry*));
+    if (entries) {
+        for (int i = 0; i < changed_count; i++) {
+            entries[i] = &listing->files[changed[i]];
+        }
+        if (sniff_contents) sniff_entries(entries, changed_count);
+        
+        profile_begin(PROFILE_CACHE_FILL);
+        for (int i = 0; i < changed_count; i++) {
+            cache_all_icons(entries[i], 1);
+            if (entries[i]->is_thumbnail) refresh_placeholder_image(entries[i]->cached_png_path);
+        }
+        profile_end(PROFILE_CACHE_FILL);
+        free(entries);
+    }
+    free(changed);
+    
+    if (removed) {
+        int kept = 0;
+        for (int i = 0; i < listing->file_count; i++) {
+            if (listing->files[i].name) listing->files[kept++] = listing->files[i];
+        }
+        listing->file_count = kept;
+    }
+}
+
+// After an inotify overflow nothing is known about what changed, so every
+// name on screen or on disk is checked
+static void rescan_watch_listing(Listing* listing) {
+    DIR* dir = opendir(listing->path);
+    if (!dir) return;
+    
+    int count = 0;
+    int capacity = listing->file_count + 64;
+    char** names = malloc(capacity * sizeof(char*));
+    for (int i = 0; names && i < listing->file_count; i++) {
+        names[count++] = strdup(listing->files[i].name);
+    }
+    
+    struct dirent* entry;
+    while (names && (entry = readdir(dir)) != NULL) {
+        profile_count(PROFILE_READDIRS, 1);
+        if (entry->d_name[0] == '.') continue;
+        if (count == capacity) {
+            capacity *= 2;
+            char** tmp = realloc(names, capacity * sizeof(char*));
+            if (!tmp) break;
+            names = tmp;
+        }
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    if (!names) return;
+    
+    // Names listed twice are found unchanged the second time
+    int valid = 0;
+    for (int i = 0; i < count; i++) {
+        if (names[i]) names[valid++] = names[i];
+    }
+    apply_watch_changes(listing, names, valid);
+    for (int i = 0; i < valid; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+static int run_watch(Listing* listing) {
+    if (!watch_start(listing->path)) return 1;
+    
+    profile_begin(PROFILE_CACHE_FILL);
+    cache_all_icons(listing->files, listing->file_count);
+    profile_end(PROFILE_CACHE_FILL);
+    
+    struct winsize w = {0};
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    WatchScreen screen = {0};
+    bool full = true;
+    
+    printf("\033[?1049h\033[?25l");
+    for (;;) {
+        redraw_watch(listing, &w, &screen, full);
+        full = false;
+        
+        WatchUpdate update;
+        watch_wait(&update);
+        if (update.stopped) break;
+        if (update.resized) {
+            ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+            full = true;
+        }
+        if (update.rescan) {
+            rescan_watch_listing(listing);
+        } else if (update.count > 0) {
+            apply_watch_changes(listing, update.names, update.count);
+        }
+    }
+    printf("\033[?25h\033[?1049l");
+    fflush(stdout);
+    
+    watch_stop();
+    free(screen.signatures);
+    return 0;
+}
+
+// Send a listing to the daemon and keep the icon bytes it returns
+static bool resolve_with_daemon(Listing* listing, const char* cwd) {
+    if (listing->file_count == 0) {
+        listing->resolved_by_daemon = true;
+        return true;
+    }
+    
+    DaemonEntry* entries = malloc(listing->file_count * sizeof(DaemonEntry));
+    DaemonPayload* payloads = calloc(listing->file_count, sizeof(DaemonPayload));
+    bool ok = entries && payloads;
+    
+    if (ok) {
+        for (int i = 0; i < listing->file_count; i++) {
+            entries[i].mode = listing->files[i].permissions;
+            entries[i].name = listing->files[i].name;
+            entries[i].path = listing->files[i].path;
+        }
+        ok = daemon_request(daemon_fd, graphics_protocol, kitty_transfer, current_icon_size, cwd,
+                            entries, listing->file_count, payloads);
+    }
+    
+    if (ok) {
+        for (int i = 0; i < listing->file_count; i++) {
+            listing->files[i].payload = payloads[i].data;
+            listing->files[i].payload_length = payloads[i].length;
+            
+            // Sixel rows are composed here, so the daemon only names the PNG
+            if (graphics_protocol == PROTOCOL_SIXEL && payloads[i].data) {
+                listing->files[i].cached_png_path = strndup(payloads[i].data, payloads[i].length);
+            }
+        }
+        listing->resolved_by_daemon = true;
+    }
+    
+    free(entries);
+    free(payloads);
+    return ok;
+}
+
+static void load_theme_and_lsd_config(void) {
+    profile_begin(PROFILE_THEME);
+    init_theme(DEFAULT_THEME);
+    profile_end(PROFILE_THEME);
+    
+    profile_begin(PROFILE_LSD_CONFIG);
+    init_lsd_config();
+    profile_end(PROFILE_LSD_CONFIG);
+}
+
+// Resolve every listing through the daemon; anything it could not answer
+// is classified locally, exactly as without a daemon.
+static void resolve_listings(Listing* file_listing, Listing* directories, int directory_count) {
+    char cwd[PATH_MAX];
+    bool ok = getcwd(cwd, sizeof(cwd)) != NULL && resolve_with_daemon(file_listing, cwd);
+    
+    for (int i = 0; ok && i < directory_count; i++) {
+        if (!directories[i].error) {
+            ok = resolve_with_daemon(&directories[i], cwd);
+        }
+    }
+    
+    close(daemon_fd);
+    daemon_fd = -1;
+    if (ok) return;
+    
+    if (getenv("DEBUG_ICONS")) {
+        fprintf(stderr, "Daemon request failed, resolving icons locally\n");
+    }
+    
+    load_theme_and_lsd_config();
+    for (int i = -1; i < directory_count; i++) {
+        Listing* listing = i < 0 ? file_listing : &directories[i];
+        if (listing->resolved_by_daemon) continue;
+        for (int j = 0; j < listing->file_count; j++) {
+            classify_entry(&listing->files[j]);
+        }
+    }
+}
+
+// Daemon side. Resolved icons are memoized per protocol, size, file class
+// and name; encoded payloads per cached file, revalidated with stat.
+// Images are memoized per path once their thumbnail is valid, and checked
+// against the image's mtime and size instead of the thumbnail's tEXt.
+typedef struct {
+    char* icon_path;
+    char* cached_png_path;
+    const char* emoji_text;
+    bool is_emoji;
+} ResolvedIcon;
+
+typedef struct {
+    char* thumbnail_path;
+    struct timespec mtime;
+    off_t size;
+} ResolvedThumbnail;
+
+typedef struct EncodedIcon {
+    char* data;
+    size_t length;
+    time_t mtime;
+    off_t size;
+    struct EncodedIcon* next_retired;
+} EncodedIcon;
+
+static HashMap* resolved_icons = NULL;
+static HashMap* resolved_thumbnails = NULL;
+static HashMap* encoded_icons = NULL;
+static size_t encoded_bytes = 0;
+static EncodedIcon* retired_icons = NULL;
+
+static void free_resolved_icon(void* value) {
+    ResolvedIcon* icon = value;
+    free(icon->icon_path);
+    free(icon->cached_png_path);
+    free(icon);
+}
+
+static void free_resolved_thumbnail(void* value) {
+    ResolvedThumbnail* thumbnail = value;
+    free(thumbnail->thumbnail_path);
+    free(thumbnail);
+}
+
+static bool same_file_version(const struct stat* st, const ResolvedThumbnail* thumbnail) {
+    return st->st_size == thumbnail->size && st->st_mtim.tv_sec == thumbnail->mtime.tv_sec &&
+           st->st_mtim.tv_nsec == thumbnail->mtime.tv_nsec;
+}
+
+static void remember_thumbnail(const FileEntry* entry) {
+    struct stat st;
+    ResolvedThumbnail* thumbnail = malloc(sizeof(ResolvedThumbnail));
+    if (!thumbnail || stat(entry->path, &st) != 0 || !(thumbnail->thumbnail_path = strdup(entry->cached_png_path))) {
+        free(thumbnail);
+        return;
+    }
+    thumbnail->mtime = st.st_mtim;
+    thumbnail->size = st.st_size;
+    
+    ResolvedThumbnail* previous = hashmap_get(resolved_thumbnails, entry->path);
+    if (hashmap_put(resolved_thumbnails, entry->path, thumbnail)) {
+        if (previous) free_resolved_thumbnail(previous);
+    } else {
+        free_resolved_thumbnail(thumbnail);
+    }
+}
+
+static void free_encoded_icon(void* value) {
+    EncodedIcon* icon = value;
+    free(icon->data);
+    free(icon);
+}
+
+static char* strdup_or_null(const char* value) {
+    return value ? strdup(value) : NULL;
+}
+
+static void resolved_icon_key(const FileEntry* entry, char* key, size_t size) {
+    char file_class = S_ISDIR(entry->permissions) ? 'd' : (entry->permissions & S_IXUSR) ? 'x' : 'f';
+    snprintf(key, size, "%d:%d:%c:%s", graphics_protocol, current_icon_size, file_class, entry->name);
+}
+
+static const EncodedIcon* encode_icon(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+    
+    // Kitty clients get the encoded image, sixel clients just the PNG path
+    char key[MAX_PATH_LENGTH + 16];
+    snprintf(key, sizeof(key), "%d:%d:%d:%s", graphics_protocol, kitty_transfer, current_icon_size, path);
+    
+    EncodedIcon* icon = hashmap_get(encoded_icons, key);
+    if (icon && icon->mtime == st.st_mtime && icon->size == st.st_size) {
+        return icon;
+    }
+    
+    size_t length = 0;
+    char* data;
+    if (graphics_protocol == PROTOCOL_SIXEL) {
+        data = strdup(path);
+        length = data ? strlen(data) : 0;
+    } else {
+        data = encode_kitty_icon("a=T,x=0,y=0,c=4,r=2", path, current_icon_size, &length);
+    }
+    if (!data) return NULL;
+    
+    // A stale payload may already be in this request's reply, so it is
+    // only released once the request is done
+    EncodedIcon* stale = icon;
+    icon = malloc(sizeof(EncodedIcon));
+    if (!icon || !hashmap_put(encoded_icons, key, icon)) {
+        free(icon);
+        free(data);
+        return NULL;
+    }
+    if (stale) {
+        encoded_bytes -= stale->length;
+        stale->next_retired = retired_icons;
+        retired_icons = stale;
+    }
+    
+    icon->data = data;
+    icon->length = length;
+    icon->mtime = st.st_mtime;
+    icon->size = st.st_size;
+    encoded_bytes += length;
+    return icon;
+}
+
+// Same checks print_listing makes before drawing an icon
+static const EncodedIcon* encode_entry(FileEntry* entry) {
+    if (!entry->cached_png_path) return NULL;
+    
+    struct stat png_st;
+    if (stat(entry->cached_png_path, &png_st) != 0 &&
+        (entry->is_emoji || !ensure_png_exists(entry->icon_path, entry->cached_png_path, entry->is_thumbnail))) {
+        return NULL;
+    }
+    
+    return encode_icon(entry->cached_png_path);
+}
+
+static void serve_request(int protocol, int transfer, int icon_size, const char* cwd,
+                          const DaemonEntry* entries, int count, DaemonPayload* payloads) {
+    graphics_protocol = protocol == PROTOCOL_SIXEL ? PROTOCOL_SIXEL : PROTOCOL_KITTY;
+    kitty_transfer = transfer == KITTY_TRANSFER_RGBA || transfer == KITTY_TRANSFER_FILE ? transfer : KITTY_TRANSFER_PNG;
+    if (icon_size < MIN_ICON_SIZE || icon_size > MAX_ICON_SIZE) {
+        icon_size = DEFAULT_ICON_SIZE;
+    }
+    // Edited sources are picked up before anything is resolved from them;
+    // memoized emoji point into the lsd config, so they go as well
+    if (theme_sources_changed() || lsd_config_changed()) {
+        current_icon_size = icon_size;
+        init_theme(DEFAULT_THEME);
+        cleanup_lsd_config();
+        init_lsd_config();
+        hashmap_clear(resolved_icons, free_resolved_icon);
+    } else if (icon_size != current_icon_size) {
+        theme_set_icon_size(icon_size);
+    }
+    
+    // Payloads handed out are borrowed from the map, so only trim between requests
+    while (retired_icons) {
+        EncodedIcon* next = retired_icons->next_retired;
+        free_encoded_icon(retired_icons);
+        retired_icons = next;
+    }
+    if (encoded_bytes > DAEMON_PAYLOAD_BUDGET) {
+        hashmap_clear(encoded_icons, free_encoded_icon);
+        encoded_bytes = 0;
+    }
+    if (hashmap_count(resolved_icons) > DAEMON_RESOLVED_MAX) {
+        hashmap_clear(resolved_icons, free_resolved_icon);
+    }
+    if (hashmap_count(resolved_thumbnails) > DAEMON_RESOLVED_MAX) {
+        hashmap_clear(resolved_thumbnails, free_resolved_thumbnail);
+    }
+    
+    FileEntry* files = calloc(count ? count : 1, sizeof(FileEntry));
+    FileEntry* misses = calloc(count ? count : 1, sizeof(FileEntry));
+    int* miss_index = calloc(count ? count : 1, sizeof(int));
+    if (!files || !misses || !miss_index) {
+        free(files);
+        free(misses);
+        free(miss_index);
+        return;
+    }
+    
+    int miss_count = 0;
+    char key[MAX_PATH_LENGTH + 32];
+    
+    for (int i = 0; i < count; i++) {
+        FileEntry* entry = &files[i];
+        entry->name = (char*)entries[i].name;
+        entry->path = entries[i].path[0] == '/' ? strdup(entries[i].path) : join_path(cwd, entries[i].path);
+        entry->permissions = entries[i].mode;
+        entry->name_length = strlen(entry->name);
+        entry->color = get_color_code(entry->permissions);
+        
+        bool image = is_image_file(entry->name);
+        ResolvedThumbnail* thumbnail = image && entry->path ? hashmap_get(resolved_thumbnails, entry->path) : NULL;
+        struct stat st;
+        if (thumbnail && stat(entry->path, &st) == 0 && same_file_version(&st, thumbnail)) {
+            const EncodedIcon* icon = encode_icon(thumbnail->thumbnail_path);
+            if (icon) {
+                cache_record_access(thumbnail->thumbnail_path, true);
+                payloads[i].data = icon->data;
+                payloads[i].length = icon->length;
+                continue;
+            }
+        }
+        
+        resolved_icon_key(entry, key, sizeof(key));
+        ResolvedIcon* resolved = image ? NULL : hashmap_get(resolved_icons, key);
+        if (resolved) {
+            entry->icon_path = strdup_or_null(resolved->icon_path);
+            entry->cached_png_path = strdup_or_null(resolved->cached_png_path);
+            entry->emoji_text = resolved->emoji_text;
+            entry->is_emoji = resolved->is_emoji;
+            
+            const EncodedIcon* icon = entry->cached_png_path ? encode_icon(entry->cached_png_path) : NULL;
+            if (icon) {
+                cache_record_access(entry->cached_png_path, true);
+                payloads[i].data = icon->data;
+                payloads[i].length = icon->length;
+                continue;
+            }
+            
+            // Evicted from the disk cache since; resolve it again
+            free(entry->icon_path);
+            free(entry->cached_png_path);
+        }
+        
+        if (entry->path) {
+            classify_entry(entry);
+            miss_index[miss_count] = i;
+            misses[miss_count++] = *entry;
+        }
+    }
+    
+    cache_all_icons(misses, miss_count);
+    
+    for (int m = 0; m < miss_count; m++) {
+        FileEntry* entry = &files[miss_index[m]];
+        *entry = misses[m];
+        
+        const EncodedIcon* icon = encode_entry(entry);
+        if (!icon) continue;
+        
+        payloads[miss_index[m]].data = icon->data;
+        payloads[miss_index[m]].length = icon->length;
+        
+        if (entry->is_thumbnail) {
+            remember_thumbnail(entry);
+            continue;
+        }
+        if (is_image_file(entry->name)) continue;
+        
+        ResolvedIcon* resolved = malloc(sizeof(ResolvedIcon));
+        if (!resolved) continue;
+        resolved->icon_path = strdup_or_null(entry->icon_path);
+        resolved->cached_png_path = strdup_or_null(entry->cached_png_path);
+        resolved->emoji_text = entry->emoji_text;
+        resolved->is_emoji = entry->is_emoji;
+        
+        resolved_icon_key(entry, key, sizeof(key));
+        ResolvedIcon* previous = hashmap_get(resolved_icons, key);
+        if (hashmap_put(resolved_icons, key, resolved)) {
+            if (previous) free_resolved_icon(previous);
+        } else {
+            free_resolved_icon(resolved);
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        free(files[i].path);
+        free(files[i].icon_path);
         free(files[i].cached_png_path);
-        free(files[i].cached_sixel_path);
     }
     free(files);
+    free(misses);
+    free(miss_index);
+}
+
+// The journal, eviction and queued thumbnails wait until requests stop
+static void serve_idle(void) {
+    cache_finish();
+    thumbnail_run_deferred();
+}
+
+static int serve_daemon(void) {
+    resolved_icons = hashmap_create(1024);
+    resolved_thumbnails = hashmap_create(1024);
+    encoded_icons = hashmap_create(1024);
+    if (!resolved_icons || !resolved_thumbnails || !encoded_icons) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    
+    // Clients give up after DAEMON_TIMEOUT_MS, so a cold image gets its type
+    // icon and the thumbnail is left to the background generator
+    defer_thumbnails = true;
+    
+    init_theme(DEFAULT_THEME);
+    init_lsd_config();
+    int status = daemon_serve(serve_request, serve_idle);
+    
+    hashmap_free(resolved_icons, free_resolved_icon);
+    hashmap_free(resolved_thumbnails, free_resolved_thumbnail);
+    hashmap_free(encoded_icons, free_encoded_icon);
     cleanup_theme();
     cleanup_lsd_config();
-    return 0;
+    return status;
+}
+
+int main(int argc, char* argv[]) {
+    struct winsize w;
+    int status = 0;
+    
+    parse_arguments(argc, argv);
+    cache_init();
+    cache_set_limits(cache_max_bytes, cache_max_entries);
+    
+    if (show_cache_stats) {
+        cache_print_stats(stdout);
+        free(path_arguments);
+        return 0;
+    }
+    
+    if (run_daemon) {
+        free(path_arguments);
+        return serve_daemon();
+    }
+    
+    // Pipes get plain names unless a protocol was asked for, and never
+    // touch the theme or the icon caches
+    if (output_mode == OUTPUT_TERMINAL && !protocol_forced && !isatty(STDOUT_FILENO)) {
+        output_mode = OUTPUT_PLAIN;
+    }
+    if (watch_mode && output_mode != OUTPUT_TERMINAL) {
+        fprintf(stderr, "ils: --watch needs a terminal\n");
+        free(path_arguments);
+        return 1;
+    }
+    
+    if (show_profile) {
+        profile_start();
+    }
+    trace_start();
+    
+    if (output_mode == OUTPUT_TERMINAL) {
+        profile_begin(PROFILE_TERMINAL);
+        if (!protocol_forced) {
+            detect_graphics_protocol();
+        }
+        
+        if (graphics_protocol == PROTOCOL_LSD) {
+            fallback_to_lsd(path_arguments, path_argument_count, long_listing);
+        } else {
+            measure_icon_box();
+        }
+        choose_kitty_transfer();
+        profile_end(PROFILE_TERMINAL);
+    }
+    
+    // Watching keeps its own state: kitty icons are placeholder images that
+    // stay uploaded across redraws, and thumbnails are made as files change
+    if (watch_mode) {
+        kitty_placeholders = true;
+        kitty_atlas = false;
+        defer_thumbnails = false;
+    }
+    
+    // The daemon only sends finished images, so atlases, placeholders and
+    // sniffed icons bypass it, as does JSON, which wants icon paths instead
+    if (allow_daemon && output_mode == OUTPUT_TERMINAL && !watch_mode && !kitty_atlas && !kitty_placeholders && !sniff_contents) {
+        daemon_fd = daemon_connect();
+    }
+    // The daemon has its own theme and lsd config, so they are only loaded
+    // when icons are resolved here
+    if (daemon_fd < 0 && output_mode != OUTPUT_PLAIN) {
+        load_theme_and_lsd_config();
+    }
+    
+    if (path_argument_count == 0 && path_arguments) {
+        path_arguments[path_argument_count++] = ".";
+    }
+    
+    // As with ls, file operands are listed together first, followed by
+    // one group per directory operand.
+    Listing file_listing = {0};
+    Listing* directories = calloc(path_argument_count ? path_argument_count : 1, sizeof(Listing));
+    int directory_count = 0;
+    if (!path_arguments || !directories) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    
+    for (int i = 0; i < path_argument_count; i++) {
+        struct stat st;
+        profile_count(PROFILE_STATS, 1);
+        if (stat(path_arguments[i], &st) == -1) {
+            fprintf(stderr, "ils: cannot access '%s': %s\n", path_arguments[i], strerror(errno));
+            status = 1;
+        } else if (S_ISDIR(st.st_mode)) {
+            directories[directory_count++].path = path_arguments[i];
+        } else {
+            char* path = strdup(path_arguments[i]);
+            if (!path || !add_listing_entry(&file_listing, path_arguments[i], path, &st)) {
+                free(path);
+            }
+        }
+    }
+    
+    if (watch_mode && (directory_count != 1 || path_argument_count != 1)) {
+        fprintf(stderr, "ils: --watch takes a single directory\n");
+        return 1;
+    }
+    
+    profile_begin(PROFILE_ENUMERATION);
+    enumerate_directories(directories, directory_count);
+    profile_end(PROFILE_ENUMERATION);
+    
+    if (daemon_fd >= 0) {
+        profile_begin(PROFILE_RESOLUTION);
+        resolve_listings(&file_listing, directories, directory_count);
+        profile_end(PROFILE_RESOLUTION);
+    } else if (sniff_contents && output_mode != OUTPUT_PLAIN) {
+        profile_begin(PROFILE_RESOLUTION);
+        sniff_listings(&file_listing, directories, directory_count);
+        profile_end(PROFILE_RESOLUTION);
+    }
+    
+    profile_begin(PROFILE_OUTPUT);
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    bool show_headers = path_argument_count > 1;
+    bool first_group = true;
+    
+    bool json = output_mode == OUTPUT_JSON || output_mode == OUTPUT_NDJSON;
+    
+    if (output_mode == OUTPUT_JSON) {
+        printf("[");
+    }
+    if (file_listing.file_count > 0) {
+        print_group(&file_listing, NULL, &w);
+        first_group = false;
+    }
+    
+    for (int i = 0; i < directory_count; i++) {
+        if (directories[i].error) {
+            fprintf(stderr, "ils: cannot open directory '%s': %s\n", directories[i].path, strerror(directories[i].error));
+            status = 1;
+            continue;
+        }
+        if (watch_mode) {
+            status = run_watch(&directories[i]);
+            continue;
+        }
+        
+        if (!first_group && !json) {
+            printf("\n");
+        }
+        if (show_headers && !json) {
+            printf("%s:\n", directories[i].path);
+        }
+        print_group(&directories[i], directories[i].path, &w);
+        first_group = false;
+    }
+    if (output_mode == OUTPUT_JSON) {
+        printf(json_entries_printed ? "\n]\n" : "]\n");
+    }
+
+    fflush(stdout);
+    profile_end(PROFILE_OUTPUT);
+    profile_report(protocol_name());
+    
+    cache_finish();
+    thumbnail_run_deferred();
+    trace_finish();
+    
+    free_listing(&file_listing);
+    for (int i = 0; i < directory_count; i++) {
+        free_listing(&directories[i]);
+    }
+    free(directories);
+    free(path_arguments);
+    cleanup_theme();
+    cleanup_lsd_config();
+    sniff_cleanup();
+    details_cleanup();
+    if (placeholder_images) hashmap_free(placeholder_images, NULL);
+    return status;
 }
@@ -0,0 +1,12 @@
+#ifndef MD5_H
+#define MD5_H
+
+#include <stddef.h>
+
+#define MD5_DIGEST_LENGTH 16
+#define MD5_HEX_LENGTH (MD5_DIGEST_LENGTH * 2 + 1)
+
+void md5_digest(const void* data, size_t len, unsigned char digest[MD5_DIGEST_LENGTH]);
+void md5_hex(const void* data, size_t len, char hex[MD5_HEX_LENGTH]);
+
+#endif
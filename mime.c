@@ -0,0 +1,826 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "hashmap.h"
+#include "md5.h"
+#include "mime.h"
+
+// Bump when the layout or hash_string changes
+#define MIME_CACHE_MAGIC "ILSMIME1"
+#define MIME_MAX_SOURCES 16
+
+#define MIME_CASE_SENSITIVE 1
+
+typedef struct {
+    uint32_t pattern;
+    uint32_t type;
+    uint16_t weight;
+    uint16_t flags;
+} MimeGlob;
+
+// One slot per literal glob, hashed on the lowercased name so exact and
+// case-insensitive lookups probe the same chain. `glob` is a glob index
+// plus one, so zero marks an empty slot.
+typedef struct {
+    uint32_t hash;
+    uint32_t glob;
+} MimeLiteralSlot;
+
+// Suffix globs ("*.tar.gz") are stored reversed, as written, in a trie
+// rooted at node 0. `any` is the best glob ending at a node, `folded` the
+// best case-insensitive one. Both are glob indices plus one. Children and
+// siblings always come later in the array, so a walk can never loop.
+typedef struct {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t any;
+    uint32_t folded;
+    uint32_t character;
+} MimeTrieNode;
+
+// The compiled matcher is one block: this header, the globs, the literal
+// table, the trie, the full glob list and the string pool. It is written
+// to the cache byte for byte.
+typedef struct {
+    char magic[8];
+    char source_key[MD5_HEX_LENGTH];
+    uint32_t glob_count;
+    uint32_t literal_slots;
+    uint32_t node_count;
+    uint32_t full_count;
+    uint32_t pool_size;
+} MimeCacheHeader;
+
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+} MimeSource;
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} MimeBuffer;
+
+typedef struct {
+    MimeGlob* globs;
+    int glob_count;
+    int glob_capacity;
+    MimeBuffer pool;
+    HashMap* interned;
+    HashMap* removed_types;
+} MimeBuilder;
+
+static struct {
+    void* data;
+    size_t size;
+    bool mapped;
+    const MimeGlob* globs;
+    const MimeLiteralSlot* literals;
+    uint32_t literal_slots;
+    const MimeTrieNode* nodes;
+    const uint32_t* full;
+    uint32_t full_count;
+    const char* pool;
+} mime = {0};
+
+// Magic rules, parsed on first use. A matchlet is followed by its
+// children, which are indented one level deeper. Values, masks and type
+// names live in `bytes`; a section's type always comes first, so a mask
+// offset of zero means no mask.
+typedef struct {
+    int indent;
+    uint32_t offset;
+    uint32_t range;
+    uint32_t value_length;
+    uint32_t value;
+    uint32_t mask;
+} MagicMatchlet;
+
+typedef struct {
+    int priority;
+    uint32_t type;
+    int first;
+    int count;
+} MagicSection;
+
+static struct {
+    bool loaded;
+    MimeBuffer sections;
+    MimeBuffer matchlets;
+    MimeBuffer bytes;
+} magic = {0};
+
+static pthread_mutex_t magic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool buffer_append(MimeBuffer* buffer, const void* data, size_t length) {
+    if (buffer->size + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->size + length) capacity *= 2;
+        char* tmp = realloc(buffer->data, capacity);
+        if (!tmp) return false;
+        buffer->data = tmp;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, length);
+    buffer->size += length;
+    return true;
+}
+
+// Pool offset of `text`, adding it once. Offset 0 is the empty string.
+static uint32_t intern(MimeBuilder* builder, const char* text) {
+    void* known = hashmap_get(builder->interned, text);
+    if (known) return (uint32_t)(uintptr_t)known;
+
+    uint32_t offset = (uint32_t)builder->pool.size;
+    if (!buffer_append(&builder->pool, text, strlen(text) + 1)) return 0;
+    hashmap_put(builder->interned, text, (void*)(uintptr_t)offset);
+    return offset;
+}
+
+static void add_glob(MimeBuilder* builder, int weight, const char* type, const char* pattern, bool case_sensitive) {
+    if (builder->glob_count == builder->glob_capacity) {
+        int capacity = builder->glob_capacity ? builder->glob_capacity * 2 : 1024;
+        MimeGlob* tmp = realloc(builder->globs, capacity * sizeof(MimeGlob));
+        if (!tmp) return;
+        builder->globs = tmp;
+        builder->glob_capacity = capacity;
+    }
+
+    MimeGlob glob;
+    glob.pattern = intern(builder, pattern);
+    glob.type = intern(builder, type);
+    glob.weight = (uint16_t)(weight > 0 && weight <= 100 ? weight : 50);
+    glob.flags = case_sensitive ? MIME_CASE_SENSITIVE : 0;
+    if (!glob.pattern || !glob.type) return;
+    builder->globs[builder->glob_count++] = glob;
+}
+
+// Sources are parsed from the highest priority down. __NOGLOBS__ in one
+// file drops the type's globs from every lower priority file.
+static void parse_globs2(MimeBuilder* builder, const char* path, int source) {
+    FILE* file = fopen(path, "r");
+    if (!file) return;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        char* newline = strchr(line, '\n');
+        if (newline) *newline = '\0';
+        if (line[0] == '#' || line[0] == '\0') continue;
+
+        // weight:type:pattern[:flags]
+        char* type = strchr(line, ':');
+        if (!type) continue;
+        *type++ = '\0';
+        char* pattern = strchr(type, ':');
+        if (!pattern) continue;
+        *pattern++ = '\0';
+        char* flags = strchr(pattern, ':');
+        if (flags) *flags++ = '\0';
+        if (!*type || !*pattern) continue;
+
+        void* removed_by = hashmap_get(builder->removed_types, type);
+        if (removed_by && (intptr_t)removed_by - 1 < source) continue;
+
+        if (strcmp(pattern, "__NOGLOBS__") == 0) {
+            if (!removed_by) hashmap_put(builder->removed_types, type, (void*)(intptr_t)(source + 1));
+            continue;
+        }
+
+        bool case_sensitive = flags && strstr(flags, "cs") != NULL;
+        add_glob(builder, atoi(line), type, pattern, case_sensitive);
+    }
+
+    fclose(file);
+}
+
+static bool is_wildcard(char c) {
+    return c == '*' || c == '?' || c == '[';
+}
+
+static bool is_literal(const char* pattern) {
+    for (const char* p = pattern; *p; p++) {
+        if (is_wildcard(*p)) return false;
+    }
+    return true;
+}
+
+static bool is_suffix(const char* pattern) {
+    return pattern[0] == '*' && pattern[1] && is_literal(pattern + 1);
+}
+
+// Keep the heavier glob; on equal weight the one seen first, which comes
+// from the higher priority source
+static void keep_best(const MimeGlob* globs, uint32_t* slot, uint32_t candidate) {
+    if (!*slot || globs[candidate - 1].weight > globs[*slot - 1].weight) *slot = candidate;
+}
+
+static uint32_t hash_folded(const char* text) {
+    char lowered[NAME_MAX + 1];
+    size_t length = strlen(text);
+    if (length >= sizeof(lowered)) length = sizeof(lowered) - 1;
+    for (size_t i = 0; i < length; i++) lowered[i] = tolower((unsigned char)text[i]);
+    lowered[length] = '\0';
+    return hash_string(lowered);
+}
+
+static void* compile_matcher(MimeBuilder* builder, const char* source_key, size_t* size) {
+    const char* pool = builder->pool.data;
+    MimeGlob* globs = builder->globs;
+    int glob_count = builder->glob_count;
+
+    int literal_count = 0;
+    for (int i = 0; i < glob_count; i++) {
+        if (is_literal(pool + globs[i].pattern)) literal_count++;
+    }
+    uint32_t literal_slots = 8;
+    while (literal_slots < (uint32_t)literal_count * 2) literal_slots *= 2;
+
+    MimeLiteralSlot* literals = calloc(literal_slots, sizeof(MimeLiteralSlot));
+    MimeBuffer nodes = {0};
+    MimeBuffer full = {0};
+    MimeTrieNode root = {0};
+    bool ok = literals && buffer_append(&nodes, &root, sizeof(root));
+
+    for (int i = 0; ok && i < glob_count; i++) {
+        const char* pattern = pool + globs[i].pattern;
+        uint32_t candidate = (uint32_t)i + 1;
+        bool folded = !(globs[i].flags & MIME_CASE_SENSITIVE);
+
+        if (is_literal(pattern)) {
+            uint32_t hash = hash_folded(pattern);
+            uint32_t index = hash & (literal_slots - 1);
+            while (literals[index].glob) index = (index + 1) & (literal_slots - 1);
+            literals[index].hash = hash;
+            literals[index].glob = candidate;
+        } else if (is_suffix(pattern)) {
+            uint32_t node = 0;
+            for (size_t j = strlen(pattern); ok && j > 1; j--) {
+                unsigned char c = (unsigned char)pattern[j - 1];
+                MimeTrieNode* trie = (MimeTrieNode*)nodes.data;
+                uint32_t child = trie[node].first_child;
+                uint32_t last = 0;
+                while (child && trie[child].character != c) {
+                    last = child;
+                    child = trie[child].next_sibling;
+                }
+                if (!child) {
+                    child = (uint32_t)(nodes.size / sizeof(MimeTrieNode));
+                    if (last) trie[last].next_sibling = child;
+                    else trie[node].first_child = child;
+                    MimeTrieNode added = {0};
+                    added.character = c;
+                    ok = buffer_append(&nodes, &added, sizeof(added));
+                }
+                node = child;
+            }
+            if (ok) {
+                MimeTrieNode* trie = (MimeTrieNode*)nodes.data;
+                keep_best(globs, &trie[node].any, candidate);
+                if (folded) keep_best(globs, &trie[node].folded, candidate);
+            }
+        } else {
+            uint32_t index = (uint32_t)i;
+            ok = buffer_append(&full, &index, sizeof(index));
+        }
+    }
+
+    char* data = NULL;
+    if (ok) {
+        MimeCacheHeader header = {0};
+        memcpy(header.magic, MIME_CACHE_MAGIC, sizeof(header.magic));
+        snprintf(header.source_key, sizeof(header.source_key), "%s", source_key);
+        header.glob_count = (uint32_t)glob_count;
+        header.literal_slots = literal_slots;
+        header.node_count = (uint32_t)(nodes.size / sizeof(MimeTrieNode));
+        header.full_count = (uint32_t)(full.size / sizeof(uint32_t));
+        header.pool_size = (uint32_t)builder->pool.size;
+
+        *size = sizeof(header) + glob_count * sizeof(MimeGlob) + literal_slots * sizeof(MimeLiteralSlot) +
+                nodes.size + full.size + builder->pool.size;
+        data = malloc(*size);
+        if (data) {
+            char* cursor = data;
+            memcpy(cursor, &header, sizeof(header));
+            cursor += sizeof(header);
+            memcpy(cursor, globs, glob_count * sizeof(MimeGlob));
+            cursor += glob_count * sizeof(MimeGlob);
+            memcpy(cursor, literals, literal_slots * sizeof(MimeLiteralSlot));
+            cursor += literal_slots * sizeof(MimeLiteralSlot);
+            memcpy(cursor, nodes.data, nodes.size);
+            cursor += nodes.size;
+            if (full.size) memcpy(cursor, full.data, full.size);
+            cursor += full.size;
+            memcpy(cursor, builder->pool.data, builder->pool.size);
+        }
+    }
+
+    free(literals);
+    free(nodes.data);
+    free(full.data);
+    return data;
+}
+
+static size_t matcher_size(const MimeCacheHeader* header) {
+    return sizeof(MimeCacheHeader) + (size_t)header->glob_count * sizeof(MimeGlob) +
+           (size_t)header->literal_slots * sizeof(MimeLiteralSlot) +
+           (size_t)header->node_count * sizeof(MimeTrieNode) +
+           (size_t)header->full_count * sizeof(uint32_t) + header->pool_size;
+}
+
+static void use_matcher(void* data, size_t size, bool mapped) {
+    const MimeCacheHeader* header = data;
+    const char* cursor = (const char*)data + sizeof(MimeCacheHeader);
+
+    mime.data = data;
+    mime.size = size;
+    mime.mapped = mapped;
+    mime.globs = (const MimeGlob*)cursor;
+    cursor += header->glob_count * sizeof(MimeGlob);
+    mime.literals = (const MimeLiteralSlot*)cursor;
+    mime.literal_slots = header->literal_slots;
+    cursor += header->literal_slots * sizeof(MimeLiteralSlot);
+    mime.nodes = (const MimeTrieNode*)cursor;
+    cursor += header->node_count * sizeof(MimeTrieNode);
+    mime.full = (const uint32_t*)cursor;
+    mime.full_count = header->full_count;
+    cursor += header->full_count * sizeof(uint32_t);
+    mime.pool = cursor;
+}
+
+// Everything in a cached matcher must point inside it before it is used
+static bool matcher_valid(const void* data, size_t size, const char* source_key) {
+    const MimeCacheHeader* header = data;
+    if (size < sizeof(MimeCacheHeader) ||
+        memcmp(header->magic, MIME_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        strncmp(header->source_key, source_key, sizeof(header->source_key)) != 0 ||
+        header->glob_count > size || header->literal_slots > size || header->node_count > size ||
+        header->full_count > size || header->pool_size == 0 || matcher_size(header) != size ||
+        header->literal_slots == 0 || (header->literal_slots & (header->literal_slots - 1)) != 0 ||
+        header->node_count == 0) {
+        return false;
+    }
+
+    const char* cursor = (const char*)data + sizeof(MimeCacheHeader);
+    const MimeGlob* globs = (const MimeGlob*)cursor;
+    cursor += header->glob_count * sizeof(MimeGlob);
+    const MimeLiteralSlot* literals = (const MimeLiteralSlot*)cursor;
+    cursor += header->literal_slots * sizeof(MimeLiteralSlot);
+    const MimeTrieNode* nodes = (const MimeTrieNode*)cursor;
+    cursor += header->node_count * sizeof(MimeTrieNode);
+    const uint32_t* full = (const uint32_t*)cursor;
+    cursor += header->full_count * sizeof(uint32_t);
+    const char* pool = cursor;
+
+    if (pool[0] != '\0' || pool[header->pool_size - 1] != '\0') return false;
+    for (uint32_t i = 0; i < header->glob_count; i++) {
+        if (globs[i].pattern >= header->pool_size || globs[i].type >= header->pool_size) return false;
+    }
+
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < header->literal_slots; i++) {
+        if (literals[i].glob > header->glob_count) return false;
+        if (literals[i].glob) used++;
+    }
+    if (used >= header->literal_slots) return false;
+
+    for (uint32_t i = 0; i < header->node_count; i++) {
+        const MimeTrieNode* node = &nodes[i];
+        if ((node->first_child && (node->first_child <= i || node->first_child >= header->node_count)) ||
+            (node->next_sibling && (node->next_sibling <= i || node->next_sibling >= header->node_count)) ||
+            node->any > header->glob_count || node->folded > header->glob_count) return false;
+    }
+
+    for (uint32_t i = 0; i < header->full_count; i++) {
+        if (full[i] >= header->glob_count) return false;
+    }
+    return true;
+}
+
+// mime/<file_name> files from the highest priority to the lowest, and a
+// key that changes whenever any of them does
+static int find_sources(const char* file_name, MimeSource* sources, char key[MD5_HEX_LENGTH]) {
+    const char* home = getenv("HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        home = pw ? pw->pw_dir : "/tmp";
+    }
+    const char* data_home = getenv("XDG_DATA_HOME");
+    const char* data_dirs = getenv("XDG_DATA_DIRS");
+    if (!data_dirs || !*data_dirs) data_dirs = "/usr/local/share:/usr/share";
+
+    int count = 0;
+    if (data_home && *data_home) {
+        snprintf(sources[count].path, sizeof(sources[count].path), "%s/mime/%s", data_home, file_name);
+    } else {
+        snprintf(sources[count].path, sizeof(sources[count].path), "%s/.local/share/mime/%s", home, file_name);
+    }
+    if (stat(sources[count].path, &sources[count].st) == 0) count++;
+
+    const char* dir = data_dirs;
+    while (*dir && count < MIME_MAX_SOURCES) {
+        size_t length = strcspn(dir, ":");
+        if (length > 0) {
+            snprintf(sources[count].path, sizeof(sources[count].path), "%.*s/mime/%s", (int)length, dir, file_name);
+            if (stat(sources[count].path, &sources[count].st) == 0) count++;
+        }
+        dir += length;
+        if (*dir == ':') dir++;
+    }
+
+    char text[MIME_MAX_SOURCES * (MAX_PATH_LENGTH + 64)];
+    size_t length = 0;
+    for (int i = 0; i < count && length < sizeof(text); i++) {
+        length += snprintf(text + length, sizeof(text) - length, "%s %lld.%09ld %lld\n", sources[i].path,
+                           (long long)sources[i].st.st_mtim.tv_sec, sources[i].st.st_mtim.tv_nsec,
+                           (long long)sources[i].st.st_size);
+    }
+    if (length >= sizeof(text)) length = sizeof(text) - 1;
+    md5_hex(text, length, key);
+    return count;
+}
+
+static void cache_file_path(char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/mime-globs.cache", cache_state_directory());
+}
+
+static bool load_cached(const char* source_key) {
+    char path[MAX_PATH_LENGTH + 32];
+    cache_file_path(path, sizeof(path));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(MimeCacheHeader)) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    if (!matcher_valid(data, st.st_size, source_key)) {
+        munmap(data, st.st_size);
+        return false;
+    }
+    use_matcher(data, st.st_size, true);
+    return true;
+}
+
+static void write_cached(const void* data, size_t size) {
+    char path[MAX_PATH_LENGTH + 32];
+    cache_file_path(path, sizeof(path));
+    ensure_cache_directory();
+
+    char temp_path[MAX_PATH_LENGTH + 96];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) return;
+
+    bool ok = fwrite(data, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path, path) != 0) unlink(temp_path);
+}
+
+void mime_init(void) {
+    mime_cleanup();
+
+    MimeSource sources[MIME_MAX_SOURCES];
+    char source_key[MD5_HEX_LENGTH];
+    int source_count = find_sources("globs2", sources, source_key);
+    if (source_count == 0) return;
+    if (load_cached(source_key)) return;
+
+    MimeBuilder builder = {0};
+    builder.interned = hashmap_create(2048);
+    builder.removed_types = hashmap_create(64);
+    void* data = NULL;
+    size_t size = 0;
+
+    if (builder.interned && builder.removed_types && buffer_append(&builder.pool, "", 1)) {
+        for (int i = 0; i < source_count; i++) {
+            parse_globs2(&builder, sources[i].path, i);
+        }
+        data = compile_matcher(&builder, source_key, &size);
+    }
+
+    free(builder.globs);
+    free(builder.pool.data);
+    if (builder.interned) hashmap_free(builder.interned, NULL);
+    if (builder.removed_types) hashmap_free(builder.removed_types, NULL);
+
+    if (data) {
+        use_matcher(data, size, false);
+        write_cached(data, size);
+    }
+}
+
+void mime_cleanup(void) {
+    if (mime.mapped) {
+        munmap(mime.data, mime.size);
+    } else {
+        free(mime.data);
+    }
+    memset(&mime, 0, sizeof(mime));
+
+    pthread_mutex_lock(&magic_lock);
+    free(magic.sections.data);
+    free(magic.matchlets.data);
+    free(magic.bytes.data);
+    memset(&magic, 0, sizeof(magic));
+    pthread_mutex_unlock(&magic_lock);
+}
+
+static uint32_t match_literal(const char* name, const char* lowered, bool folded) {
+    uint32_t hash = hash_string(lowered);
+    uint32_t mask = mime.literal_slots - 1;
+    uint32_t best = 0;
+    for (uint32_t index = hash & mask; mime.literals[index].glob; index = (index + 1) & mask) {
+        const MimeLiteralSlot* slot = &mime.literals[index];
+        if (slot->hash != hash) continue;
+
+        const MimeGlob* glob = &mime.globs[slot->glob - 1];
+        const char* pattern = mime.pool + glob->pattern;
+        bool matches = folded ? !(glob->flags & MIME_CASE_SENSITIVE) && strcasecmp(pattern, name) == 0
+                              : strcmp(pattern, name) == 0;
+        if (matches) keep_best(mime.globs, &best, slot->glob);
+    }
+    return best;
+}
+
+// Walk the name backwards; the deepest node with a glob is the longest
+// matching suffix
+static uint32_t match_suffix(const char* name, size_t length, bool folded) {
+    uint32_t node = 0;
+    uint32_t best = 0;
+    for (size_t i = length; i > 0; i--) {
+        unsigned char c = (unsigned char)name[i - 1];
+        uint32_t child = mime.nodes[node].first_child;
+        while (child && mime.nodes[child].character != c) {
+            child = mime.nodes[child].next_sibling;
+        }
+        if (!child) break;
+
+        node = child;
+        uint32_t glob = folded ? mime.nodes[node].folded : mime.nodes[node].any;
+        if (glob) best = glob;
+    }
+    return best;
+}
+
+static uint32_t match_full(const char* name) {
+    uint32_t best = 0;
+    size_t best_length = 0;
+    for (uint32_t i = 0; i < mime.full_count; i++) {
+        const MimeGlob* glob = &mime.globs[mime.full[i]];
+        const char* pattern = mime.pool + glob->pattern;
+        int flags = glob->flags & MIME_CASE_SENSITIVE ? 0 : FNM_CASEFOLD;
+        if (fnmatch(pattern, name, flags) != 0) continue;
+
+        size_t length = strlen(pattern);
+        if (!best || glob->weight > mime.globs[best - 1].weight ||
+            (glob->weight == mime.globs[best - 1].weight && length > best_length)) {
+            best = mime.full[i] + 1;
+            best_length = length;
+        }
+    }
+    return best;
+}
+
+const char* mime_type_for_name(const char* name) {
+    if (!mime.data || !name) return NULL;
+
+    size_t length = strlen(name);
+    char lowered_name[NAME_MAX + 1];
+    const char* lowered = NULL;
+    if (length < sizeof(lowered_name)) {
+        for (size_t i = 0; i <= length; i++) lowered_name[i] = tolower((unsigned char)name[i]);
+        lowered = lowered_name;
+    }
+
+    uint32_t glob = 0;
+    if (lowered) {
+        glob = match_literal(name, lowered, false);
+        if (!glob) glob = match_literal(name, lowered, true);
+    }
+    if (!glob) glob = match_suffix(name, length, false);
+    if (!glob && lowered) glob = match_suffix(lowered, length, true);
+    if (!glob) glob = match_full(name);
+
+    return glob ? mime.pool + mime.globs[glob - 1].type : NULL;
+}
+
+static bool parse_number(const unsigned char** p, const unsigned char* end, uint32_t* value) {
+    if (*p >= end || !isdigit(**p)) return false;
+    uint32_t number = 0;
+    while (*p < end && isdigit(**p)) number = number * 10 + (*(*p)++ - '0');
+    *value = number;
+    return true;
+}
+
+// Values are stored big-endian; ~2 and ~4 mean host byte order words
+static void swap_words(unsigned char* data, uint32_t length, uint32_t word_size) {
+    const uint16_t probe = 1;
+    if (*(const unsigned char*)&probe != 1 || (word_size != 2 && word_size != 4)) return;
+    for (uint32_t i = 0; i + word_size <= length; i += word_size) {
+        for (uint32_t j = 0; j < word_size / 2; j++) {
+            unsigned char c = data[i + j];
+            data[i + j] = data[i + word_size - 1 - j];
+            data[i + word_size - 1 - j] = c;
+        }
+    }
+}
+
+static bool parse_matchlet(const unsigned char** cursor, const unsigned char* end, MagicMatchlet* matchlet) {
+    const unsigned char* p = *cursor;
+    uint32_t indent = 0;
+    if (p < end && isdigit(*p)) parse_number(&p, end, &indent);
+    if (p >= end || *p++ != '>' || !parse_number(&p, end, &matchlet->offset)) return false;
+    if (p + 3 > end || *p++ != '=') return false;
+
+    uint32_t length = (uint32_t)p[0] << 8 | p[1];
+    p += 2;
+    if (length == 0 || (size_t)(end - p) < length) return false;
+
+    matchlet->indent = (int)indent;
+    matchlet->value_length = length;
+    matchlet->value = (uint32_t)magic.bytes.size;
+    if (!buffer_append(&magic.bytes, p, length)) return false;
+    p += length;
+
+    matchlet->mask = 0;
+    if (p < end && *p == '&') {
+        if ((size_t)(end - ++p) < length) return false;
+        matchlet->mask = (uint32_t)magic.bytes.size;
+        if (!buffer_append(&magic.bytes, p, length)) return false;
+        p += length;
+    }
+
+    uint32_t word_size = 1;
+    matchlet->range = 1;
+    if (p < end && *p == '~') {
+        p++;
+        if (!parse_number(&p, end, &word_size)) return false;
+    }
+    if (p < end && *p == '+') {
+        p++;
+        if (!parse_number(&p, end, &matchlet->range) || matchlet->range == 0) return false;
+    }
+    if (p >= end || *p != '\n') return false;
+
+    swap_words((unsigned char*)magic.bytes.data + matchlet->value, length, word_size);
+    if (matchlet->mask) swap_words((unsigned char*)magic.bytes.data + matchlet->mask, length, word_size);
+    *cursor = p + 1;
+    return true;
+}
+
+static void parse_magic(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 12) {
+        mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) return;
+
+    const unsigned char* p = mapped;
+    const unsigned char* end = p + st.st_size;
+    if (memcmp(p, "MIME-Magic\0\n", 12) != 0) {
+        munmap(mapped, st.st_size);
+        return;
+    }
+    p += 12;
+
+    int section = -1;
+    while (p < end) {
+        if (*p == '[') {
+            const unsigned char* close = memchr(p, ']', end - p);
+            const unsigned char* colon = memchr(p, ':', end - p);
+            section = -1;
+            if (close && colon && colon < close && close + 1 < end && close[1] == '\n') {
+                MagicSection added = { atoi((const char*)p + 1), (uint32_t)magic.bytes.size,
+                                       (int)(magic.matchlets.size / sizeof(MagicMatchlet)), 0 };
+                const char terminator = '\0';
+                if (buffer_append(&magic.bytes, colon + 1, close - colon - 1) &&
+                    buffer_append(&magic.bytes, &terminator, 1) &&
+                    buffer_append(&magic.sections, &added, sizeof(added))) {
+                    section = (int)(magic.sections.size / sizeof(MagicSection)) - 1;
+                }
+                p = close + 2;
+                continue;
+            }
+        }
+
+        MagicMatchlet matchlet;
+        if (section >= 0 && parse_matchlet(&p, end, &matchlet)) {
+            if (buffer_append(&magic.matchlets, &matchlet, sizeof(matchlet))) {
+                ((MagicSection*)magic.sections.data)[section].count++;
+            }
+            continue;
+        }
+
+        // Unknown or malformed line: drop the section rather than guess
+        section = -1;
+        const unsigned char* newline = memchr(p, '\n', end - p);
+        p = newline ? newline + 1 : end;
+    }
+
+    munmap(mapped, st.st_size);
+}
+
+static void load_magic(void) {
+    MimeSource sources[MIME_MAX_SOURCES];
+    char key[MD5_HEX_LENGTH];
+    int count = find_sources("magic", sources, key);
+    for (int i = 0; i < count; i++) {
+        parse_magic(sources[i].path);
+    }
+    magic.loaded = true;
+}
+
+static bool matchlet_test(const MagicMatchlet* matchlet, const unsigned char* data, size_t length) {
+    const unsigned char* value = (const unsigned char*)magic.bytes.data + matchlet->value;
+    const unsigned char* mask = matchlet->mask ? (const unsigned char*)magic.bytes.data + matchlet->mask : NULL;
+
+    for (uint32_t i = 0; i < matchlet->range; i++) {
+        size_t start = (size_t)matchlet->offset + i;
+        if (start + matchlet->value_length > length) return false;
+
+        const unsigned char* p = data + start;
+        uint32_t j = 0;
+        if (mask) {
+            while (j < matchlet->value_length && (p[j] & mask[j]) == (value[j] & mask[j])) j++;
+        } else {
+            while (j < matchlet->value_length && p[j] == value[j]) j++;
+        }
+        if (j == matchlet->value_length) return true;
+    }
+    return false;
+}
+
+static int subtree_end(const MagicMatchlet* matchlets, int index, int end) {
+    int next = index + 1;
+    while (next < end && matchlets[next].indent > matchlets[index].indent) next++;
+    return next;
+}
+
+// A matchlet matches when its test passes and, if it has children, one
+// of them matches too
+static bool matchlet_matches(const MagicMatchlet* matchlets, int index, int end,
+                             const unsigned char* data, size_t length) {
+    if (!matchlet_test(&matchlets[index], data, length)) return false;
+
+    int stop = subtree_end(matchlets, index, end);
+    if (index + 1 == stop) return true;
+    for (int child = index + 1; child < stop; child = subtree_end(matchlets, child, stop)) {
+        if (matchlet_matches(matchlets, child, stop, data, length)) return true;
+    }
+    return false;
+}
+
+const char* mime_type_for_data(const unsigned char* data, size_t length) {
+    pthread_mutex_lock(&magic_lock);
+    if (!magic.loaded) load_magic();
+    pthread_mutex_unlock(&magic_lock);
+
+    const MagicSection* sections = (const MagicSection*)magic.sections.data;
+    const MagicMatchlet* matchlets = (const MagicMatchlet*)magic.matchlets.data;
+    int section_count = (int)(magic.sections.size / sizeof(MagicSection));
+    const MagicSection* best = NULL;
+
+    for (int s = 0; s < section_count; s++) {
+        const MagicSection* section = &sections[s];
+        if (best && section->priority <= best->priority) continue;
+
+        int end = section->first + section->count;
+        for (int m = section->first; m < end; m = subtree_end(matchlets, m, end)) {
+            if (matchlet_matches(matchlets, m, end, data, length)) {
+                best = section;
+                break;
+            }
+        }
+    }
+
+    return best ? magic.bytes.data + best->type : NULL;
+}
+
+void mime_magic_key(char key[MD5_HEX_LENGTH]) {
+    MimeSource sources[MIME_MAX_SOURCES];
+    find_sources("magic", sources, key);
+}
@@ -0,0 +1,29 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stddef.h>
+#include "md5.h"
+
+// File name to MIME type matching from shared-mime-info's globs2 files,
+// in XDG data directory order. The globs are compiled into a literal-name
+// hash, a reversed suffix trie and a short list of full globs, and the
+// compiled form is cached in the state directory until any globs2 file
+// changes. Matching follows xdgmime: literal names, then the longest
+// suffix, then the heaviest full glob, each tried case-sensitively
+// before falling back to the lowercased name.
+
+void mime_init(void);
+void mime_cleanup(void);
+
+// NULL when no glob matches or no database is installed
+const char* mime_type_for_name(const char* name);
+
+// Content matching with the magic files, loaded on first use. Returns the
+// type of the highest priority rule that matches `data`, or NULL.
+const char* mime_type_for_data(const unsigned char* data, size_t length);
+
+// Changes whenever any magic file does, so results derived from them can
+// be cached under it
+void mime_magic_key(char key[MD5_HEX_LENGTH]);
+
+#endif
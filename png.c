@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "png.h"
+
+static const unsigned char png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static uint32_t read_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void write_be32(unsigned char* p, uint32_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+uint32_t png_crc32(uint32_t crc, const unsigned char* data, size_t len) {
+    static uint32_t table[256];
+    static int table_ready = 0;
+
+    if (!table_ready) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        table_ready = 1;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Read tEXt chunks without loading the image data; IDAT chunks are skipped
+// with fseek so this stays cheap even for large thumbnails.
+bool png_read_text(const char* path, PngTextField* fields, int count) {
+    for (int i = 0; i < count; i++) {
+        fields[i].found = false;
+        fields[i].value[0] = '\0';
+    }
+
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return false;
+
+    unsigned char header[8];
+    if (fread(header, 1, 8, fp) != 8 || memcmp(header, png_signature, 8) != 0) {
+        fclose(fp);
+        return false;
+    }
+
+    int remaining = count;
+    while (remaining > 0 && fread(header, 1, 8, fp) == 8) {
+        uint32_t length = read_be32(header);
+
+        if (memcmp(header + 4, "IEND", 4) == 0) break;
+
+        if (memcmp(header + 4, "tEXt", 4) != 0 || length >= PNG_TEXT_VALUE_MAX * 2) {
+            if (fseek(fp, (long)length + 4, SEEK_CUR) != 0) break;
+            continue;
+        }
+
+        char* data = malloc(length + 1);
+        if (!data || fread(data, 1, length, fp) != length || fseek(fp, 4, SEEK_CUR) != 0) {
+            free(data);
+            break;
+        }
+        data[length] = '\0';
+
+        size_t key_len = strlen(data);
+        if (key_len < length) {
+            const char* text = data + key_len + 1;
+            size_t text_len = length - key_len - 1;
+            for (int i = 0; i < count; i++) {
+                if (!fields[i].found && strcmp(fields[i].key, data) == 0 && text_len < PNG_TEXT_VALUE_MAX) {
+                    memcpy(fields[i].value, text, text_len);
+                    fields[i].value[text_len] = '\0';
+                    fields[i].found = true;
+                    remaining--;
+                }
+            }
+        }
+        free(data);
+    }
+
+    fclose(fp);
+    return true;
+}
+
+// Rewrite a PNG in place with extra tEXt chunks right after IHDR
+bool png_write_text(const char* path, const PngTextField* fields, int count) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return false;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    // Signature plus a complete IHDR chunk
+    if (size < 33) {
+        fclose(fp);
+        return false;
+    }
+
+    unsigned char* data = malloc(size);
+    if (!data || fread(data, 1, size, fp) != (size_t)size) {
+        free(data);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    if (memcmp(data, png_signature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0) {
+        free(data);
+        return false;
+    }
+    size_t ihdr_end = 8 + 12 + read_be32(data + 8);
+    if (ihdr_end > (size_t)size) {
+        free(data);
+        return false;
+    }
+
+    fp = fopen(path, "wb");
+    if (!fp) {
+        free(data);
+        return false;
+    }
+
+    bool ok = fwrite(data, 1, ihdr_end, fp) == ihdr_end;
+    for (int i = 0; ok && i < count; i++) {
+        size_t key_len = strlen(fields[i].key);
+        size_t value_len = strlen(fields[i].value);
+        size_t chunk_len = key_len + 1 + value_len;
+
+        unsigned char* chunk = malloc(chunk_len + 12);
+        if (!chunk) {
+            ok = false;
+            break;
+        }
+        write_be32(chunk, (uint32_t)chunk_len);
+        memcpy(chunk + 4, "tEXt", 4);
+        memcpy(chunk + 8, fields[i].key, key_len + 1);
+        memcpy(chunk + 8 + key_len + 1, fields[i].value, value_len);
+        write_be32(chunk + 8 + chunk_len, png_crc32(0, chunk + 4, chunk_len + 4));
+
+        ok = fwrite(chunk, 1, chunk_len + 12, fp) == chunk_len + 12;
+        free(chunk);
+    }
+    if (ok) {
+        ok = fwrite(data + ihdr_end, 1, (size_t)size - ihdr_end, fp) == (size_t)size - ihdr_end;
+    }
+
+    free(data);
+    if (fclose(fp) != 0) ok = false;
+    return ok;
+}
+
+// True if the file is a PNG whose last chunk is a complete IEND
+bool png_is_complete(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return false;
+
+    unsigned char header[8];
+    unsigned char trailer[12];
+    static const unsigned char iend[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 };
+
+    bool ok = fread(header, 1, 8, fp) == 8 && memcmp(header, png_signature, 8) == 0 &&
+              fseek(fp, -12, SEEK_END) == 0 && fread(trailer, 1, 12, fp) == 12 &&
+              memcmp(trailer, iend, 12) == 0;
+
+    fclose(fp);
+    return ok;
+}
+
+static bool write_chunk(FILE* fp, const char* type, const unsigned char* data, size_t length) {
+    unsigned char header[8];
+    write_be32(header, (uint32_t)length);
+    memcpy(header + 4, type, 4);
+
+    uint32_t crc = png_crc32(0, header + 4, 4);
+    crc = png_crc32(crc, data, length);
+    unsigned char trailer[4];
+    write_be32(trailer, crc);
+
+    return fwrite(header, 1, 8, fp) == 8 &&
+           (length == 0 || fwrite(data, 1, length, fp) == length) &&
+           fwrite(trailer, 1, 4, fp) == 4;
+}
+
+// Encode straight-alpha 8-bit RGBA pixels as a PNG with no row filtering
+bool png_write_rgba(const char* path, const unsigned char* pixels, int width, int height) {
+    size_t row_bytes = (size_t)width * 4;
+    size_t raw_length = (row_bytes + 1) * height;
+    unsigned char* raw = malloc(raw_length);
+    uLongf packed_length = compressBound(raw_length);
+    unsigned char* packed = malloc(packed_length);
+    if (!raw || !packed) {
+        free(raw);
+        free(packed);
+        return false;
+    }
+
+    for (int y = 0; y < height; y++) {
+        raw[y * (row_bytes + 1)] = 0;
+        memcpy(raw + y * (row_bytes + 1) + 1, pixels + y * row_bytes, row_bytes);
+    }
+
+    bool ok = compress2(packed, &packed_length, raw, raw_length, 6) == Z_OK;
+    free(raw);
+
+    unsigned char ihdr[13];
+    write_be32(ihdr, (uint32_t)width);
+    write_be32(ihdr + 4, (uint32_t)height);
+    ihdr[8] = 8;  // bit depth
+    ihdr[9] = 6;  // RGBA
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    FILE* fp = ok ? fopen(path, "wb") : NULL;
+    if (!fp) {
+        free(packed);
+        return false;
+    }
+
+    ok = fwrite(png_signature, 1, 8, fp) == 8 &&
+         write_chunk(fp, "IHDR", ihdr, sizeof(ihdr)) &&
+         write_chunk(fp, "IDAT", packed, packed_length) &&
+         write_chunk(fp, "IEND", NULL, 0);
+    free(packed);
+
+    if (fclose(fp) != 0) ok = false;
+    return ok;
+}
+
+static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+static bool unfilter(unsigned char* data, size_t stride, int height, int bpp) {
+    unsigned char* previous = NULL;
+    for (int y = 0; y < height; y++) {
+        unsigned char* row = data + y * (stride + 1);
+        int filter = row[0];
+        row++;
+
+        for (size_t x = 0; x < stride; x++) {
+            int a = x >= (size_t)bpp ? row[x - bpp] : 0;
+            int b = previous ? previous[x] : 0;
+            int c = previous && x >= (size_t)bpp ? previous[x - bpp] : 0;
+            switch (filter) {
+                case 0: break;
+                case 1: row[x] += a; break;
+                case 2: row[x] += b; break;
+                case 3: row[x] += (a + b) / 2; break;
+                case 4: row[x] += paeth(a, b, c); break;
+                default: return false;
+            }
+        }
+        previous = row;
+    }
+    return true;
+}
+
+// Sample `depth` bits of pixel component `index` from an unfiltered row
+static int read_sample(const unsigned char* row, size_t index, int depth) {
+    switch (depth) {
+        case 16: return row[index * 2];
+        case 8: return row[index];
+        default: {
+            size_t bit = index * depth;
+            int shift = 8 - depth - (int)(bit & 7);
+            return (row[bit >> 3] >> shift) & ((1 << depth) - 1);
+        }
+    }
+}
+
+// Decode a non-interlaced PNG of any colour type into straight-alpha RGBA8
+unsigned char* png_read_rgba(const char* path, int* width_out, int* height_out) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    unsigned char header[8];
+    if (fread(header, 1, 8, fp) != 8 || memcmp(header, png_signature, 8) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    uint32_t width = 0, height = 0;
+    int depth = 0, color_type = -1, interlace = 0;
+    unsigned char palette[256][4];
+    int palette_size = 0;
+    int transparent_gray = -1;
+    unsigned char* compressed = NULL;
+    size_t compressed_length = 0;
+    bool ok = false;
+
+    for (int i = 0; i < 256; i++) palette[i][3] = 255;
+
+    while (fread(header, 1, 8, fp) == 8) {
+        uint32_t length = read_be32(header);
+        if (length > 0x7fffffff) break;
+
+        if (memcmp(header + 4, "IEND", 4) == 0) {
+            ok = width > 0 && compressed_length > 0;
+            break;
+        }
+
+        unsigned char* data = malloc(length ? length : 1);
+        if (!data || fread(data, 1, length, fp) != length || fseek(fp, 4, SEEK_CUR) != 0) {
+            free(data);
+            break;
+        }
+
+        if (memcmp(header + 4, "IHDR", 4) == 0 && length >= 13) {
+            width = read_be32(data);
+            height = read_be32(data + 4);
+            depth = data[8];
+            color_type = data[9];
+            interlace = data[12];
+        } else if (memcmp(header + 4, "PLTE", 4) == 0) {
+            palette_size = length / 3 > 256 ? 256 : length / 3;
+            for (int i = 0; i < palette_size; i++) {
+                memcpy(palette[i], data + i * 3, 3);
+            }
+        } else if (memcmp(header + 4, "tRNS", 4) == 0) {
+            if (color_type == 3) {
+                for (uint32_t i = 0; i < length && i < 256; i++) palette[i][3] = data[i];
+            } else if (color_type == 0 && length >= 2) {
+                transparent_gray = (data[0] << 8 | data[1]) >> (depth == 16 ? 8 : 0);
+            }
+        } else if (memcmp(header + 4, "IDAT", 4) == 0) {
+            unsigned char* tmp = realloc(compressed, compressed_length + length);
+            if (!tmp) {
+                free(data);
+                break;
+            }
+            compressed = tmp;
+            memcpy(compressed + compressed_length, data, length);
+            compressed_length += length;
+        }
+        free(data);
+    }
+    fclose(fp);
+
+    int channels = color_type == 0 ? 1 : color_type == 2 ? 3 : color_type == 3 ? 1 :
+                   color_type == 4 ? 2 : color_type == 6 ? 4 : 0;
+    if (!ok || interlace != 0 || channels == 0 || width > 16384 || height > 16384 ||
+        (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)) {
+        free(compressed);
+        return NULL;
+    }
+
+    int bits_per_pixel = channels * depth;
+    size_t stride = ((size_t)width * bits_per_pixel + 7) / 8;
+    uLongf raw_length = (stride + 1) * height;
+    unsigned char* raw = malloc(raw_length);
+    unsigned char* pixels = malloc((size_t)width * height * 4);
+
+    ok = raw && pixels &&
+         uncompress(raw, &raw_length, compressed, compressed_length) == Z_OK &&
+         raw_length == (stride + 1) * height &&
+         unfilter(raw, stride, height, bits_per_pixel >= 8 ? bits_per_pixel / 8 : 1);
+    free(compressed);
+
+    if (!ok) {
+        free(raw);
+        free(pixels);
+        return NULL;
+    }
+
+    // Scale sub-byte gray to 0-255; palette indices are used as is
+    int gray_scale = color_type == 0 && depth < 8 ? 255 / ((1 << depth) - 1) : 1;
+
+    for (uint32_t y = 0; y < height; y++) {
+        const unsigned char* row = raw + y * (stride + 1) + 1;
+        unsigned char* out = pixels + (size_t)y * width * 4;
+
+        for (uint32_t x = 0; x < width; x++, out += 4) {
+            size_t index = (size_t)x * channels;
+            switch (color_type) {
+                case 0: {
+                    int gray = read_sample(row, index, depth);
+                    out[0] = out[1] = out[2] = (unsigned char)(gray * gray_scale);
+                    out[3] = gray == transparent_gray ? 0 : 255;
+                    break;
+                }
+                case 3: {
+                    int entry = read_sample(row, index, depth);
+                    memcpy(out, entry < palette_size ? palette[entry] : palette[0], 4);
+                    break;
+                }
+                case 4:
+                    out[0] = out[1] = out[2] = (unsigned char)read_sample(row, index, depth);
+                    out[3] = (unsigned char)read_sample(row, index + 1, depth);
+                    break;
+                default:
+                    out[0] = (unsigned char)read_sample(row, index, depth);
+                    out[1] = (unsigned char)read_sample(row, index + 1, depth);
+                    out[2] = (unsigned char)read_sample(row, index + 2, depth);
+                    out[3] = channels == 4 ? (unsigned char)read_sample(row, index + 3, depth) : 255;
+                    break;
+            }
+        }
+    }
+
+    free(raw);
+    *width_out = (int)width;
+    *height_out = (int)height;
+    return pixels;
+}
+
+// Box-filter an RGBA image into the middle of a box on a larger canvas,
+// keeping its aspect ratio
+void png_blit_scaled(unsigned char* canvas, int canvas_width, int box_x, int box_y, int box_width, int box_height,
+                     const unsigned char* icon, int width, int height) {
+    double scale_x = (double)box_width / width;
+    double scale_y = (double)box_height / height;
+    double scale = scale_x < scale_y ? scale_x : scale_y;
+    int scaled_width = (int)(width * scale + 0.5);
+    int scaled_height = (int)(height * scale + 0.5);
+    int offset_x = box_x + (box_width - scaled_width) / 2;
+    int offset_y = box_y + (box_height - scaled_height) / 2;
+
+    for (int dy = 0; dy < scaled_height; dy++) {
+        int sy0 = (int)(dy / scale);
+        int sy1 = (int)((dy + 1) / scale);
+        if (sy1 <= sy0) sy1 = sy0 + 1;
+        if (sy1 > height) sy1 = height;
+
+        for (int dx = 0; dx < scaled_width; dx++) {
+            int sx0 = (int)(dx / scale);
+            int sx1 = (int)((dx + 1) / scale);
+            if (sx1 <= sx0) sx1 = sx0 + 1;
+            if (sx1 > width) sx1 = width;
+
+            // Average premultiplied so transparent pixels don't darken edges
+            unsigned long sum[4] = {0, 0, 0, 0};
+            int samples = 0;
+            for (int sy = sy0; sy < sy1; sy++) {
+                for (int sx = sx0; sx < sx1; sx++) {
+                    const unsigned char* p = icon + ((size_t)sy * width + sx) * 4;
+                    sum[0] += p[0] * p[3];
+                    sum[1] += p[1] * p[3];
+                    sum[2] += p[2] * p[3];
+                    sum[3] += p[3];
+                    samples++;
+                }
+            }
+            if (samples == 0 || sum[3] == 0) continue;
+
+            unsigned char* out = canvas + ((size_t)(offset_y + dy) * canvas_width + offset_x + dx) * 4;
+            out[0] = (unsigned char)(sum[0] / sum[3]);
+            out[1] = (unsigned char)(sum[1] / sum[3]);
+            out[2] = (unsigned char)(sum[2] / sum[3]);
+            out[3] = (unsigned char)(sum[3] / samples);
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PNG_TEXT_VALUE_MAX 4096
+
+typedef struct {
+    const char* key;
+    char value[PNG_TEXT_VALUE_MAX];
+    bool found;
+} PngTextField;
+
+uint32_t png_crc32(uint32_t crc, const unsigned char* data, size_t len);
+bool png_read_text(const char* path, PngTextField* fields, int count);
+bool png_write_text(const char* path, const PngTextField* fields, int count);
+bool png_is_complete(const char* path);
+bool png_write_rgba(const char* path, const unsigned char* pixels, int width, int height);
+unsigned char* png_read_rgba(const char* path, int* width, int* height);
+void png_blit_scaled(unsigned char* canvas, int canvas_width, int box_x, int box_y, int box_width, int box_height,
+                     const unsigned char* icon, int width, int height);
+
+#endif
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "config.h"
+#include "profile.h"
+
+#define PROFILE_MAX_DEPTH 16
+
+typedef struct {
+    ProfilePhase phase;
+    long long wall_start;
+    long long cpu_start;
+} ProfileSpan;
+
+bool profile_enabled = false;
+
+static const char* phase_names[PROFILE_PHASE_COUNT] = {
+    [PROFILE_TERMINAL] = "terminal",
+    [PROFILE_THEME] = "theme",
+    [PROFILE_LSD_CONFIG] = "lsd config",
+    [PROFILE_ENUMERATION] = "enumeration",
+    [PROFILE_RESOLUTION] = "resolution",
+    [PROFILE_CACHE_FILL] = "cache fill",
+    [PROFILE_ENCODING] = "encoding",
+    [PROFILE_OUTPUT] = "output",
+};
+
+// Nanoseconds, updated atomically since phases also run on worker threads
+static long long phase_wall[PROFILE_PHASE_COUNT];
+static long long phase_cpu[PROFILE_PHASE_COUNT];
+static long long counters[PROFILE_COUNTER_COUNT];
+static long long bytes_written = 0;
+static long long start_time = 0;
+
+static __thread ProfileSpan span_stack[PROFILE_MAX_DEPTH];
+static __thread int span_depth = 0;
+
+static long long clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static ssize_t counting_write(void* cookie, const char* data, size_t size) {
+    (void)cookie;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(STDOUT_FILENO, data + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+    __atomic_fetch_add(&bytes_written, (long long)done, __ATOMIC_RELAXED);
+    return done > 0 || size == 0 ? (ssize_t)done : -1;
+}
+
+void profile_start(void) {
+    profile_enabled = true;
+    start_time = clock_ns(CLOCK_MONOTONIC);
+
+    fflush(stdout);
+    cookie_io_functions_t functions = { .write = counting_write };
+    FILE* counted = fopencookie(NULL, "w", functions);
+    if (counted) {
+        setvbuf(counted, NULL, _IOFBF, OUTPUT_CHUNK_SIZE);
+        stdout = counted;
+    }
+}
+
+static void charge(const ProfileSpan* span, long long wall, long long cpu) {
+    __atomic_fetch_add(&phase_wall[span->phase], wall - span->wall_start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phase_cpu[span->phase], cpu - span->cpu_start, __ATOMIC_RELAXED);
+}
+
+void profile_begin(ProfilePhase phase) {
+    if (!profile_enabled || span_depth >= PROFILE_MAX_DEPTH) return;
+
+    long long wall = clock_ns(CLOCK_MONOTONIC);
+    long long cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (span_depth > 0) charge(&span_stack[span_depth - 1], wall, cpu);
+
+    span_stack[span_depth].phase = phase;
+    span_stack[span_depth].wall_start = wall;
+    span_stack[span_depth].cpu_start = cpu;
+    span_depth++;
+}
+
+void profile_end(ProfilePhase phase) {
+    if (!profile_enabled || span_depth == 0 || span_stack[span_depth - 1].phase != phase) return;
+
+    long long wall = clock_ns(CLOCK_MONOTONIC);
+    long long cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    charge(&span_stack[--span_depth], wall, cpu);
+
+    // The enclosing phase resumes from here
+    if (span_depth > 0) {
+        span_stack[span_depth - 1].wall_start = wall;
+        span_stack[span_depth - 1].cpu_start = cpu;
+    }
+}
+
+void profile_add(ProfileCounter counter, long long count) {
+    __atomic_fetch_add(&counters[counter], count, __ATOMIC_RELAXED);
+}
+
+void profile_report(const char* protocol) {
+    if (!profile_enabled) return;
+    fflush(stdout);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double total_wall = (clock_ns(CLOCK_MONOTONIC) - start_time) / 1e6;
+    double total_cpu = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+                       (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+
+    fprintf(stderr, "ils profile (%s)\n", protocol);
+    fprintf(stderr, "  %-12s %10s %10s\n", "phase", "wall ms", "cpu ms");
+    for (int i = 0; i < PROFILE_PHASE_COUNT; i++) {
+        fprintf(stderr, "  %-12s %10.2f %10.2f\n", phase_names[i], phase_wall[i] / 1e6, phase_cpu[i] / 1e6);
+    }
+    fprintf(stderr, "  %-12s %10.2f %10.2f\n", "total", total_wall, total_cpu);
+
+    fprintf(stderr, "  stats %lld, readdirs %lld, spawns %lld, cache hits %lld, cache misses %lld, sniffed %lld\n",
+            counters[PROFILE_STATS], counters[PROFILE_READDIRS], counters[PROFILE_SPAWNS],
+            counters[PROFILE_CACHE_HITS], counters[PROFILE_CACHE_MISSES], counters[PROFILE_SNIFFED]);
+    fprintf(stderr, "  bytes written %lld (%s), peak rss %ld KiB\n", bytes_written, protocol, usage.ru_maxrss);
+}
@@ -0,0 +1,45 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+
+// `ils --profile` reports wall and CPU time per phase, a few counters and
+// peak RSS to stderr. Phases nest: entering one pauses the enclosing phase
+// on the same thread, so each phase's time is its own. Phases entered on
+// enumeration threads are summed over threads.
+
+typedef enum {
+    PROFILE_TERMINAL,
+    PROFILE_THEME,
+    PROFILE_LSD_CONFIG,
+    PROFILE_ENUMERATION,
+    PROFILE_RESOLUTION,
+    PROFILE_CACHE_FILL,
+    PROFILE_ENCODING,
+    PROFILE_OUTPUT,
+    PROFILE_PHASE_COUNT
+} ProfilePhase;
+
+typedef enum {
+    PROFILE_STATS,
+    PROFILE_READDIRS,
+    PROFILE_SPAWNS,
+    PROFILE_CACHE_HITS,
+    PROFILE_CACHE_MISSES,
+    PROFILE_SNIFFED,
+    PROFILE_COUNTER_COUNT
+} ProfileCounter;
+
+extern bool profile_enabled;
+
+// Enables profiling and routes stdout through a byte counter
+void profile_start(void);
+void profile_begin(ProfilePhase phase);
+void profile_end(ProfilePhase phase);
+void profile_add(ProfileCounter counter, long long count);
+void profile_report(const char* protocol);
+
+#define profile_count(counter, count) \
+    do { if (profile_enabled) profile_add(counter, count); } while (0)
+
+#endif
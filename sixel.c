@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "sixel.h"
+
+#define LEVELS_R 6
+#define LEVELS_G 7
+#define LEVELS_B 6
+#define PALETTE_SIZE (LEVELS_R * LEVELS_G * LEVELS_B)
+#define TRANSPARENT 0xFFFF
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static bool reserve(Buffer* buffer, size_t extra) {
+    if (buffer->length + extra <= buffer->capacity) return true;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + extra) capacity *= 2;
+    char* tmp = realloc(buffer->data, capacity);
+    if (!tmp) return false;
+    buffer->data = tmp;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static bool append(Buffer* buffer, const char* text, size_t length) {
+    if (!reserve(buffer, length)) return false;
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    return true;
+}
+
+static bool append_run(Buffer* buffer, char sixel, int count) {
+    char run[16];
+    int length;
+    if (count > 3) {
+        length = snprintf(run, sizeof(run), "!%d%c", count, sixel);
+    } else {
+        memset(run, sixel, count);
+        length = count;
+    }
+    return append(buffer, run, length);
+}
+
+static unsigned short quantize(const unsigned char* pixel) {
+    if (pixel[3] < 128) return TRANSPARENT;
+
+    int r = (pixel[0] * (LEVELS_R - 1) + 127) / 255;
+    int g = (pixel[1] * (LEVELS_G - 1) + 127) / 255;
+    int b = (pixel[2] * (LEVELS_B - 1) + 127) / 255;
+    return (unsigned short)((r * LEVELS_G + g) * LEVELS_B + b);
+}
+
+char* sixel_encode(const unsigned char* rgba, int width, int height, size_t* length) {
+    unsigned short* indices = malloc((size_t)width * height * sizeof(unsigned short));
+    if (!indices) return NULL;
+
+    bool used[PALETTE_SIZE] = {false};
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        indices[i] = quantize(rgba + i * 4);
+        if (indices[i] != TRANSPARENT) used[indices[i]] = true;
+    }
+
+    Buffer out = {0};
+    char text[64];
+
+    // P2=1 keeps unpainted pixels transparent; 1:1 aspect, exact raster size
+    int text_length = snprintf(text, sizeof(text), "\033P0;1;0q\"1;1;%d;%d", width, height);
+    bool ok = append(&out, text, text_length);
+
+    for (int c = 0; ok && c < PALETTE_SIZE; c++) {
+        if (!used[c]) continue;
+        int r = c / (LEVELS_G * LEVELS_B);
+        int g = (c / LEVELS_B) % LEVELS_G;
+        int b = c % LEVELS_B;
+        text_length = snprintf(text, sizeof(text), "#%d;2;%d;%d;%d", c,
+                               r * 100 / (LEVELS_R - 1), g * 100 / (LEVELS_G - 1), b * 100 / (LEVELS_B - 1));
+        ok = append(&out, text, text_length);
+    }
+
+    // One band is six pixel rows; each colour present in it is one pass
+    unsigned char* bits = malloc(width);
+    ok = ok && bits;
+    for (int band = 0; ok && band < height; band += 6) {
+        bool in_band[PALETTE_SIZE] = {false};
+        for (int y = band; y < band + 6 && y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                unsigned short index = indices[(size_t)y * width + x];
+                if (index != TRANSPARENT) in_band[index] = true;
+            }
+        }
+
+        bool first_pass = true;
+        for (int c = 0; ok && c < PALETTE_SIZE; c++) {
+            if (!in_band[c]) continue;
+
+            memset(bits, 0, width);
+            for (int y = band; y < band + 6 && y < height; y++) {
+                const unsigned short* row = indices + (size_t)y * width;
+                for (int x = 0; x < width; x++) {
+                    if (row[x] == c) bits[x] |= (unsigned char)(1 << (y - band));
+                }
+            }
+
+            text_length = snprintf(text, sizeof(text), "%s#%d", first_pass ? "" : "$", c);
+            ok = append(&out, text, text_length);
+            first_pass = false;
+
+            // Trailing empty columns are simply left out
+            int end = width;
+            while (end > 0 && bits[end - 1] == 0) end--;
+
+            for (int x = 0; ok && x < end;) {
+                int run = 1;
+                while (x + run < end && bits[x + run] == bits[x]) run++;
+                ok = append_run(&out, (char)('?' + bits[x]), run);
+                x += run;
+            }
+        }
+
+        if (ok) ok = append(&out, "-", 1);
+    }
+
+    ok = ok && append(&out, "\033\\", 2);
+    free(bits);
+    free(indices);
+
+    if (!ok) {
+        free(out.data);
+        return NULL;
+    }
+    *length = out.length;
+    return out.data;
+}
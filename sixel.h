@@ -0,0 +1,12 @@
+#ifndef SIXEL_H
+#define SIXEL_H
+
+#include <stddef.h>
+
+// Encodes a straight-alpha RGBA canvas as one DCS sixel sequence. Colours
+// are mapped onto a fixed 6x7x6 cube and only the entries actually used
+// are defined, so one palette serves every icon on the canvas. Pixels with
+// alpha below half are left transparent.
+char* sixel_encode(const unsigned char* rgba, int width, int height, size_t* length);
+
+#endif
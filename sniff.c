@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "hashmap.h"
+#include "md5.h"
+#include "mime.h"
+#include "profile.h"
+#include "trace.h"
+#include "sniff.h"
+
+// Bump when the layout or the built-in signatures change
+#define SNIFF_CACHE_MAGIC "ILSSNIF1"
+#define SNIFF_TYPE_LENGTH 128
+
+// The cache file is this header, the type names (NUL-terminated, in id
+// order) and the records. It is keyed by the magic files it was built
+// from, so updating shared-mime-info starts it over.
+typedef struct {
+    char magic[8];
+    char source_key[MD5_HEX_LENGTH];
+    uint32_t type_bytes;
+    uint32_t record_count;
+} SniffCacheHeader;
+
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t type;      // Type id, 0 when nothing matched
+    uint32_t seen;      // Used during this run; written as 0
+} SniffRecord;
+
+typedef struct {
+    SniffRequest* requests;
+    const int* misses;
+    int miss_count;
+    char (*types)[SNIFF_TYPE_LENGTH];
+    int next;
+} SniffQueue;
+
+static struct {
+    bool loaded;
+    bool dirty;
+    char source_key[MD5_HEX_LENGTH];
+    SniffRecord* records;
+    int count;
+    int capacity;
+    uint32_t* index;        // Record index + 1, open addressing on device and inode
+    uint32_t index_size;
+    char** types;           // Type id - 1 to name
+    int type_count;
+    int type_capacity;
+    HashMap* type_ids;
+} results = {0};
+
+static uint32_t record_hash(uint64_t device, uint64_t inode) {
+    uint64_t hash = device * 0x9E3779B97F4A7C15ULL ^ inode;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+static int find_record(uint64_t device, uint64_t inode) {
+    if (results.index_size == 0) return -1;
+
+    uint32_t mask = results.index_size - 1;
+    for (uint32_t slot = record_hash(device, inode) & mask; results.index[slot]; slot = (slot + 1) & mask) {
+        const SniffRecord* record = &results.records[results.index[slot] - 1];
+        if (record->device == device && record->inode == inode) return (int)results.index[slot] - 1;
+    }
+    return -1;
+}
+
+static bool rebuild_index(uint32_t size) {
+    uint32_t* index = calloc(size, sizeof(uint32_t));
+    if (!index) return false;
+
+    for (int i = 0; i < results.count; i++) {
+        uint32_t slot = record_hash(results.records[i].device, results.records[i].inode) & (size - 1);
+        while (index[slot]) slot = (slot + 1) & (size - 1);
+        index[slot] = (uint32_t)i + 1;
+    }
+    free(results.index);
+    results.index = index;
+    results.index_size = size;
+    return true;
+}
+
+static void put_record(const SniffRequest* request, uint32_t type) {
+    int found = find_record(request->device, request->inode);
+    if (found < 0) {
+        if (results.count == results.capacity) {
+            int capacity = results.capacity ? results.capacity * 2 : 1024;
+            SniffRecord* tmp = realloc(results.records, capacity * sizeof(SniffRecord));
+            if (!tmp) return;
+            results.records = tmp;
+            results.capacity = capacity;
+        }
+        if ((uint32_t)(results.count + 1) * 2 > results.index_size) {
+            uint32_t size = results.index_size ? results.index_size : 2048;
+            while ((uint32_t)(results.count + 1) * 2 > size) size *= 2;
+            if (!rebuild_index(size)) return;
+        }
+
+        found = results.count++;
+        uint32_t mask = results.index_size - 1;
+        uint32_t slot = record_hash(request->device, request->inode) & mask;
+        while (results.index[slot]) slot = (slot + 1) & mask;
+        results.index[slot] = (uint32_t)found + 1;
+    }
+
+    SniffRecord* record = &results.records[found];
+    record->device = request->device;
+    record->inode = request->inode;
+    record->mtime_sec = request->mtime.tv_sec;
+    record->mtime_nsec = request->mtime.tv_nsec;
+    record->size = request->size;
+    record->type = type;
+    record->seen = 1;
+    results.dirty = true;
+}
+
+static uint32_t intern_type(const char* name) {
+    void* known = hashmap_get(results.type_ids, name);
+    if (known) return (uint32_t)(uintptr_t)known;
+
+    if (results.type_count == results.type_capacity) {
+        int capacity = results.type_capacity ? results.type_capacity * 2 : 64;
+        char** tmp = realloc(results.types, capacity * sizeof(char*));
+        if (!tmp) return 0;
+        results.types = tmp;
+        results.type_capacity = capacity;
+    }
+    char* copy = strdup(name);
+    if (!copy) return 0;
+
+    results.types[results.type_count++] = copy;
+    uint32_t id = (uint32_t)results.type_count;
+    hashmap_put(results.type_ids, name, (void*)(uintptr_t)id);
+    return id;
+}
+
+static void cache_file_path(char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/sniff.cache", cache_state_directory());
+}
+
+static void load_results(void) {
+    results.loaded = true;
+    results.type_ids = hashmap_create(256);
+    mime_magic_key(results.source_key);
+    if (!results.type_ids) return;
+
+    char path[MAX_PATH_LENGTH + 32];
+    cache_file_path(path, sizeof(path));
+    FILE* file = fopen(path, "rb");
+    if (!file) return;
+
+    SniffCacheHeader header;
+    char* names = NULL;
+    SniffRecord* records = NULL;
+    uint32_t* type_map = NULL;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, SNIFF_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+              strncmp(header.source_key, results.source_key, sizeof(header.source_key)) == 0 &&
+              header.record_count <= SNIFF_CACHE_MAX_ENTRIES && header.type_bytes <= 1024 * 1024;
+
+    if (ok) {
+        names = malloc(header.type_bytes + 1);
+        records = malloc((header.record_count ? header.record_count : 1) * sizeof(SniffRecord));
+        type_map = calloc(header.type_bytes + 1, sizeof(uint32_t));
+        ok = names && records && type_map &&
+             fread(names, 1, header.type_bytes, file) == header.type_bytes &&
+             fread(records, sizeof(SniffRecord), header.record_count, file) == header.record_count &&
+             fgetc(file) == EOF;
+    }
+
+    // File type ids are positions in the name list; map them to ours
+    uint32_t type_count = 0;
+    if (ok) {
+        names[header.type_bytes] = '\0';
+        for (uint32_t offset = 0; offset < header.type_bytes; offset += strlen(names + offset) + 1) {
+            type_map[++type_count] = intern_type(names + offset);
+        }
+    }
+
+    for (uint32_t i = 0; ok && i < header.record_count; i++) {
+        if (records[i].type > type_count) continue;
+        SniffRequest request = {0};
+        request.device = records[i].device;
+        request.inode = records[i].inode;
+        request.mtime.tv_sec = records[i].mtime_sec;
+        request.mtime.tv_nsec = records[i].mtime_nsec;
+        request.size = records[i].size;
+        put_record(&request, type_map[records[i].type]);
+        results.records[results.count - 1].seen = 0;
+    }
+    results.dirty = false;
+
+    free(names);
+    free(records);
+    free(type_map);
+    fclose(file);
+}
+
+// Everything is rewritten when anything changed. Past the entry limit,
+// only records used during this run are kept.
+static void save_results(void) {
+    if (!results.dirty) return;
+    results.dirty = false;
+
+    bool only_seen = results.count > SNIFF_CACHE_MAX_ENTRIES;
+    SniffCacheHeader header = {0};
+    memcpy(header.magic, SNIFF_CACHE_MAGIC, sizeof(header.magic));
+    memcpy(header.source_key, results.source_key, sizeof(header.source_key));
+    for (int i = 0; i < results.type_count; i++) {
+        header.type_bytes += (uint32_t)strlen(results.types[i]) + 1;
+    }
+    for (int i = 0; i < results.count; i++) {
+        if ((!only_seen || results.records[i].seen) && header.record_count < SNIFF_CACHE_MAX_ENTRIES) {
+            header.record_count++;
+        }
+    }
+
+    char path[MAX_PATH_LENGTH + 32];
+    cache_file_path(path, sizeof(path));
+    ensure_cache_directory();
+
+    char temp_path[MAX_PATH_LENGTH + 96];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) return;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; ok && i < results.type_count; i++) {
+        ok = fwrite(results.types[i], 1, strlen(results.types[i]) + 1, file) == strlen(results.types[i]) + 1;
+    }
+    uint32_t written = 0;
+    for (int i = 0; ok && i < results.count && written < header.record_count; i++) {
+        if (only_seen && !results.records[i].seen) continue;
+        SniffRecord record = results.records[i];
+        record.seen = 0;
+        ok = fwrite(&record, sizeof(record), 1, file) == 1;
+        written++;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path, path) != 0) unlink(temp_path);
+}
+
+static const struct {
+    const char* interpreter;
+    const char* mimetype;
+} interpreters[] = {
+    {"sh", "application/x-shellscript"},
+    {"bash", "application/x-shellscript"},
+    {"dash", "application/x-shellscript"},
+    {"zsh", "application/x-shellscript"},
+    {"ksh", "application/x-shellscript"},
+    {"mksh", "application/x-shellscript"},
+    {"fish", "application/x-shellscript"},
+    {"python", "text/x-python3"},
+    {"perl", "application/x-perl"},
+    {"ruby", "application/x-ruby"},
+    {"node", "application/javascript"},
+    {"nodejs", "application/javascript"},
+    {"php", "application/x-php"},
+    {"lua", "text/x-lua"},
+    {"tclsh", "text/x-tcl"},
+    {"wish", "text/x-tcl"},
+    {"awk", "application/x-awk"},
+    {"gawk", "application/x-awk"},
+    {"make", "text/x-makefile"},
+    {NULL, NULL}
+};
+
+// "#!/usr/bin/env python3.12 -u" names python; version suffixes are dropped
+static const char* shebang_type(const unsigned char* data, size_t length) {
+    char line[SNIFF_TYPE_LENGTH];
+    size_t n = 0;
+    for (size_t i = 2; i < length && data[i] != '\n' && n + 1 < sizeof(line); i++) {
+        line[n++] = (char)data[i];
+    }
+    line[n] = '\0';
+
+    char* save = NULL;
+    char* word = strtok_r(line, " \t\r", &save);
+    const char* name = NULL;
+    while (word) {
+        const char* base = strrchr(word, '/');
+        base = base ? base + 1 : word;
+        if (strcmp(base, "env") == 0 || word[0] == '-' || strchr(word, '=')) {
+            word = strtok_r(NULL, " \t\r", &save);
+            continue;
+        }
+        name = base;
+        break;
+    }
+    if (!name) return "application/x-shellscript";
+
+    size_t stem = strlen(name);
+    while (stem > 0 && (isdigit((unsigned char)name[stem - 1]) || name[stem - 1] == '.')) stem--;
+    for (int i = 0; interpreters[i].interpreter; i++) {
+        if (strlen(interpreters[i].interpreter) == stem && strncmp(name, interpreters[i].interpreter, stem) == 0) {
+            return interpreters[i].mimetype;
+        }
+    }
+    return "application/x-shellscript";
+}
+
+static const char* elf_type(const unsigned char* data, size_t length, mode_t mode) {
+    if (length < 18) return "application/x-executable";
+    unsigned type = data[5] == 2 ? (unsigned)data[16] << 8 | data[17] : (unsigned)data[17] << 8 | data[16];
+    switch (type) {
+        case 1: return "application/x-object";
+        case 3: return mode & S_IXUSR ? "application/x-executable" : "application/x-sharedlib";
+        case 4: return "application/x-core";
+        default: return "application/x-executable";
+    }
+}
+
+// OpenDocument and friends store their type uncompressed as the first entry
+static bool zip_mimetype(const unsigned char* data, size_t length, char* type) {
+    if (length < 38 || memcmp(data + 30, "mimetype", 8) != 0 || data[8] != 0) return false;
+
+    size_t size = data[18] | (size_t)data[19] << 8;
+    if (size == 0 || size >= SNIFF_TYPE_LENGTH || 38 + size > length) return false;
+    for (size_t i = 0; i < size; i++) {
+        unsigned char c = data[38 + i];
+        if (!isalnum(c) && !strchr("./+-", c)) return false;
+    }
+    memcpy(type, data + 38, size);
+    type[size] = '\0';
+    return true;
+}
+
+static bool looks_like_text(const unsigned char* data, size_t length) {
+    size_t control = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == 0) return false;
+        if (data[i] < 0x20 && !strchr("\t\n\r\f\b\033", data[i])) control++;
+    }
+    return control * 20 < length;
+}
+
+static void detect_type(const unsigned char* data, size_t length, mode_t mode, char* type) {
+    const char* found = NULL;
+    type[0] = '\0';
+
+    if (length >= 2 && data[0] == '#' && data[1] == '!') {
+        found = shebang_type(data, length);
+    } else if (length >= 4 && memcmp(data, "\177ELF", 4) == 0) {
+        found = elf_type(data, length, mode);
+    } else if (length >= 4 && memcmp(data, "PK\003\004", 4) == 0) {
+        if (zip_mimetype(data, length, type)) return;
+        found = "application/zip";
+    } else if (length >= 2 && data[0] == 0x1F && data[1] == 0x8B) {
+        found = "application/gzip";
+    } else if (length >= 5 && memcmp(data, "%PDF-", 5) == 0) {
+        found = "application/pdf";
+    } else if (length >= 8 && memcmp(data, "\211PNG\r\n\032\n", 8) == 0) {
+        found = "image/png";
+    } else if (length >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) {
+        found = "image/jpeg";
+    } else if (length >= 2 && data[0] == 'M' && data[1] == 'Z') {
+        found = "application/x-ms-dos-executable";
+    } else {
+        found = mime_type_for_data(data, length);
+        if (!found && looks_like_text(data, length)) found = "text/plain";
+    }
+
+    if (found) snprintf(type, SNIFF_TYPE_LENGTH, "%s", found);
+}
+
+static void* sniff_worker(void* arg) {
+    SniffQueue* queue = arg;
+    unsigned char buffer[SNIFF_READ_BYTES];
+
+    for (;;) {
+        int first = __atomic_fetch_add(&queue->next, SNIFF_BATCH_SIZE, __ATOMIC_RELAXED);
+        if (first >= queue->miss_count) return NULL;
+        int last = first + SNIFF_BATCH_SIZE < queue->miss_count ? first + SNIFF_BATCH_SIZE : queue->miss_count;
+
+        long long start = trace_now();
+        for (int i = first; i < last; i++) {
+            const SniffRequest* request = &queue->requests[queue->misses[i]];
+            int fd = open(request->path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+            if (fd < 0) continue;
+
+            ssize_t length = pread(fd, buffer, sizeof(buffer), 0);
+            close(fd);
+            profile_count(PROFILE_SNIFFED, 1);
+            if (length > 0) detect_type(buffer, (size_t)length, request->mode, queue->types[i]);
+        }
+        trace_span("sniff", "read batch", NULL, start);
+    }
+}
+
+void sniff_files(SniffRequest* requests, int count) {
+    if (!results.loaded) load_results();
+
+    int* misses = malloc((count ? count : 1) * sizeof(int));
+    if (!misses) return;
+
+    int miss_count = 0;
+    for (int i = 0; i < count; i++) {
+        requests[i].mimetype = NULL;
+        int found = find_record(requests[i].device, requests[i].inode);
+        SniffRecord* record = found >= 0 ? &results.records[found] : NULL;
+        if (record && record->mtime_sec == requests[i].mtime.tv_sec &&
+            record->mtime_nsec == requests[i].mtime.tv_nsec && record->size == requests[i].size) {
+            record->seen = 1;
+            if (record->type) requests[i].mimetype = results.types[record->type - 1];
+        } else {
+            misses[miss_count++] = i;
+        }
+    }
+
+    char (*types)[SNIFF_TYPE_LENGTH] = miss_count ? calloc(miss_count, SNIFF_TYPE_LENGTH) : NULL;
+    if (types) {
+        SniffQueue queue = { requests, misses, miss_count, types, 0 };
+        int batches = (miss_count + SNIFF_BATCH_SIZE - 1) / SNIFF_BATCH_SIZE;
+        int thread_count = batches < MAX_ENUMERATION_THREADS ? batches : MAX_ENUMERATION_THREADS;
+        pthread_t threads[MAX_ENUMERATION_THREADS];
+        int started = 0;
+
+        for (int i = 1; i < thread_count; i++) {
+            if (pthread_create(&threads[started], NULL, sniff_worker, &queue) != 0) break;
+            started++;
+        }
+        sniff_worker(&queue);
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        for (int i = 0; i < miss_count; i++) {
+            SniffRequest* request = &requests[misses[i]];
+            uint32_t type = types[i][0] ? intern_type(types[i]) : 0;
+            put_record(request, type);
+            if (type) request->mimetype = results.types[type - 1];
+        }
+        free(types);
+    }
+
+    free(misses);
+    save_results();
+}
+
+void sniff_cleanup(void) {
+    for (int i = 0; i < results.type_count; i++) {
+        free(results.types[i]);
+    }
+    free(results.types);
+    free(results.records);
+    free(results.index);
+    if (results.type_ids) hashmap_free(results.type_ids, NULL);
+    memset(&results, 0, sizeof(results));
+}
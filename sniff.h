@@ -0,0 +1,26 @@
+#ifndef SNIFF_H
+#define SNIFF_H
+
+#include <sys/types.h>
+#include <time.h>
+
+// `ils --sniff` types files whose names say nothing by their first
+// SNIFF_READ_BYTES bytes: shebang lines, common binary signatures and
+// shared-mime-info magic. Files are read in batches spread over worker
+// threads. Results are kept in the state directory per device, inode,
+// mtime and size, so unchanged files are never read twice.
+
+typedef struct {
+    const char* path;
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    mode_t mode;
+    const char* mimetype;   // Set by sniff_files; NULL when nothing matched
+} SniffRequest;
+
+void sniff_files(SniffRequest* requests, int count);
+void sniff_cleanup(void);
+
+#endif
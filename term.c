@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "md5.h"
+#include "term.h"
+
+#define DA1_QUERY "\033[c"
+
+// A 1x1 RGB image the terminal is asked to validate but not store, and the
+// XTSMGRAPHICS read of the sixel colour register count
+#define KITTY_QUERY "\033_Gi=31,s=1,v=1,a=q,t=d,f=24;AAAA\033\\"
+#define KITTY_REPLY "\033_Gi=31;OK"
+#define SIXEL_QUERY "\033[?1;1;0S"
+#define SIXEL_REPLY "\033[?1;0;"
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The DA1 reply is CSI ? Ps ; ... c; other replies may share its prefix
+static const char* find_da1_reply(const char* reply) {
+    for (const char* start = strstr(reply, "\033[?"); start; start = strstr(start + 1, "\033[?")) {
+        const char* p = start + 3;
+        while ((*p >= '0' && *p <= '9') || *p == ';') p++;
+        if (*p == 'c') return start;
+    }
+    return NULL;
+}
+
+// Send a query followed by DA1 and collect everything up to the DA1 reply
+static bool term_query(const char* query, char* reply, size_t size) {
+    int fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct termios saved;
+    if (tcgetattr(fd, &saved) != 0) {
+        close(fd);
+        return false;
+    }
+
+    // No echo and no line buffering, so the replies stay off the screen
+    struct termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &raw);
+
+    size_t length = 0;
+    reply[0] = '\0';
+
+    bool sent = write(fd, query, strlen(query)) == (ssize_t)strlen(query) &&
+                write(fd, DA1_QUERY, strlen(DA1_QUERY)) == (ssize_t)strlen(DA1_QUERY);
+
+    long long deadline = now_ms() + TERM_QUERY_TIMEOUT_MS;
+    while (sent && length + 1 < size && !find_da1_reply(reply)) {
+        long long remaining = deadline - now_ms();
+        if (remaining <= 0) break;
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int)remaining) <= 0) break;
+
+        ssize_t n = read(fd, reply + length, size - length - 1);
+        if (n <= 0) break;
+        length += n;
+        reply[length] = '\0';
+    }
+
+    tcsetattr(fd, TCSANOW, &saved);
+    close(fd);
+    return find_da1_reply(reply) != NULL;
+}
+
+bool term_cell_size(int* width, int* height) {
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col && w.ws_row &&
+        w.ws_xpixel && w.ws_ypixel) {
+        *width = w.ws_xpixel / w.ws_col;
+        *height = w.ws_ypixel / w.ws_row;
+        return *width > 0 && *height > 0;
+    }
+
+    if (!isatty(STDOUT_FILENO)) return false;
+
+    // Reply is CSI 6 ; height ; width t
+    char reply[256];
+    if (!term_query("\033[16t", reply, sizeof(reply))) return false;
+
+    const char* start = strstr(reply, "\033[6;");
+    int cell_height, cell_width;
+    if (!start || sscanf(start + 4, "%d;%dt", &cell_height, &cell_width) != 2 ||
+        cell_width <= 0 || cell_height <= 0) {
+        return false;
+    }
+    *width = cell_width;
+    *height = cell_height;
+    return true;
+}
+
+// DA1 lists the terminal's features as CSI ? Ps ; Ps ... c, 4 being sixel
+static bool da1_has_sixel(const char* reply) {
+    const char* start = find_da1_reply(reply);
+    if (!start) return false;
+
+    for (const char* p = start + 3; *p && *p != 'c'; ) {
+        char* end;
+        long feature = strtol(p, &end, 10);
+        if (end == p) break;
+        if (feature == 4) return true;
+        p = *end == ';' ? end + 1 : end;
+    }
+    return false;
+}
+
+// Results are kept per terminal, identified by what it puts in the environment
+static void probe_cache_path(char* path, size_t size) {
+    static const char* identity_variables[] = {
+        "TERM", "TERM_PROGRAM", "TERM_PROGRAM_VERSION", "LC_TERMINAL",
+        "LC_TERMINAL_VERSION", "VTE_VERSION", "KONSOLE_VERSION", NULL
+    };
+
+    char key[1024];
+    size_t length = 0;
+    for (int i = 0; identity_variables[i] && length < sizeof(key); i++) {
+        const char* value = getenv(identity_variables[i]);
+        length += snprintf(key + length, sizeof(key) - length, "%s=%s\n",
+                           identity_variables[i], value ? value : "");
+    }
+    // Only presence matters for these; multiplexers hide the graphics
+    if (length < sizeof(key)) {
+        length += snprintf(key + length, sizeof(key) - length, "tmux=%d\nwt=%d\n",
+                           getenv("TMUX") != NULL, getenv("WT_SESSION") != NULL);
+    }
+    if (length >= sizeof(key)) length = sizeof(key) - 1;
+
+    char hex[MD5_HEX_LENGTH];
+    md5_hex(key, length, hex);
+    snprintf(path, size, "%s/terminals/%s", cache_state_directory(), hex);
+}
+
+static const char* protocol_names[] = {
+    [PROTOCOL_KITTY] = "kitty",
+    [PROTOCOL_SIXEL] = "sixel",
+    [PROTOCOL_LSD] = "lsd",
+};
+
+static bool read_probe_cache(const char* path, GraphicsProtocol* protocol) {
+    struct stat st;
+    if (stat(path, &st) != 0 || time(NULL) - st.st_mtime >= TERM_PROBE_TTL_SECONDS) return false;
+
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+
+    char name[16] = "";
+    bool found = false;
+    if (fscanf(file, "%15s", name) == 1) {
+        for (int i = 0; i < (int)(sizeof(protocol_names) / sizeof(protocol_names[0])); i++) {
+            if (strcmp(name, protocol_names[i]) == 0) {
+                *protocol = (GraphicsProtocol)i;
+                found = true;
+            }
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+static void write_probe_cache(const char* path, GraphicsProtocol protocol) {
+    char dir[MAX_PATH_LENGTH + 16];
+    snprintf(dir, sizeof(dir), "%s/terminals", cache_state_directory());
+    ensure_cache_directory();
+    mkdir(dir, 0755);
+
+    char temp_path[MAX_PATH_LENGTH + 96];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    FILE* file = fopen(temp_path, "w");
+    if (!file) return;
+
+    bool ok = fprintf(file, "%s\n", protocol_names[protocol]) > 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path, path) != 0) unlink(temp_path);
+}
+
+bool term_probe_graphics(GraphicsProtocol* protocol) {
+    if (!isatty(STDOUT_FILENO)) return false;
+
+    char cache_path[MAX_PATH_LENGTH + 64];
+    probe_cache_path(cache_path, sizeof(cache_path));
+    if (read_probe_cache(cache_path, protocol)) return true;
+
+    char reply[512];
+    if (!term_query(KITTY_QUERY SIXEL_QUERY, reply, sizeof(reply))) return false;
+
+    if (strstr(reply, KITTY_REPLY)) {
+        *protocol = PROTOCOL_KITTY;
+    } else if (strstr(reply, SIXEL_REPLY) || da1_has_sixel(reply)) {
+        *protocol = PROTOCOL_SIXEL;
+    } else {
+        *protocol = PROTOCOL_LSD;
+    }
+
+    if (getenv("DEBUG_ICONS")) {
+        fprintf(stderr, "Probed terminal graphics: %s\n", protocol_names[*protocol]);
+    }
+    write_probe_cache(cache_path, *protocol);
+    return true;
+}
@@ -0,0 +1,22 @@
+#ifndef TERM_H
+#define TERM_H
+
+#include <stdbool.h>
+#include "config.h"
+
+// Queries about the controlling terminal. Replies are read from /dev/tty
+// with a short timeout, and every query is followed by a DA1 request that
+// all terminals answer, so a terminal that ignores the query costs one
+// round trip instead of the whole timeout.
+
+// Pixel size of one character cell, from TIOCGWINSZ or else CSI 16 t
+bool term_cell_size(int* width, int* height);
+
+// Ask the terminal which graphics it supports: a kitty a=q query, then
+// XTSMGRAPHICS and the DA1 feature list for sixel. The answer is cached in
+// ~/.local/share/ils/terminals per terminal identity (TERM, TERM_PROGRAM
+// and friends) for TERM_PROBE_TTL_SECONDS. False when stdout is not a
+// terminal or nothing answered.
+bool term_probe_graphics(GraphicsProtocol* protocol);
+
+#endif
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "logo.h"
+#include "md5.h"
+#include "png.h"
+#include "cache.h"
+#include "thumbnail.h"
+#include "profile.h"
+#include "trace.h"
+#include "hashmap.h"
+
+typedef struct {
+    const char* name;
+    int size;
+} ThumbnailFlavor;
+
+typedef struct {
+    char* source_path;
+    char* thumbnail_path;
+} ThumbnailJob;
+
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThumbnailJob* deferred_jobs = NULL;
+static int deferred_count = 0;
+static int deferred_capacity = 0;
+static HashMap* deferred_set = NULL;    // Thumbnail paths already queued
+
+static const ThumbnailFlavor thumbnail_flavors[] = {
+    {"normal", 128},
+    {"large", 256},
+    {"x-large", 512},
+    {"xx-large", 1024},
+    {NULL, 0}
+};
+
+static const ThumbnailFlavor* thumbnail_flavor(void) {
+    int i = 0;
+    while (thumbnail_flavors[i + 1].name && thumbnail_flavors[i].size < current_icon_size) {
+        i++;
+    }
+    return &thumbnail_flavors[i];
+}
+
+static void get_thumbnail_root(char* root, size_t size) {
+    const char* cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home && cache_home[0] == '/') {
+        snprintf(root, size, "%s/thumbnails", cache_home);
+        return;
+    }
+
+    const char* home = getenv("HOME");
+    if (!home) {
+        struct passwd *pw = getpwuid(getuid());
+        home = pw ? pw->pw_dir : "/tmp";
+    }
+    snprintf(root, size, "%s/.cache/thumbnails", home);
+}
+
+// Escape an absolute path into a file:// URI the way GLib does, so the MD5
+// matches the thumbnails written by GNOME/KDE file managers.
+static bool path_to_uri(const char* path, char* uri, size_t size) {
+    static const char allowed[] = "!$&'()*+,-./:=@_~";
+    static const char digits[] = "0123456789ABCDEF";
+
+    size_t pos = snprintf(uri, size, "file://");
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        if (pos + 4 > size) return false;
+
+        if (isalnum(*p) || (*p && strchr(allowed, *p))) {
+            uri[pos++] = *p;
+        } else {
+            uri[pos++] = '%';
+            uri[pos++] = digits[*p >> 4];
+            uri[pos++] = digits[*p & 0x0f];
+        }
+    }
+    uri[pos] = '\0';
+    return true;
+}
+
+char* get_thumbnail_path(const char* filename) {
+    char absolute[PATH_MAX];
+    if (!realpath(filename, absolute)) return NULL;
+
+    char uri[PNG_TEXT_VALUE_MAX];
+    if (!path_to_uri(absolute, uri, sizeof(uri))) return NULL;
+
+    char hash[MD5_HEX_LENGTH];
+    md5_hex(uri, strlen(uri), hash);
+
+    char root[MAX_PATH_LENGTH];
+    get_thumbnail_root(root, sizeof(root));
+
+    char* thumbnail_path = malloc(MAX_PATH_LENGTH);
+    if (!thumbnail_path) return NULL;
+
+    snprintf(thumbnail_path, MAX_PATH_LENGTH, "%.*s/%s/%s.png",
+             MAX_PATH_LENGTH - 64, root, thumbnail_flavor()->name, hash);
+    return thumbnail_path;
+}
+
+// A thumbnail is only valid if it was made from this file at its current
+// modification time (and size, when the writer recorded it).
+bool thumbnail_is_valid(const char* source_path, const char* thumbnail_path) {
+    if (!source_path || !thumbnail_path) return false;
+
+    struct stat source_stat;
+    profile_count(PROFILE_STATS, 1);
+    if (stat(source_path, &source_stat) != 0) return false;
+
+    // The file name is only a hash of the URI, so check whose thumbnail it is
+    char absolute[PATH_MAX];
+    char uri[PNG_TEXT_VALUE_MAX];
+    if (!realpath(source_path, absolute) || !path_to_uri(absolute, uri, sizeof(uri))) return false;
+
+    PngTextField fields[] = {
+        {.key = "Thumb::URI"},
+        {.key = "Thumb::MTime"},
+        {.key = "Thumb::Size"},
+    };
+    if (!png_read_text(thumbnail_path, fields, 3) || !fields[0].found || !fields[1].found) return false;
+
+    if (strcmp(fields[0].value, uri) != 0) return false;
+    if (strtoll(fields[1].value, NULL, 10) != (long long)source_stat.st_mtime) return false;
+    if (fields[2].found && strtoll(fields[2].value, NULL, 10) != (long long)source_stat.st_size) return false;
+
+    return true;
+}
+
+static void ensure_thumbnail_directory(const char* thumbnail_path) {
+    char* dir_copy = strdup(thumbnail_path);
+    if (!dir_copy) return;
+
+    char* last = strrchr(dir_copy, '/');
+    if (last) *last = '\0';
+
+    // Spec asks for private directories, files are chmod'ed to 0600 below
+    char* slash = strchr(dir_copy + 1, '/');
+    while (slash) {
+        *slash = '\0';
+        mkdir(dir_copy, 0700);
+        *slash = '/';
+        slash = strchr(slash + 1, '/');
+    }
+    mkdir(dir_copy, 0700);
+    free(dir_copy);
+}
+
+// A stale thumbnail in place is not somebody else's finished fill
+static bool thumbnail_is_current(const char* thumbnail_path, const void* source_path) {
+    return thumbnail_is_valid(source_path, thumbnail_path);
+}
+
+static const char* thumbnail_tool(const char* source_path) {
+    const char* extension = get_file_extension(source_path);
+    return extension && strcasecmp(extension, ".svg") == 0 ? "rsvg-convert" : "convert";
+}
+
+bool generate_thumbnail(const char* source_path, const char* thumbnail_path) {
+    if (!source_path || !thumbnail_path) return false;
+
+    if (thumbnail_is_valid(source_path, thumbnail_path)) {
+        return true;
+    }
+
+    char absolute[PATH_MAX];
+    struct stat source_stat;
+    if (!realpath(source_path, absolute) || stat(absolute, &source_stat) != 0) return false;
+
+    // Never thumbnail the thumbnails themselves
+    char root[MAX_PATH_LENGTH];
+    get_thumbnail_root(root, sizeof(root));
+    if (strncmp(absolute, root, strlen(root)) == 0) return false;
+
+    PngTextField fields[4] = {
+        {.key = "Thumb::URI"},
+        {.key = "Thumb::MTime"},
+        {.key = "Thumb::Size"},
+        {.key = "Software"},
+    };
+    if (!path_to_uri(absolute, fields[0].value, sizeof(fields[0].value))) return false;
+    snprintf(fields[1].value, sizeof(fields[1].value), "%lld", (long long)source_stat.st_mtime);
+    snprintf(fields[2].value, sizeof(fields[2].value), "%lld", (long long)source_stat.st_size);
+    snprintf(fields[3].value, sizeof(fields[3].value), "ils");
+
+    int size = thumbnail_flavor()->size;
+    const char* tool = thumbnail_tool(source_path);
+    bool is_svg = strcmp(tool, "rsvg-convert") == 0;
+
+    if (cache_known_failure("thumbnail", absolute, size, tool)) return false;
+
+    ensure_thumbnail_directory(thumbnail_path);
+
+    // Spec requires writing to a temporary file and renaming it in place;
+    // the cache fill also keeps concurrent ils runs from duplicating work
+    CacheFill fill;
+    if (!cache_begin_refill(thumbnail_path, &fill, thumbnail_is_current, source_path)) {
+        return thumbnail_is_valid(source_path, thumbnail_path);
+    }
+    const char* temp_path = fill.temp_path;
+
+    char cmd[PATH_MAX * 2 + MAX_PATH_LENGTH + 100];
+
+    if (is_svg) {
+        // Use rsvg-convert for SVG files
+        snprintf(cmd, sizeof(cmd),
+                "rsvg-convert \"%s\" -o \"%s\" --width=%d --height=%d --keep-aspect-ratio 2>/dev/null",
+                absolute, temp_path, size, size);
+    } else {
+        // Use ImageMagick for other formats
+        snprintf(cmd, sizeof(cmd),
+                "convert \"%s[0]\" -thumbnail %dx%d \"PNG32:%s\" 2>/dev/null",
+                absolute, size, size, temp_path);
+    }
+
+    profile_count(PROFILE_SPAWNS, 1);
+    long long start = trace_now();
+    bool produced = system(cmd) == 0 && png_write_text(temp_path, fields, 4) &&
+                    chmod(temp_path, 0600) == 0;
+    trace_span("raster", "thumbnail", absolute, start);
+    if (!produced) {
+        cache_record_failure("thumbnail", absolute, size, tool);
+    }
+    return cache_end_fill(thumbnail_path, &fill, produced);
+}
+
+static bool thumbnail_queued(const char* thumbnail_path) {
+    if (!deferred_set) deferred_set = hashmap_create(INITIAL_CAPACITY);
+    return deferred_set && hashmap_get(deferred_set, thumbnail_path);
+}
+
+void thumbnail_defer(const char* source_path, const char* thumbnail_path) {
+    // A daemon sees the same images again before the generator runs
+    pthread_mutex_lock(&deferred_lock);
+    bool queued = thumbnail_queued(thumbnail_path);
+    pthread_mutex_unlock(&deferred_lock);
+    if (queued) return;
+
+    // The generator outlives this listing, so pin the source down now
+    char* absolute = realpath(source_path, NULL);
+    char* thumbnail = strdup(thumbnail_path);
+    // Images that failed before would only cost a generator that gives up
+    if (!absolute || !thumbnail ||
+        cache_known_failure("thumbnail", absolute, thumbnail_flavor()->size, thumbnail_tool(source_path))) {
+        free(absolute);
+        free(thumbnail);
+        return;
+    }
+
+    pthread_mutex_lock(&deferred_lock);
+    if (thumbnail_queued(thumbnail)) {
+        pthread_mutex_unlock(&deferred_lock);
+        free(absolute);
+        free(thumbnail);
+        return;
+    }
+    if (deferred_count >= deferred_capacity) {
+        int capacity = deferred_capacity ? deferred_capacity * 2 : INITIAL_CAPACITY;
+        ThumbnailJob* tmp = realloc(deferred_jobs, capacity * sizeof(ThumbnailJob));
+        if (!tmp) {
+            pthread_mutex_unlock(&deferred_lock);
+            free(absolute);
+            free(thumbnail);
+            return;
+        }
+        deferred_jobs = tmp;
+        deferred_capacity = capacity;
+    }
+    deferred_jobs[deferred_count].source_path = absolute;
+    deferred_jobs[deferred_count].thumbnail_path = thumbnail;
+    deferred_count++;
+    if (deferred_set) hashmap_put(deferred_set, thumbnail, thumbnail);
+    pthread_mutex_unlock(&deferred_lock);
+}
+
+// Hand the queued jobs to a detached generator; call once output is done
+void thumbnail_run_deferred(void) {
+    pthread_mutex_lock(&deferred_lock);
+
+    if (deferred_count > 0 && cache_fork_detached()) {
+        for (int i = 0; i < deferred_count; i++) {
+            if (generate_thumbnail(deferred_jobs[i].source_path, deferred_jobs[i].thumbnail_path)) {
+                cache_filled(deferred_jobs[i].thumbnail_path);
+            }
+        }
+        cache_finish();
+        _exit(0);
+    }
+
+    for (int i = 0; i < deferred_count; i++) {
+        free(deferred_jobs[i].source_path);
+        free(deferred_jobs[i].thumbnail_path);
+    }
+    free(deferred_jobs);
+    deferred_jobs = NULL;
+    deferred_count = deferred_capacity = 0;
+    if (deferred_set) hashmap_clear(deferred_set, NULL);
+
+    pthread_mutex_unlock(&deferred_lock);
+}
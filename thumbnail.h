@@ -0,0 +1,18 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include <stdbool.h>
+
+// Thumbnails follow the freedesktop.org thumbnail managing standard so they
+// are shared with file managers: ~/.cache/thumbnails/{normal,large,...}/
+// <md5 of file URI>.png, validated through Thumb::URI and Thumb::MTime.
+
+char* get_thumbnail_path(const char* filename);
+bool thumbnail_is_valid(const char* source_path, const char* thumbnail_path);
+bool generate_thumbnail(const char* source_path, const char* thumbnail_path);
+
+// Deferred mode: queue jobs while listing, generate them in the background
+void thumbnail_defer(const char* source_path, const char* thumbnail_path);
+void thumbnail_run_deferred(void);
+
+#endif
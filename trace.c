@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} TraceBuffer;
+
+bool trace_enabled = false;
+
+static char* trace_path = NULL;
+static long long trace_origin = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer events = {0};
+static __thread int trace_tid = 0;
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static bool reserve(TraceBuffer* buffer, size_t extra) {
+    if (buffer->length + extra <= buffer->capacity) return true;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 65536;
+    while (capacity < buffer->length + extra) capacity *= 2;
+    char* tmp = realloc(buffer->data, capacity);
+    if (!tmp) return false;
+    buffer->data = tmp;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static void append(TraceBuffer* buffer, const char* text) {
+    size_t length = strlen(text);
+    if (!reserve(buffer, length)) return;
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+}
+
+// JSON string escaping for paths and names
+static void append_string(TraceBuffer* buffer, const char* text) {
+    append(buffer, "\"");
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++) {
+        char escaped[8];
+        if (*p == '"' || *p == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", *p);
+        } else if (*p < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *p);
+        } else {
+            escaped[0] = (char)*p;
+            escaped[1] = '\0';
+        }
+        append(buffer, escaped);
+    }
+    append(buffer, "\"");
+}
+
+static int current_tid(void) {
+    if (trace_tid == 0) trace_tid = (int)syscall(SYS_gettid);
+    return trace_tid;
+}
+
+void trace_start(void) {
+    const char* path = getenv("ILS_TRACE");
+    if (!path || !path[0]) return;
+
+    trace_path = strdup(path);
+    if (!trace_path) return;
+    trace_origin = monotonic_us();
+    trace_enabled = true;
+
+    char text[128];
+    snprintf(text, sizeof(text),
+             "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"main\"}}",
+             (int)getpid(), current_tid());
+    append(&events, text);
+}
+
+long long trace_now(void) {
+    return trace_enabled ? monotonic_us() - trace_origin : 0;
+}
+
+void trace_span(const char* category, const char* name, const char* detail, long long start) {
+    if (!trace_enabled) return;
+
+    long long end = trace_now();
+    bool first_span = trace_tid == 0;
+    int tid = current_tid();
+    char text[160];
+
+    pthread_mutex_lock(&trace_lock);
+    if (first_span) {
+        snprintf(text, sizeof(text),
+                 ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+                 (int)getpid(), tid, tid);
+        append(&events, text);
+    }
+    append(&events, ",\n{\"cat\":");
+    append_string(&events, category);
+    append(&events, ",\"name\":");
+    append_string(&events, name);
+    snprintf(text, sizeof(text), ",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+             start, end - start, (int)getpid(), tid);
+    append(&events, text);
+    if (detail) {
+        append(&events, ",\"args\":{\"detail\":");
+        append_string(&events, detail);
+        append(&events, "}");
+    }
+    append(&events, "}");
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_finish(void) {
+    if (!trace_enabled) return;
+    trace_enabled = false;
+
+    FILE* file = fopen(trace_path, "w");
+    if (file) {
+        fputs("{\"traceEvents\":[\n", file);
+        if (events.data) fwrite(events.data, 1, events.length, file);
+        fputs("\n],\"displayTimeUnit\":\"ms\"}\n", file);
+        if (fclose(file) != 0) {
+            fprintf(stderr, "ils: cannot write trace to %s\n", trace_path);
+        }
+    } else {
+        fprintf(stderr, "ils: cannot write trace to %s\n", trace_path);
+    }
+
+    free(events.data);
+    memset(&events, 0, sizeof(events));
+    free(trace_path);
+    trace_path = NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+// With ILS_TRACE=path.json set, spans are collected in memory and written
+// at exit as Chrome trace-event JSON, which chrome://tracing and Perfetto
+// load directly. Each span records the thread it ran on, so work done on
+// enumeration threads shows up on its own track.
+
+extern bool trace_enabled;
+
+void trace_start(void);
+void trace_finish(void);
+
+// Microseconds since tracing started, or 0 when tracing is off
+long long trace_now(void);
+
+// Record a span that began at `start` (from trace_now) and ends now.
+// `detail` is optional and shown as the span's argument.
+void trace_span(const char* category, const char* name, const char* detail, long long start);
+
+#endif
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "config.h"
+#include "hashmap.h"
+#include "watch.h"
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+                      IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static const int watched_signals[] = { SIGWINCH, SIGINT, SIGTERM, SIGHUP };
+#define WATCHED_SIGNAL_COUNT (int)(sizeof(watched_signals) / sizeof(watched_signals[0]))
+
+static int inotify_fd = -1;
+static sigset_t saved_mask;
+static sigset_t wait_mask;
+static struct sigaction saved_actions[WATCHED_SIGNAL_COUNT];
+static volatile sig_atomic_t resized = 0;
+static volatile sig_atomic_t stopped = 0;
+
+static HashMap* seen = NULL;
+static char** names = NULL;
+static int name_count = 0;
+static int name_capacity = 0;
+
+static void on_signal(int signal_number) {
+    if (signal_number == SIGWINCH) {
+        resized = 1;
+    } else {
+        stopped = 1;
+    }
+}
+
+bool watch_start(const char* directory) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        fprintf(stderr, "ils: inotify: %s\n", strerror(errno));
+        return false;
+    }
+    if (inotify_add_watch(inotify_fd, directory, WATCH_EVENTS) < 0) {
+        fprintf(stderr, "ils: cannot watch '%s': %s\n", directory, strerror(errno));
+        close(inotify_fd);
+        inotify_fd = -1;
+        return false;
+    }
+
+    seen = hashmap_create(256);
+    if (!seen) {
+        close(inotify_fd);
+        inotify_fd = -1;
+        return false;
+    }
+
+    // The signals stay blocked except inside ppoll(), so none can slip in
+    // between checking the flags and going to sleep
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    for (int i = 0; i < WATCHED_SIGNAL_COUNT; i++) {
+        sigaddset(&blocked, watched_signals[i]);
+    }
+    sigprocmask(SIG_BLOCK, &blocked, &saved_mask);
+    wait_mask = saved_mask;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    for (int i = 0; i < WATCHED_SIGNAL_COUNT; i++) {
+        sigdelset(&wait_mask, watched_signals[i]);
+        sigaction(watched_signals[i], &action, &saved_actions[i]);
+    }
+    return true;
+}
+
+static void add_name(const char* name) {
+    if (hashmap_get(seen, name)) return;
+
+    if (name_count == name_capacity) {
+        int capacity = name_capacity ? name_capacity * 2 : 64;
+        char** tmp = realloc(names, capacity * sizeof(char*));
+        if (!tmp) return;
+        names = tmp;
+        name_capacity = capacity;
+    }
+
+    char* copy = strdup(name);
+    if (!copy) return;
+    names[name_count++] = copy;
+    hashmap_put(seen, name, copy);
+}
+
+// Hidden entries are skipped, as the listing never shows them
+static void read_events(WatchUpdate* update) {
+    union {
+        struct inotify_event event;
+        char bytes[16384];
+    } buffer;
+
+    ssize_t length;
+    while ((length = read(inotify_fd, buffer.bytes, sizeof(buffer.bytes))) > 0) {
+        for (char* next = buffer.bytes; next < buffer.bytes + length; ) {
+            struct inotify_event* event = (struct inotify_event*)next;
+            if (event->mask & IN_Q_OVERFLOW) {
+                update->rescan = true;
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                update->stopped = true;
+            } else if (event->len > 0 && event->name[0] != '.') {
+                add_name(event->name);
+            }
+            next += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void watch_wait(WatchUpdate* update) {
+    for (int i = 0; i < name_count; i++) {
+        free(names[i]);
+    }
+    name_count = 0;
+    hashmap_clear(seen, NULL);
+    memset(update, 0, sizeof(*update));
+
+    // Sleep until the first change, then keep collecting until the
+    // settle time is up
+    long long deadline = -1;
+    while (!update->stopped) {
+        struct timespec timeout;
+        if (deadline >= 0) {
+            long long remaining = deadline - monotonic_ms();
+            if (remaining <= 0) break;
+            timeout.tv_sec = remaining / 1000;
+            timeout.tv_nsec = (remaining % 1000) * 1000000;
+        }
+
+        struct pollfd poller = { inotify_fd, POLLIN, 0 };
+        int ready = ppoll(&poller, 1, deadline >= 0 ? &timeout : NULL, &wait_mask);
+        if (ready < 0 && errno != EINTR) update->stopped = true;
+        if (stopped) update->stopped = true;
+        if (resized) {
+            resized = 0;
+            update->resized = true;
+        }
+        if (ready > 0) read_events(update);
+
+        if (deadline < 0 && (update->resized || update->rescan || name_count > 0)) {
+            deadline = monotonic_ms() + WATCH_SETTLE_MS;
+        }
+    }
+
+    update->names = names;
+    update->count = name_count;
+}
+
+void watch_stop(void) {
+    if (inotify_fd < 0) return;
+
+    close(inotify_fd);
+    inotify_fd = -1;
+    // Anything still pending goes to our handler before the old one is back
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    for (int i = 0; i < WATCHED_SIGNAL_COUNT; i++) {
+        sigaction(watched_signals[i], &saved_actions[i], NULL);
+    }
+
+    for (int i = 0; i < name_count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    names = NULL;
+    name_count = name_capacity = 0;
+    hashmap_free(seen, NULL);
+    seen = NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+
+// `ils --watch` keeps one directory's listing on screen and follows it
+// with inotify. Once something happens, events are collected for
+// WATCH_SETTLE_MS more, so a burst of changes turns into a single redraw.
+
+typedef struct {
+    char** names;       // Entries that changed, each named once
+    int count;
+    bool rescan;        // Events were lost; every entry has to be checked
+    bool resized;       // The terminal window changed size
+    bool stopped;       // Interrupted, or the directory itself went away
+} WatchUpdate;
+
+bool watch_start(const char* directory);
+
+// Blocks until there is something to report. The names stay valid until
+// the next call.
+void watch_wait(WatchUpdate* update);
+void watch_stop(void);
+
+#endif